@@ -242,6 +242,9 @@ consoleintr(int (*getc)(void)) {
             case C('P'):  // Process listing.
                 procdump();
                 break;
+            case C('N'):  // Network driver counters.
+                net_debug();
+                break;
             case C('U'):  // Kill line.
                 while (input.e != input.w &&
                        input.buf[(input.e - 1) % INPUT_BUF] != '\n') {
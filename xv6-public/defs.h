@@ -10,6 +10,11 @@ struct sleeplock;
 struct stat;
 struct superblock;
 struct trapframe;
+struct mbuf;
+struct netstat;
+struct pci_func;
+struct netdev;
+struct rtentry;
 
 // entry.S
 void
@@ -119,6 +124,62 @@ kinit1(void*, void*);
 void
 kinit2();
 
+// pktbuf.c
+void
+pktbuf_init(void);
+char*
+pktbuf_alloc(void);
+void
+pktbuf_free(char*);
+void*
+netobj_alloc(void);
+void
+netobj_free(void*);
+void
+pktbuf_dump(void);
+
+// mbuf.c
+int
+mbuf_extfree_register(void (*)(char*));
+struct mbuf*
+mbuf_wrap(char*, int, int);
+struct mbuf*
+mbuf_alloc(int);
+struct mbuf*
+mbuf_free(struct mbuf*);
+void
+mbuf_freem(struct mbuf*);
+struct mbuf*
+mbuf_clone(struct mbuf*);
+struct mbuf*
+mbuf_slice(struct mbuf*, int, int);
+char*
+mbuf_prepend(struct mbuf*, int);
+char*
+mbuf_pull(struct mbuf*, int);
+char*
+mbuf_append(struct mbuf*, int);
+void
+mbuf_trim(struct mbuf*, int);
+int
+mbuf_pktlen(struct mbuf*);
+
+// rtable.c
+void
+rt_init(void);
+int
+rt_add(struct rtentry*);
+int
+rt_del(uint32, int);
+int
+rt_get(int, struct rtentry*);
+int
+rt_lookup(uint32, struct rtentry*);
+int
+rt_bench(uint32, int, int, int);
+void
+rt_getstats(struct netstat*);
+
 // kbd.c
 void
 kbdintr(void);
@@ -171,6 +232,8 @@ fork(void);
 int growproc(int64);
 int
 kill(int);
+int
+kthread(char*, void (*)(void*), void*);
 void
 pinit(void);
 void
@@ -267,6 +330,12 @@ extern uint ticks;
 void
 tvinit(void);
 extern struct spinlock tickslock;
+int
+irq_register(int, void (*)(void));
+int
+irq_alloc(void (*)(void));
+void
+irq_free(int);
 
 // uart.c
 void
@@ -316,18 +385,58 @@ void
 pci_init();
 
 // e1000.c
+int
+e1000_attach(struct pci_func*);
 void
 e1000_init(uint32*);
 void
 e1000_intr(void);
 int
-e1000_transmit(char*, int);
+e1000_transmit(struct mbuf*);
+int
+e1000_transmit_batch(struct mbuf**, int);
+int
+e1000_mtu(void);
+void
+e1000_getstats(struct netstat*);
+int
+e1000_mcast_add(uchar*);
+int
+e1000_mcast_del(uchar*);
+void
+e1000_dump(void);
+int
+e1000_ctl(int, int);
+
+// e1000e.c
+int
+e1000e_attach(struct pci_func*);
+int
+e1000e_transmit(struct mbuf*);
+int
+e1000e_transmit_batch(struct mbuf**, int);
+int
+e1000e_mtu(void);
+int
+e1000e_ctl(int, int);
+void
+e1000e_getstats(struct netstat*);
+void
+e1000e_dump(void);
+
+// virtio_net.c
+int
+virtio_net_attach(struct pci_func*);
 
 // net.c
 void
 netinit(void);
 void
-net_rx(char* buf, int len);
+netdev_register(struct netdev*);
+void
+net_timer(void);
+void
+net_rx(struct mbuf*);
 
 
 
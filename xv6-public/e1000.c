@@ -12,22 +12,354 @@
 #include "proc.h"
 #include "defs.h"
 #include "e1000_dev.h"
+#include "mbuf.h"
+#include "netctl.h"
+#include "netdev.h"
+#include "netstat.h"
+#include "net.h"
+#include "pci.h"
 
-#define TX_RING_SIZE 16
-static struct tx_desc tx_ring[TX_RING_SIZE] __attribute__((aligned(16)));
+// Ring sizes are chosen at boot (E1000_TXRING / E1000_RXRING in the
+// Makefile, passed to this file only) and clamped by ring_size_ok().
+// The 82540EM takes up to 4096 descriptors per ring, and TDLEN/RDLEN
+// must be a multiple of 128 bytes, i.e. the descriptor count must be
+// a multiple of 8.
+#define RING_SIZE_MAX 4096
+#ifndef E1000_TXRING
+#define E1000_TXRING 256
+#endif
+#ifndef E1000_RXRING
+#define E1000_RXRING 256
+#endif
 
-#define RX_RING_SIZE 16
-static struct rx_desc rx_ring[RX_RING_SIZE] __attribute__((aligned(16)));
+// Ring memory lives in the kernel image so that each ring is physically
+// contiguous (kalloc() only hands out single pages). Page alignment
+// satisfies the 16-byte base / 128-byte length rules for TDBAL/RDBAL.
+static struct tx_desc tx_ring[RING_SIZE_MAX] __attribute__((aligned(PGSIZE)));
+static struct rx_desc rx_ring[RING_SIZE_MAX] __attribute__((aligned(PGSIZE)));
 
-static char* tx_bufs[TX_RING_SIZE];  // transmit buffer
-static char* rx_bufs[RX_RING_SIZE];  // receiver buffer
+static struct mbuf* tx_bufs[RING_SIZE_MAX];  // transmit buffer
+static char* rx_bufs[RING_SIZE_MAX];  // receiver buffer
+
+static uint32 tx_ring_size;  // descriptors in use in tx_ring
+static uint32 rx_ring_size;  // descriptors in use in rx_ring
+
+// Shadow TX ring indices, protected by e1000_lock. tx_tail mirrors
+// TDT so the hot path never reads it back over MMIO; descriptors
+// from tx_clean up to tx_tail are owned by the NIC or not yet freed.
+static uint32 tx_tail;   // next descriptor to fill
+static uint32 tx_clean;  // oldest descriptor not yet reclaimed
+
+// Ask for a status write-back on every Nth TX descriptor only, and
+// reclaim finished buffers once this many descriptors are in use.
+// The threshold keeps few buffers parked in the ring when idle.
+#define TX_RS_INTERVAL 8
+#define TX_RECLAIM_THRESH 16
+
+// Transmit checksum offload (NETCTL_TXCSUM). The NIC remembers the
+// last context descriptor, so tx_ctx_key caches what it holds and a
+// new context is only queued when the header layout changes.
+static int tx_csum_offload = 1;
+static int tx_ctx_valid;
+static uint32 tx_ctx_key;
+
+// Jumbo frames (NETCTL_MTU). RX buffers are 2048-byte pktbufs
+// (SZ_2048), so a frame longer than that arrives spread over several
+// descriptors, the last marked EOP. e1000_recv() gathers the pieces
+// into one of these buffers, as neither kalloc() nor the pktbuf pool
+// gives out anything bigger than a page; mbuf_free() hands it back
+// to rx_jumbo_put(), which e1000 registers as an mbuf extfree hook.
+// The free list has a lock of its own, taken after e1000_lock: a
+// jumbo buffer can be sent (an echo reply goes out in the request's
+// buffer), and tx_reclaim() then frees it with e1000_lock held.
+#define RX_JUMBO_BUFS 8
+#define RX_JUMBO_SIZE (3 * PGSIZE)  // >= E1000_MAX_MTU + headers
+static char rx_jumbo[RX_JUMBO_BUFS][RX_JUMBO_SIZE];
+static struct spinlock rx_jumbo_lock;  // protects the two below
+static char* rx_jumbo_free[RX_JUMBO_BUFS];
+static int rx_jumbo_cnt;
+static int rx_jumbo_extfree;  // extfree number of rx_jumbo_put()
+static char* rx_frag;     // frame being gathered, or 0
+static int rx_frag_len;   // bytes gathered so far
+static int rx_frag_drop;  // drop descriptors up to the next EOP
+static int mtu = ETH_MTU;
+
+static char*
+rx_jumbo_get(void);
+static void
+rx_jumbo_put(char* buf);
+
+// Joined multicast MAC addresses, reference counted since several
+// IP groups can share one MAC. The first E1000_RA_ENTRIES-1 use the
+// spare exact-match RA slots; the rest set a bit in the MTA hash
+// table, which may let some unjoined groups through too. mta[]
+// shadows the hardware table so only changed words get written.
+#define MCAST_MAX 32
+static struct {
+    uchar mac[ETHADDR_LEN];
+    int refs;
+} mcast[MCAST_MAX];
+static uint32 mta[E1000_MTA_ENTRIES];
+
+// Counters for the receive path; dumped by e1000_dump().
+static struct {
+    uint64 interrupts;   // e1000_intr() calls
+    uint64 intr_cpu[NCPU];  // ... on each CPU
+    uint64 irq_moves;    // times the interrupt was steered elsewhere
+    uint64 rx_packets;   // frames handed to net_rx()
+    uint64 rx_bytes;
+    uint64 tx_bytes;
+    uint64 tx_errors;    // frames too long or in too many mbufs
+    uint64 rx_zerocopy;  // frames handed up by loaning the DMA buffer
+    uint64 rx_nomem;     // frames dropped: no pktbuf to refill with
+    uint64 itr_changes;  // adaptive moderation level switches
+    uint64 tx_packets;   // frames queued for transmit
+    uint64 tx_doorbells; // TDT writes (one per batch)
+    uint64 tx_reclaimed; // transmit buffers freed after completion
+    uint64 tx_ring_full; // batches cut short by a full TX ring
+    uint64 tx_sg_frames; // frames sent as more than one fragment
+    uint64 tx_csum_offload;  // frames with NIC-inserted checksums
+    uint64 tx_ctx_loads; // context descriptors queued
+    uint64 rx_csum_ok;   // frames whose checksums the NIC verified
+    uint64 rx_csum_bad;  // frames the NIC flagged as corrupt
+    uint64 rx_jumbo;     // frames gathered from several descriptors
+    uint64 rx_jumbo_drop;   // multi-descriptor frames dropped
+    uint64 rx_polls;     // interrupts handed over to the poll thread
+    uint64 rx_poll_yields;  // poll passes that used their whole budget
+    uint64 tx_stalls;    // TX stalls caught by e1000_watchdog()
+    uint64 ring_resets;  // ring resets, by the watchdog or netctl
+    uint64 tx_reset_freed;  // queued TX frames dropped by a reset
+} e1000_stats;
+
+// TX watchdog state, see e1000_watchdog(). The NIC counts as
+// stalled when TDH hasn't moved for WD_STALL_CHECKS checks in a
+// row although descriptors are queued up to TDT.
+#define WD_STALL_CHECKS 2
+static uint32 wd_tdh;  // TDH at the last check
+static int wd_stuck;   // checks in a row without progress
+
+// The NIC's statistics registers clear when read, so every read
+// is added in here; see hwstats_update().
+static struct {
+    uint64 gprc, gorc, gptc, gotc, mpc, rnbc, crcerrs, colc;
+} hwstats;
 
 // remember where the e1000's registers live.
 static volatile uint32* regs;
 
 struct spinlock e1000_lock;
 
-// called by pci_init().
+// Held for a whole receive pass, so that passes from the interrupt
+// handler, the poll thread and rx_poll() don't interleave and
+// frames reach the stack in ring order. Taken before e1000_lock.
+static struct spinlock e1000_rxlock;
+
+// Interrupt moderation [E1000 3.2.7, 13.4.18].
+// In adaptive mode e1000_itr_update() picks a level from the smoothed
+// receive packet rate: interrupt per packet when traffic is light,
+// delayed and throttled interrupts when it is heavy. A level is left
+// for a lower one only once the rate falls below half of that lower
+// level's limit, so the setting doesn't flap around a boundary.
+static const struct {
+    uint32 maxpps;  // highest packet rate this level is used for
+    uint32 itr;     // ITR: min gap between interrupts, 256ns units
+    uint32 rdtr;    // RX packet delay timer, 1.024us units
+    uint32 radv;    // RX absolute delay timer, 1.024us units
+} itr_levels[] = {
+    {2000, 0, 0, 0},                // lowest latency: no moderation
+    {20000, 195, 8, 32},            // low latency: <= ~20000 ints/s
+    {0xffffffff, 976, 32, 128},     // bulk: <= ~4000 ints/s
+};
+
+static int itr_mode = NETCTL_ITR_ADAPTIVE;  // or fixed ints/s cap
+static int itr_level;       // current adaptive level
+static uint itr_tick;       // ticks at the last rate sample
+static uint32 itr_pkts;     // packets received since itr_tick
+static uint32 itr_pps;      // smoothed packet rate
+
+// Interrupt-then-poll receive (NAPI style). When rx_budget > 0 the
+// interrupt handler masks RX interrupts and wakes e1000_poll(), which
+// handles at most rx_budget frames per pass and yields in between.
+// RX interrupts are unmasked only once a pass finds the ring empty.
+#define RX_BUDGET_DEFAULT 64
+static int rx_budget = RX_BUDGET_DEFAULT;  // 0: receive in the interrupt
+static int rx_poll_running;  // is the poll thread started?
+static int rx_poll_pending;  // has the interrupt handed the ring over?
+static struct spinlock rx_poll_lock;
+
+// Interrupt steering (NETCTL_IRQCPU). irq_mode is a fixed CPU, or
+// NETCTL_IRQ_RR / NETCTL_IRQ_LEAST, in which case e1000_irq_balance()
+// picks a new CPU every IRQ_BALANCE_TICKS. Moving it on every
+// interrupt would cost config writes and cache locality for nothing.
+#define IRQ_BALANCE_TICKS 10
+static struct pci_func* e1000_pcif;
+static int irq_mode = 0;          // CPU 0 until told otherwise
+static uint irq_tick;             // ticks at the last balance
+static uint irq_busy[NCPU];       // cpus[i].busyticks at the last balance
+
+// ------------------------------------------------------------
+// irq_steer()
+// Deliver the NIC interrupt to CPU c from now on. Caller holds
+// e1000_lock.
+// ------------------------------------------------------------
+static void
+irq_steer(int c) {
+    if (e1000_pcif == 0 || c == e1000_pcif->cpu) return;
+    pci_intr_set_cpu(e1000_pcif, c);
+    e1000_stats.irq_moves++;
+}
+
+// Program the moderation registers. Caller holds e1000_lock.
+static void
+itr_program(uint32 itr, uint32 rdtr, uint32 radv) {
+    regs[E1000_RDTR] = rdtr;
+    regs[E1000_RADV] = radv;
+    regs[E1000_ITR] = itr;
+}
+
+// Round a requested ring size to something the NIC accepts:
+// a multiple of 8 descriptors between min and RING_SIZE_MAX.
+static uint32
+ring_size_ok(int n, int min) {
+    if (n < min) n = min;
+    if (n > RING_SIZE_MAX) n = RING_SIZE_MAX;
+    return (uint32)n & ~7;
+}
+
+static int
+e1000_rx_poll(int budget);
+static void
+e1000_watchdog(void);
+static void
+e1000_start(void);
+
+// The device as the stack sees it, see netdev.h.
+static struct netdev e1000_netdev = {
+    "e1000",
+    NETDEV_F_TXCSUM | NETDEV_F_RXCSUM | NETDEV_F_MCAST,
+    e1000_transmit,
+    e1000_transmit_batch,
+    e1000_rx_poll,
+    e1000_mtu,
+    e1000_getstats,
+    e1000_ctl,
+    e1000_dump,
+    e1000_mcast_add,
+    e1000_mcast_del,
+    e1000_watchdog,
+    e1000_start,
+};
+
+// ------------------------------------------------------------
+// tx_ring_reset()
+// Point the NIC at an empty TX ring. Buffers of frames still queued
+// are freed, since the NIC may not have sent them. Caller holds
+// e1000_lock with the transmitter off, or is e1000_init().
+// ------------------------------------------------------------
+static void
+tx_ring_reset(void) {
+    for (int i = 0; i < tx_ring_size; i++) {
+        if (tx_bufs[i]) {
+            mbuf_free(tx_bufs[i]);
+            tx_bufs[i] = 0;
+            e1000_stats.tx_reset_freed++;
+        }
+    }
+    memset(tx_ring, 0, tx_ring_size * sizeof(struct tx_desc));
+    for (int i = 0; i < tx_ring_size; i++) tx_ring[i].status = E1000_TXD_STAT_DD;
+
+    // set up TX ring base (physical address)
+    uint64 tx_pa = (uint64)V2P(tx_ring);
+    regs[E1000_TDBAL] = (uint32)tx_pa;
+    regs[E1000_TDBAH] = (uint32)(tx_pa >> 32);
+    regs[E1000_TDLEN] = tx_ring_size * sizeof(struct tx_desc);
+    regs[E1000_TDH] = regs[E1000_TDT] = 0;
+    tx_tail = tx_clean = 0;
+    tx_ctx_valid = 0;  // the NIC forgot the checksum context
+}
+
+// ------------------------------------------------------------
+// rx_ring_reset()
+// Give every RX descriptor its buffer again and hand the whole
+// ring to the NIC. The buffers stay where they are; a half-gathered
+// jumbo frame is dropped. Caller holds e1000_rxlock and e1000_lock
+// with the receiver off, or is e1000_init().
+// ------------------------------------------------------------
+static void
+rx_ring_reset(void) {
+    memset(rx_ring, 0, rx_ring_size * sizeof(struct rx_desc));
+    for (int i = 0; i < rx_ring_size; i++)
+        rx_ring[i].addr = (uint64)V2P(rx_bufs[i]);  // give NIC phys addr
+
+    if (rx_frag) rx_jumbo_put(rx_frag);
+    rx_frag = 0;
+    rx_frag_len = 0;
+    rx_frag_drop = 0;
+
+    // set up RX ring base (physical address)
+    uint64 rx_pa = (uint64)V2P(rx_ring);
+    regs[E1000_RDBAL] = (uint32)rx_pa;
+    regs[E1000_RDBAH] = (uint32)(rx_pa >> 32);
+    regs[E1000_RDLEN] = rx_ring_size * sizeof(struct rx_desc);
+    regs[E1000_RDH] = 0;
+    regs[E1000_RDT] = rx_ring_size - 1;
+}
+
+// ------------------------------------------------------------
+// e1000_reset_rings()
+// Recover a wedged NIC without a reboot: stop the transmitter and
+// receiver, put both rings back to their initial state and start
+// them again. Everything else (filters, moderation, MTU) is kept,
+// and so is every RX buffer; only frames still queued for sending
+// are lost.
+// ------------------------------------------------------------
+static void
+e1000_reset_rings(void) {
+    acquire(&e1000_rxlock);
+    acquire(&e1000_lock);
+    uint32 tctl = regs[E1000_TCTL];
+    uint32 rctl = regs[E1000_RCTL];
+    regs[E1000_TCTL] = tctl & ~E1000_TCTL_EN;
+    regs[E1000_RCTL] = rctl & ~E1000_RCTL_EN;
+    __sync_synchronize();
+
+    tx_ring_reset();
+    rx_ring_reset();
+    wd_tdh = 0;
+    wd_stuck = 0;
+    e1000_stats.ring_resets++;
+
+    __sync_synchronize();
+    regs[E1000_RCTL] = rctl;
+    regs[E1000_TCTL] = tctl;
+    release(&e1000_lock);
+    release(&e1000_rxlock);
+}
+
+// ------------------------------------------------------------
+// e1000_attach()
+// Called by pci_init() for an 82540EM: enable the function, map
+// its registers (BAR0) and take its interrupts on CPU 0.
+// ------------------------------------------------------------
+int
+e1000_attach(struct pci_func* f) {
+    pci_func_enable(f);
+    e1000_pcif = f;
+
+    uint32* xregs = pci_map_bar(f, 0);
+    if (xregs == 0) return -1;
+
+    e1000_init(xregs);
+
+    if (pci_intr_enable(f, e1000_intr, 0) < 0) {
+        cprintf("e1000: no interrupt\n");
+        return -1;
+    }
+    netdev_register(&e1000_netdev);
+    return 0;
+}
+
+// called by e1000_attach().
 // xregs is the memory address at which the
 // e1000's registers are mapped.
 // this code loosely follows the initialization directions
@@ -40,6 +372,8 @@ e1000_init(uint32* xregs)
     int i;
 
     initlock(&e1000_lock, "e1000");
+    initlock(&rx_poll_lock, "e1000poll");
+    initlock(&e1000_rxlock, "e1000rx");
 
     regs = xregs;
 
@@ -49,44 +383,37 @@ e1000_init(uint32* xregs)
     regs[E1000_IMS] = 0;  // redisable interrupts
     __sync_synchronize();
 
-    // [E1000 14.5] Transmit initialization
-    memset(tx_ring, 0, sizeof(tx_ring));
-    for (i = 0; i < TX_RING_SIZE; i++) {
-        tx_ring[i].status = E1000_TXD_STAT_DD;
-        tx_ring[i].addr = 0;
-        tx_bufs[i] = 0;
-    }
+    // The TX ring must hold 2 * TX_RS_INTERVAL: with one slot kept
+    // empty, any full ring then spans an RS descriptor, so there is
+    // always something tx_reclaim() can wait for.
+    tx_ring_size = ring_size_ok(E1000_TXRING, 2 * TX_RS_INTERVAL);
+    rx_ring_size = ring_size_ok(E1000_RXRING, 8);
+    cprintf("e1000: tx ring %d rx ring %d descriptors\n", tx_ring_size,
+            rx_ring_size);
 
-    // set up TX ring base (physical address)
-    uint64 tx_pa = (uint64)V2P(tx_ring);
-    regs[E1000_TDBAL] = (uint32)tx_pa;
-    regs[E1000_TDBAH] = (uint32)(tx_pa >> 32);
-    regs[E1000_TDLEN] = sizeof(tx_ring);
-    regs[E1000_TDH] = regs[E1000_TDT] = 0;
+    // [E1000 14.5] Transmit initialization
+    tx_ring_reset();
 
     // [E1000 14.4] Receive initialization
-    memset(rx_ring, 0, sizeof(rx_ring));
-    for (i = 0; i < RX_RING_SIZE; i++) {
-        void* buf = kalloc();
-        if (!buf) panic("e1000 rx kalloc");
+    for (i = 0; i < rx_ring_size; i++) {
+        char* buf = pktbuf_alloc();
+        if (!buf) panic("e1000 rx pktbuf");
         rx_bufs[i] = buf;                    // remember kvaddr
-        rx_ring[i].addr = (uint64)V2P(buf);  // give NIC phys addr
-        rx_ring[i].status = 0;
     }
 
-    // set up RX ring base (physical address)
-    uint64 rx_pa = (uint64)V2P(rx_ring);
-    regs[E1000_RDBAL] = (uint32)rx_pa;
-    regs[E1000_RDBAH] = (uint32)(rx_pa >> 32);
-    regs[E1000_RDLEN] = sizeof(rx_ring);
-    regs[E1000_RDH] = 0;
-    regs[E1000_RDT] = RX_RING_SIZE - 1;
+    initlock(&rx_jumbo_lock, "e1000.jumbo");
+    for (i = 0; i < RX_JUMBO_BUFS; i++) rx_jumbo_free[i] = rx_jumbo[i];
+    rx_jumbo_cnt = RX_JUMBO_BUFS;
+    rx_jumbo_extfree = mbuf_extfree_register(rx_jumbo_put);
+    if (rx_jumbo_extfree < 0) panic("e1000 extfree");
+    rx_ring_reset();
 
     // filter by qemu's MAC address, 52:54:00:12:34:56
     regs[E1000_RA] = 0x12005452;
     regs[E1000_RA + 1] = 0x5634 | (1 << 31);
-    // multicast table
-    for (int i = 0; i < 4096 / 32; i++) regs[E1000_MTA + i] = 0;
+    // multicast table; see e1000_mcast_add()
+    for (int i = 0; i < E1000_MTA_ENTRIES; i++) regs[E1000_MTA + i] = 0;
+    for (int i = 1; i < E1000_RA_ENTRIES; i++) regs[E1000_RA + 2 * i + 1] = 0;
 
     // transmitter control bits.
     regs[E1000_TCTL] = E1000_TCTL_EN |                  // enable
@@ -95,112 +422,365 @@ e1000_init(uint32* xregs)
                        (0x40 << E1000_TCTL_COLD_SHIFT);
     regs[E1000_TIPG] = 10 | (8 << 10) | (6 << 20);  // inter-pkt gap
 
+    // let the NIC verify IPv4 and TCP/UDP checksums; results come
+    // back in each descriptor's status and errors bytes.
+    regs[E1000_RXCSUM] = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL;
+
     // receiver control bits.
-    regs[E1000_RCTL] = E1000_RCTL_EN |       // enable receiver
-                       E1000_RCTL_BAM |      // enable broadcast
-                       E1000_RCTL_SZ_2048 |  // 2048-byte rx buffers
-                       E1000_RCTL_SECRC;     // strip CRC
+    regs[E1000_RCTL] = E1000_RCTL_EN |                       // enable receiver
+                       E1000_RCTL_BAM |                      // enable broadcast
+                       E1000_RCTL_SZ_2048 |                  // pktbufs
+                       E1000_RCTL_SECRC |                    // strip CRC
+                       (mtu > ETH_MTU ? E1000_RCTL_LPE : 0); // jumbo frames
 
-    // ask e1000 for receive interrupts.
-    regs[E1000_RDTR] = 0;  // interrupt after every received packet (no timer)
-    regs[E1000_RADV] = 0;  // interrupt after every packet (no timer)
-    regs[E1000_IMS] = (1 << 7);  // RXDW -- Receiver Descriptor Write Back
+    // ask e1000 for receive interrupts. Moderation starts at the
+    // lowest-latency level (interrupt after every received packet)
+    // and adapts from there; see e1000_itr_update().
+    itr_level = 0;
+    itr_tick = ticks;
+    itr_program(itr_levels[0].itr, itr_levels[0].rdtr, itr_levels[0].radv);
+    regs[E1000_IMS] = E1000_ICR_RXT0;  // RX descriptor write back
 
     // ---- debug sanity checks ----
     uint32 status = regs[0x00008 / 4];  // E1000_STATUS register at 0x00008
     cprintf("e1000_init: STATUS=0x%x\n", status);
+}
 
-    uint32 tdt_before = regs[E1000_TDT];
+// ------------------------------------------------------------
+// tx_reclaim()
+// Free the buffers of transmitted frames in bulk. Only every
+// TX_RS_INTERVAL-th descriptor asks for a status write-back, so
+// completion is detected a group at a time: once the NIC sets DD
+// on an RS descriptor, it and everything before it are done.
+// Caller holds e1000_lock.
+// ------------------------------------------------------------
+static void
+tx_reclaim(void) {
+    while (tx_clean != tx_tail) {
+        // find the RS descriptor that closes the oldest group
+        uint32 j = tx_clean;
+        while (j != tx_tail && (tx_ring[j].cmd & E1000_TXD_CMD_RS) == 0)
+            j = (j + 1) % tx_ring_size;
+        if (j == tx_tail || (tx_ring[j].status & E1000_TXD_STAT_DD) == 0)
+            break;
+
+        for (;;) {
+            if (tx_bufs[tx_clean]) {
+                mbuf_free(tx_bufs[tx_clean]);
+                tx_bufs[tx_clean] = 0;
+                e1000_stats.tx_reclaimed++;
+            }
+            int last = (tx_clean == j);
+            tx_clean = (tx_clean + 1) % tx_ring_size;
+            if (last) break;
+        }
+    }
 }
 
-int
-e1000_transmit(char* buf, int len) {
-    // buf contains an ethernet frame; program it into
-    // the TX descriptor ring so that the e1000 sends it. Stash
-    // a pointer so that it can be freed after send completes.
-    //
-    // return 0 on success.
-    // return -1 on failure (e.g., there is no descriptor available)
-    // so that the caller knows to free buf.
-    //
+// ------------------------------------------------------------
+// tx_room()
+// Return how many TX descriptors are free for a request of n,
+// reclaiming finished buffers once enough have piled up or when
+// the request would not fit otherwise. Caller holds e1000_lock.
+// ------------------------------------------------------------
+static uint32
+tx_room(uint32 n) {
+    uint32 used = (tx_tail + tx_ring_size - tx_clean) % tx_ring_size;
+    if (used >= TX_RECLAIM_THRESH || used + n >= tx_ring_size) {
+        tx_reclaim();
+        used = (tx_tail + tx_ring_size - tx_clean) % tx_ring_size;
+    }
 
-    // Disable interrupts to prevent preemption while manipulating NIC state.
-    pushcli();
+    // one slot stays empty so that tx_tail == tx_clean means "idle"
+    return tx_ring_size - 1 - used;
+}
 
-    // Lock the E1000 driver so only one CPU can access TX structures at a time.
-    acquire(&e1000_lock);
+// ------------------------------------------------------------
+// tx_put_ctx()
+// Load a TCP/IP context descriptor describing where the IPv4 and
+// UDP checksums of the following frames live. The NIC keeps the
+// last context, so one is only queued when the layout changes.
+// Caller holds e1000_lock and has room for one more descriptor.
+// ------------------------------------------------------------
+static void
+tx_put_ctx(int iphl) {
+    uint32 key = iphl;
+    if (tx_ctx_valid && tx_ctx_key == key) return;
+
+    uint32 t = tx_tail;
+    struct tx_ctx_desc* c = (struct tx_ctx_desc*)&tx_ring[t];
+    int ipoff = sizeof(struct eth);
+
+    c->ipcss = ipoff;
+    c->ipcso = ipoff + 10;  // offsetof(struct ip, ip_sum)
+    c->ipcse = ipoff + iphl - 1;
+    c->tucss = ipoff + iphl;
+    c->tucso = ipoff + iphl + 6;  // offsetof(struct udp, sum)
+    c->tucse = 0;                 // through the end of the frame
+    c->cmd_and_length = E1000_TXD_XCMD_DEXT | E1000_TXD_XCMD_IP;
+    if (t % TX_RS_INTERVAL == TX_RS_INTERVAL - 1)
+        c->cmd_and_length |= E1000_TXD_XCMD_RS;
+    c->status = 0;
+    c->hdr_len = 0;
+    c->mss = 0;
+
+    tx_bufs[t] = 0;
+    tx_tail = (t + 1) % tx_ring_size;
+    tx_ctx_key = key;
+    tx_ctx_valid = 1;
+    e1000_stats.tx_ctx_loads++;
+}
+
+// ------------------------------------------------------------
+// tx_put()
+// Fill one descriptor per mbuf of frame m, starting at tx_tail;
+// EOP goes on the last one only. Each mbuf is handed to the NIC
+// where it lies and freed by tx_reclaim() once sent. Caller holds
+// e1000_lock and has checked tx_room(). Doesn't ring the doorbell.
+// ------------------------------------------------------------
+static void
+tx_put(struct mbuf* m, int popts) {
+    while (m) {
+        struct mbuf* next = m->next;
+        uint32 t = tx_tail;
+        struct tx_desc* d = &tx_ring[t];
 
-    // Read the hardware Transmit Descriptor Tail register.
-    // This tells us where the NIC expects the next descriptor.
-    uint32 t_raw = regs[E1000_TDT];
+        // Physical address of the data (NIC can only use physical
+        // memory) and its length in bytes
+        d->addr = V2P(m->data);
+        d->length = m->len;
 
-    // Convert the hardware tail index into our ring buffer index (0–15).
-    uint32 t = t_raw % TX_RING_SIZE;
+        // EOP = end of packet, on the frame's last descriptor
+        // RS  = request status, only on every TX_RS_INTERVAL-th slot
+        d->cmd = next == 0 ? E1000_TXD_CMD_EOP : 0;
+        if (t % TX_RS_INTERVAL == TX_RS_INTERVAL - 1)
+            d->cmd |= E1000_TXD_CMD_RS;
+        d->status = 0;
 
-    // Get a pointer to the descriptor entry for this index.
-    struct tx_desc* d = &tx_ring[t];
+        if (popts) {
+            // Extended data descriptor: same EOP/RS bits, plus the
+            // checksum insertion options from the loaded context.
+            struct tx_data_desc* x = (struct tx_data_desc*)d;
+            x->lower = m->len | E1000_TXD_DTYP_D | E1000_TXD_XCMD_DEXT |
+                       ((uint32)d->cmd << 24);
+            x->status = 0;
+            x->popts = popts;
+            x->special = 0;
+        }
 
-    // If the descriptor’s "Descriptor Done" bit is NOT set,
-    // it means the NIC is still using this descriptor → no free slot.
-    if ((d->status & E1000_TXD_STAT_DD) == 0) {
-        release(&e1000_lock);  // unlock before returning
-        popcli();              // re-enable interrupts
-        return -1;             // tell caller to retry later
+        // Remember what to free once tx_reclaim() sees it done
+        tx_bufs[t] = m;
+        tx_tail = (t + 1) % tx_ring_size;
+        m = next;
     }
+}
 
-    // If an old buffer is still stored here, free it.
-    // Once DD=1, the NIC has finished with it, so it’s safe to release.
-    if (tx_bufs[t]) kfree(tx_bufs[t]);
+// Current interface MTU (IP packet size), see NETCTL_MTU.
+int
+e1000_mtu(void) {
+    return mtu;
+}
 
-    // Program the descriptor with the new packet info.
+// Hand everything up to tx_tail to the NIC. Caller holds e1000_lock.
+static void
+tx_doorbell(void) {
+    __sync_synchronize();
+    regs[E1000_TDT] = tx_tail;
+    e1000_stats.tx_doorbells++;
+}
 
-    // Physical address of the packet buffer (NIC can only use physical memory)
-    d->addr = V2P(buf);
+// ------------------------------------------------------------
+// tx_check()
+// Count the mbufs (descriptors) of frame m and work out the
+// checksum offload options its csum asks for; they are dropped
+// when offload is switched off with netctl, so callers should check
+// NETDEV_F_TXCSUM first. Returns -1 if the NIC can't send m.
+// ------------------------------------------------------------
+static int
+tx_check(struct mbuf* m, int* popts, int* iphl) {
+    int nsegs = 0, total = 0;
 
-    // Length of the Ethernet frame in bytes
-    d->length = len;
+    for (struct mbuf* n = m; n; n = n->next) {
+        nsegs++;
+        total += n->len;
+    }
+    if (nsegs == 0 || nsegs > TX_MAX_FRAGS || total > E1000_TX_MAXFRAME)
+        return -1;
 
-    // Command bits:
-    // EOP = end of packet (marks the last descriptor in this frame)
-    // RS  = request status (NIC will set DD when done)
-    d->cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
+    *popts = *iphl = 0;
+    if (m->csum && tx_csum_offload) {
+        struct ip* ip = (struct ip*)(m->data + sizeof(struct eth));
+        *iphl = (ip->ip_vhl & 0x0f) * 4;
+        if (m->csum & TXO_IPCSUM) *popts |= E1000_TXD_POPTS_IXSM;
+        if (m->csum & TXO_UDPCSUM) *popts |= E1000_TXD_POPTS_TXSM;
+    }
+    return nsegs;
+}
 
-    // Clear status bit (hardware will set it when transmission completes)
-    d->status = 0;
+// ------------------------------------------------------------
+// e1000_transmit_batch()
+// Queue n ethernet frames for transmission under one hold of
+// e1000_lock and ring the TDT doorbell once for the whole batch.
+// Each frame is an mbuf chain, sent scatter-gather with one
+// descriptor per mbuf, so headers and payload need not be in one
+// buffer. The tail index is shadowed in tx_tail, so TDT is never
+// read back over MMIO. Each queued mbuf is freed after the NIC is
+// done with it; see tx_reclaim().
+//
+// Returns the number of frames queued, from the front of pkts[].
+// The caller still owns (and must free) pkts[ret..n-1].
+// ------------------------------------------------------------
+int
+e1000_transmit_batch(struct mbuf** pkts, int n) {
+    int i, popts, iphl;
 
-    // Remember the buffer’s virtual address so we can free it later
-    tx_bufs[t] = buf;
+    acquire(&e1000_lock);
+
+    for (i = 0; i < n; i++) {
+        struct mbuf* m = pkts[i];
+        int nsegs = tx_check(m, &popts, &iphl);
+        if (nsegs < 0) {
+            e1000_stats.tx_errors++;
+            break;
+        }
+        // one spare slot in case a context descriptor must be loaded
+        if (tx_room(nsegs + 1) < nsegs + 1) {
+            e1000_stats.tx_ring_full++;
+            break;
+        }
+
+        if (popts) {
+            tx_put_ctx(iphl);
+            e1000_stats.tx_csum_offload++;
+        }
+        e1000_stats.tx_bytes += mbuf_pktlen(m);
+        if (nsegs > 1) e1000_stats.tx_sg_frames++;
+        tx_put(m, popts);
+    }
 
-    // Advance the NIC’s transmit tail register.
-    // This hands the descriptor to the NIC so it can start transmitting.
-    regs[E1000_TDT] = (t + 1) % TX_RING_SIZE;
+    if (i > 0) {
+        // One doorbell for the whole batch hands the descriptors to
+        // the NIC.
+        tx_doorbell();
+        e1000_stats.tx_packets += i;
+    }
 
-    // Done modifying TX state — release the driver lock.
     release(&e1000_lock);
+    return i;
+}
 
-    // Re-enable interrupts (restore previous interrupt state).
-    popcli();
+// ------------------------------------------------------------
+// e1000_transmit()
+// Send one ethernet frame, an mbuf chain. TXO_* flags in m->csum
+// ask the NIC to insert the IPv4 and/or UDP checksum.
+//
+// return 0 on success; the driver then owns m.
+// return -1 on failure (e.g., there are not enough descriptors
+// available) so that the caller knows to free m.
+// ------------------------------------------------------------
+int
+e1000_transmit(struct mbuf* m) {
+    return e1000_transmit_batch(&m, 1) == 1 ? 0 : -1;
+}
 
-    // Return success.
-    return 0;
+// Translate a descriptor's checksum status and error bits into the
+// RXC_* flags that travel with the frame. IXSM means the NIC did
+// not look at the checksums at all.
+static int
+rx_csum(struct rx_desc* d) {
+    int csum = 0;
+
+    if (d->status & E1000_RXD_STAT_IXSM) return 0;
+    if (d->status & E1000_RXD_STAT_IPCS)
+        csum |= (d->errors & E1000_RXD_ERR_IPE) ? RXC_IP_BAD : RXC_IP_OK;
+    if (d->status & E1000_RXD_STAT_TCPCS)
+        csum |= (d->errors & E1000_RXD_ERR_TCPE) ? RXC_L4_BAD : RXC_L4_OK;
+
+    if (csum & (RXC_IP_BAD | RXC_L4_BAD))
+        e1000_stats.rx_csum_bad++;
+    else if (csum)
+        e1000_stats.rx_csum_ok++;
+    return csum;
+}
+
+// Append one descriptor's worth of a multi-descriptor frame to
+// rx_frag. Returns the whole frame (length in *plen) once the EOP
+// descriptor has been added, else 0. A frame that finds no free
+// jumbo buffer, or outgrows one, is dropped. Caller holds e1000_lock.
+static char*
+rx_gather(char* src, int len, int eop, int* plen) {
+    if (rx_frag == 0 && !rx_frag_drop) {
+        rx_frag = rx_jumbo_get();
+        rx_frag_len = 0;
+        if (rx_frag == 0) rx_frag_drop = 1;
+    }
+    if (rx_frag && rx_frag_len + len > RX_JUMBO_SIZE) {
+        rx_jumbo_put(rx_frag);
+        rx_frag = 0;
+        rx_frag_drop = 1;
+    }
+    if (rx_frag) {
+        memmove(rx_frag + rx_frag_len, src, len);
+        rx_frag_len += len;
+    }
+    if (!eop) return 0;
+
+    char* pkt = rx_frag;
+    *plen = rx_frag_len;
+    if (pkt)
+        e1000_stats.rx_jumbo++;
+    else
+        e1000_stats.rx_jumbo_drop++;
+    rx_frag = 0;
+    rx_frag_drop = 0;
+    return pkt;
+}
+
+// A free jumbo buffer, or 0.
+static char*
+rx_jumbo_get(void) {
+    char* buf = 0;
+    acquire(&rx_jumbo_lock);
+    if (rx_jumbo_cnt > 0) buf = rx_jumbo_free[--rx_jumbo_cnt];
+    release(&rx_jumbo_lock);
+    return buf;
+}
+
+// Take back a jumbo buffer; also the mbuf extfree hook mbuf_free()
+// calls once the stack is done with a gathered frame, with or
+// without e1000_lock held.
+static void
+rx_jumbo_put(char* buf) {
+    acquire(&rx_jumbo_lock);
+    rx_jumbo_free[rx_jumbo_cnt++] = buf;
+    release(&rx_jumbo_lock);
 }
 
 // ------------------------------------------------------------
 // e1000_receive()
-// Continuously polls for packets that have been received by the NIC.
+// Polls for packets that have been received by the NIC, handling at
+// most budget of them (budget <= 0 means until the ring is empty).
+// Returns the number of descriptors handled, so a return value
+// below budget means the ring was drained.
 // For each completed RX descriptor, this function:
-//   - Copies the received packet into a freshly allocated kernel buffer
-//   - Hands it off to the xv6 network stack via net_rx()
+//   - Loans the DMA buffer itself to the stack, wrapped in an mbuf,
+//     and refills the descriptor with a fresh pktbuf (zero-copy),
+//     or drops the frame if the pools are exhausted
+//   - Hands the mbuf off to the xv6 network stack via net_rx()
 //   - Returns the descriptor to the NIC for reuse
 // ------------------------------------------------------------
-static void
-e1000_recv(void) {
+static int
+e1000_recv(int budget) {
     // Check for packets that have arrived from the e1000.
-    // Create and deliver a buf for each packet (using net_rx()).
+    // Create and deliver an mbuf for each packet (using net_rx()).
     //
+    int done = 0;
 
-    // Infinite polling loop — continuously check for received packets
-    for (;;) {
+    acquire(&e1000_rxlock);
+
+    // Polling loop — check for received packets until the ring is
+    // empty or the budget is used up
+    while (budget <= 0 || done < budget) {
         // Lock NIC state so that RX ring and register access are atomic
         acquire(&e1000_lock);
 
@@ -209,8 +789,8 @@ e1000_recv(void) {
         uint32 r = regs[E1000_RDT];
 
         // Compute the next index in the RX ring
-        // Wraps around (ring buffer of RX_RING_SIZE descriptors)
-        uint32 i = (r + 1) % RX_RING_SIZE;
+        // Wraps around (ring buffer of rx_ring_size descriptors)
+        uint32 i = (r + 1) % rx_ring_size;
 
         // Get the descriptor at this index
         struct rx_desc* d = &rx_ring[i];
@@ -231,23 +811,49 @@ e1000_recv(void) {
         // --------------------------------------------------------
         int len = d->length;     // actual number of bytes received
         char* src = rx_bufs[i];  // pointer to the NIC’s receive buffer
+        int eop = d->status & E1000_RXD_STAT_EOP;  // last piece of frame
+        // checksum results are only valid in the EOP descriptor
+        int csum = eop ? rx_csum(d) : 0;
 
         // --------------------------------------------------------
-        // Copy the received packet into a new kernel buffer.
-        // We must do this before returning the descriptor to the NIC,
-        // since the NIC can overwrite the buffer once we clear the DD bit.
+        // Take the frame out of the ring before the descriptor is
+        // returned to the NIC, since the NIC can overwrite the buffer
+        // once we clear the DD bit.
         // --------------------------------------------------------
-        char* dst = 0;
-        if (len > 0 && len <= PGSIZE) {  // sanity check on packet size
-            dst = kalloc();              // allocate a fresh page for the packet
-            if (dst != 0)
-                memmove(dst, src, len);  // copy packet contents safely
+        struct mbuf* pkt = 0;
+        if (rx_frag || rx_frag_drop || !eop) {
+            // A jumbo frame spanning several descriptors: copy this
+            // piece out; the buffer stays in the ring.
+            char* buf = rx_gather(src, len, eop, &len);
+            if (buf && (pkt = mbuf_wrap(buf, RX_JUMBO_SIZE, len)) == 0) {
+                rx_jumbo_put(buf);
+                e1000_stats.rx_nomem++;
+            } else if (pkt) {
+                pkt->extfree = rx_jumbo_extfree;
+            }
+        } else if (len > 0 && len <= PKTBUF_SIZE) {  // sanity check on size
+            char* fresh = pktbuf_alloc();
+            if (fresh && (pkt = mbuf_wrap(src, PKTBUF_SIZE, len)) != 0) {
+                // Zero-copy: hand the DMA buffer itself up the stack
+                // and give the NIC a fresh one in its place.
+                rx_bufs[i] = fresh;
+                d->addr = (uint64)V2P(fresh);
+                e1000_stats.rx_zerocopy++;
+            } else {
+                // Out of buffers: the frame stays in the ring and is
+                // overwritten.
+                if (fresh) pktbuf_free(fresh);
+                e1000_stats.rx_nomem++;
+            }
+        }
+        if (pkt) {
+            pkt->csum = csum;
+            pkt->dev = &e1000_netdev;
         }
 
         // --------------------------------------------------------
         // Return descriptor back to NIC for reuse.
         // Clearing the DD bit allows the NIC to refill it.
-        // The address (src) remains valid, so no need to reset addr.
         // --------------------------------------------------------
         d->status = 0;
 
@@ -261,18 +867,466 @@ e1000_recv(void) {
         // --------------------------------------------------------
         // Hand the packet to the upper layer (network stack)
         // outside the lock to avoid holding it too long.
-        // net_rx() will take ownership of dst and eventually free it.
+        // net_rx() takes ownership of pkt and eventually releases
+        // it with mbuf_freem().
         // --------------------------------------------------------
-        if (dst != 0) net_rx(dst, len);
+        if (pkt != 0) {
+            e1000_stats.rx_packets++;
+            e1000_stats.rx_bytes += len;
+            net_rx(pkt);
+        }
+        itr_pkts++;
+        done++;
+    }
+
+    release(&e1000_rxlock);
+    return done;
+}
+
+// netdev rx_poll(): a receive pass outside of the interrupt path.
+static int
+e1000_rx_poll(int budget) {
+    return e1000_recv(budget);
+}
+
+// Is there a received frame waiting at the head of the RX ring?
+static int
+e1000_rx_pending(void) {
+    uint32 i = (regs[E1000_RDT] + 1) % rx_ring_size;
+    return (rx_ring[i].status & E1000_RXD_STAT_DD) != 0;
+}
+
+static void
+e1000_itr_update(void);
+static void
+e1000_irq_balance(void);
+
+// ------------------------------------------------------------
+// e1000_poll()
+// Kernel thread body for interrupt-then-poll receive. Sleeps until
+// e1000_intr() hands over the ring, then runs budgeted receive
+// passes, yielding the CPU between them so user processes keep
+// running under a flood. Once a pass drains the ring, RX interrupts
+// are unmasked and the thread goes back to sleep.
+// ------------------------------------------------------------
+static void
+e1000_poll(void* arg) {
+    for (;;) {
+        acquire(&rx_poll_lock);
+        while (!rx_poll_pending) sleep(&rx_poll_pending, &rx_poll_lock);
+        release(&rx_poll_lock);
+
+        int budget = rx_budget;
+        int n = e1000_recv(budget);
+        e1000_itr_update();
+        if (budget > 0 && n >= budget) {
+            e1000_stats.rx_poll_yields++;
+            yield();
+            continue;
+        }
+
+        // Ring drained: back to interrupt mode. A frame that lands
+        // after the check below leaves its cause bit set in ICR, so
+        // unmasking raises a fresh interrupt for it.
+        acquire(&rx_poll_lock);
+        rx_poll_pending = 0;
+        regs[E1000_IMS] = E1000_ICR_RXT0;
+        if (e1000_rx_pending()) {
+            regs[E1000_IMC] = E1000_ICR_RXT0;
+            rx_poll_pending = 1;
+        }
+        release(&rx_poll_lock);
+    }
+}
+
+// netdev start(): start the receive poll thread, now that the
+// process table is ready (see netinit()).
+static void
+e1000_start(void) {
+    if (regs == 0) return;
+    if (kthread("e1000poll", e1000_poll, 0) < 0) {
+        cprintf("e1000: no poll thread, receiving in interrupts\n");
+        return;
+    }
+    rx_poll_running = 1;
+}
+
+// [E1000 13.5.1] With RCTL.MO = 0 the multicast hash is bits 47:36
+// of the destination address: 7 bits pick an MTA word, 5 a bit.
+static uint32
+mta_hash(uchar* mac) {
+    return ((mac[4] >> 4) | ((uint32)mac[5] << 4)) & 0xfff;
+}
+
+// Rewrite the RA slots and MTA from the mcast[] table. Caller
+// holds e1000_lock.
+static void
+mcast_program(void) {
+    uint32 nmta[E1000_MTA_ENTRIES];
+    int ra = 1, i;
+
+    memset(nmta, 0, sizeof(nmta));
+    for (i = 0; i < MCAST_MAX; i++) {
+        uchar* m = mcast[i].mac;
+        if (mcast[i].refs == 0) continue;
+        if (ra < E1000_RA_ENTRIES) {
+            regs[E1000_RA + 2 * ra] =
+                m[0] | (m[1] << 8) | (m[2] << 16) | ((uint32)m[3] << 24);
+            regs[E1000_RA + 2 * ra + 1] = m[4] | (m[5] << 8) | E1000_RAH_AV;
+            ra++;
+        } else {
+            uint32 h = mta_hash(m);
+            nmta[h >> 5] |= 1 << (h & 31);
+        }
+    }
+    for (; ra < E1000_RA_ENTRIES; ra++) regs[E1000_RA + 2 * ra + 1] = 0;
+
+    for (i = 0; i < E1000_MTA_ENTRIES; i++) {
+        if (nmta[i] != mta[i]) {
+            mta[i] = nmta[i];
+            regs[E1000_MTA + i] = nmta[i];
+        }
+    }
+}
+
+// Start accepting frames sent to multicast address mac.
+// Returns 0, or -1 if too many groups are joined.
+int
+e1000_mcast_add(uchar* mac) {
+    int i, slot = -1;
+
+    acquire(&e1000_lock);
+    for (i = 0; i < MCAST_MAX; i++) {
+        if (mcast[i].refs && memcmp(mcast[i].mac, mac, ETHADDR_LEN) == 0) {
+            mcast[i].refs++;
+            release(&e1000_lock);
+            return 0;
+        }
+        if (mcast[i].refs == 0 && slot < 0) slot = i;
+    }
+    if (slot < 0) {
+        release(&e1000_lock);
+        return -1;
     }
+    memmove(mcast[slot].mac, mac, ETHADDR_LEN);
+    mcast[slot].refs = 1;
+    mcast_program();
+    release(&e1000_lock);
+    return 0;
+}
+
+// Drop one reference to multicast address mac; the filter is
+// removed with the last one. Returns -1 if mac wasn't joined.
+int
+e1000_mcast_del(uchar* mac) {
+    acquire(&e1000_lock);
+    for (int i = 0; i < MCAST_MAX; i++) {
+        if (mcast[i].refs && memcmp(mcast[i].mac, mac, ETHADDR_LEN) == 0) {
+            if (--mcast[i].refs == 0) mcast_program();
+            release(&e1000_lock);
+            return 0;
+        }
+    }
+    release(&e1000_lock);
+    return -1;
+}
+
+// Fold the clear-on-read statistics registers into hwstats.
+// Caller holds e1000_lock.
+static void
+hwstats_update(void) {
+    hwstats.gprc += regs[E1000_GPRC];
+    hwstats.gptc += regs[E1000_GPTC];
+    // 64-bit octet counters: low then high, the high read clears both
+    hwstats.gorc += regs[E1000_GORCL];
+    hwstats.gorc += (uint64)regs[E1000_GORCH] << 32;
+    hwstats.gotc += regs[E1000_GOTCL];
+    hwstats.gotc += (uint64)regs[E1000_GOTCH] << 32;
+    hwstats.mpc += regs[E1000_MPC];
+    hwstats.rnbc += regs[E1000_RNBC];
+    hwstats.crcerrs += regs[E1000_CRCERRS];
+    hwstats.colc += regs[E1000_COLC];
+}
+
+// Fill in the driver and hardware parts of st (see netstat.h).
+void
+e1000_getstats(struct netstat* st) {
+    acquire(&e1000_lock);
+    hwstats_update();
+    st->hw_rx_packets = hwstats.gprc;
+    st->hw_rx_bytes = hwstats.gorc;
+    st->hw_tx_packets = hwstats.gptc;
+    st->hw_tx_bytes = hwstats.gotc;
+    st->hw_missed = hwstats.mpc;
+    st->hw_no_buffers = hwstats.rnbc;
+    st->hw_crc_errors = hwstats.crcerrs;
+    st->hw_collisions = hwstats.colc;
+    st->interrupts = e1000_stats.interrupts;
+    for (int c = 0; c < NCPU && c < NETSTAT_NCPU; c++)
+        st->intr_cpu[c] = e1000_stats.intr_cpu[c];
+    st->irq_cpu = e1000_pcif ? e1000_pcif->cpu : 0;
+    st->rx_packets = e1000_stats.rx_packets;
+    st->rx_bytes = e1000_stats.rx_bytes;
+    st->rx_nomem = e1000_stats.rx_nomem;
+    st->tx_packets = e1000_stats.tx_packets;
+    st->tx_bytes = e1000_stats.tx_bytes;
+    st->tx_ring_full = e1000_stats.tx_ring_full;
+    st->tx_errors = e1000_stats.tx_errors;
+    st->tx_stalls = e1000_stats.tx_stalls;
+    release(&e1000_lock);
+}
+
+// Print driver counters to the console (see net_debug()).
+void
+e1000_dump(void) {
+    cprintf("e1000: tx ring %d rx ring %d mtu %d\n", tx_ring_size,
+            rx_ring_size, mtu);
+    acquire(&e1000_lock);
+    hwstats_update();
+    release(&e1000_lock);
+    cprintf("e1000: interrupts %d, hw rx %d tx %d missed %d nobufs %d crc %d "
+            "collisions %d\n",
+            (int)e1000_stats.interrupts, (int)hwstats.gprc, (int)hwstats.gptc,
+            (int)hwstats.mpc, (int)hwstats.rnbc, (int)hwstats.crcerrs,
+            (int)hwstats.colc);
+    cprintf("e1000: irq cpu %d mode %d moves %d, per cpu:",
+            e1000_pcif ? e1000_pcif->cpu : 0, irq_mode,
+            (int)e1000_stats.irq_moves);
+    for (int c = 0; c < ncpu; c++)
+        cprintf(" %d", (int)e1000_stats.intr_cpu[c]);
+    cprintf("\n");
+    cprintf("e1000: rx zerocopy %d nomem %d\n",
+            (int)e1000_stats.rx_zerocopy, (int)e1000_stats.rx_nomem);
+    cprintf("e1000: tx packets %d doorbells %d reclaimed %d ring full %d\n",
+            (int)e1000_stats.tx_packets, (int)e1000_stats.tx_doorbells,
+            (int)e1000_stats.tx_reclaimed, (int)e1000_stats.tx_ring_full);
+    cprintf("e1000: tx scatter-gather frames %d\n",
+            (int)e1000_stats.tx_sg_frames);
+    cprintf("e1000: tx stalls %d, ring resets %d, queued frames dropped %d\n",
+            (int)e1000_stats.tx_stalls, (int)e1000_stats.ring_resets,
+            (int)e1000_stats.tx_reset_freed);
+    cprintf("e1000: tx csum offload %s frames %d contexts %d\n",
+            tx_csum_offload ? "on" : "off", (int)e1000_stats.tx_csum_offload,
+            (int)e1000_stats.tx_ctx_loads);
+    cprintf("e1000: rx csum verified %d bad %d\n",
+            (int)e1000_stats.rx_csum_ok, (int)e1000_stats.rx_csum_bad);
+    cprintf("e1000: rx jumbo frames %d dropped %d, buffers free %d/%d\n",
+            (int)e1000_stats.rx_jumbo, (int)e1000_stats.rx_jumbo_drop,
+            rx_jumbo_cnt, RX_JUMBO_BUFS);
+    int nmcast = 0;
+    for (int i = 0; i < MCAST_MAX; i++)
+        if (mcast[i].refs) nmcast++;
+    cprintf("e1000: multicast addresses %d (%d exact, rest hashed)\n",
+            nmcast, nmcast < E1000_RA_ENTRIES ? nmcast : E1000_RA_ENTRIES - 1);
+    cprintf("e1000: rx budget %d polls %d yields %d\n", rx_budget,
+            (int)e1000_stats.rx_polls, (int)e1000_stats.rx_poll_yields);
+    if (itr_mode == NETCTL_ITR_ADAPTIVE)
+        cprintf("e1000: itr adaptive level %d rate %d pps changes %d\n",
+                itr_level, itr_pps, (int)e1000_stats.itr_changes);
+    else
+        cprintf("e1000: itr fixed %d ints/s\n", itr_mode);
+}
+
+// ------------------------------------------------------------
+// e1000_itr_update()
+// Adaptive interrupt moderation: once per timer tick, fold the
+// packets seen since the last sample into a smoothed rate and move
+// to the matching moderation level. Called after each receive pass.
+// ------------------------------------------------------------
+static void
+e1000_itr_update(void) {
+    uint now = ticks;
+    if (itr_mode != NETCTL_ITR_ADAPTIVE || now == itr_tick) return;
+
+    // packets per second over the sample (100 ticks per second),
+    // then a 1/4-weight moving average
+    uint32 pps = itr_pkts * 100 / (now - itr_tick);
+    itr_pps = (itr_pps * 3 + pps) / 4;
+    itr_pkts = 0;
+    itr_tick = now;
+
+    int level = itr_level;
+    while (level < NELEM(itr_levels) - 1 && itr_pps > itr_levels[level].maxpps)
+        level++;
+    while (level > 0 && itr_pps < itr_levels[level - 1].maxpps / 2) level--;
+    if (level == itr_level) return;
+
+    acquire(&e1000_lock);
+    if (itr_mode == NETCTL_ITR_ADAPTIVE) {
+        itr_level = level;
+        itr_program(itr_levels[level].itr, itr_levels[level].rdtr,
+                    itr_levels[level].radv);
+        e1000_stats.itr_changes++;
+    }
+    release(&e1000_lock);
+}
+
+// ------------------------------------------------------------
+// e1000_ctl()
+// Run-time driver knobs for the netctl() system call.
+// Returns 0 on success, -1 on a bad command or argument.
+// ------------------------------------------------------------
+int
+e1000_ctl(int cmd, int arg) {
+    switch (cmd) {
+        case NETCTL_ITR:
+            if (arg < NETCTL_ITR_ADAPTIVE) return -1;
+            acquire(&e1000_lock);
+            itr_mode = arg;
+            if (arg == NETCTL_ITR_ADAPTIVE) {
+                // restart adaptation from the current level
+                itr_pkts = 0;
+                itr_tick = ticks;
+                itr_program(itr_levels[itr_level].itr,
+                            itr_levels[itr_level].rdtr,
+                            itr_levels[itr_level].radv);
+            } else if (arg == 0) {
+                itr_program(0, 0, 0);
+            } else {
+                // pin a fixed cap; ITR counts in 256ns units
+                uint32 itr = 1000000000 / 256 / (uint32)arg;
+                itr_program(itr ? itr : 1, 0, 0);
+            }
+            release(&e1000_lock);
+            return 0;
+        case NETCTL_TXCSUM:
+            if (arg != 0 && arg != 1) return -1;
+            tx_csum_offload = arg;
+            if (arg)
+                e1000_netdev.features |= NETDEV_F_TXCSUM;
+            else
+                e1000_netdev.features &= ~NETDEV_F_TXCSUM;
+            return 0;
+        case NETCTL_RXPOLL:
+            if (arg < 0) return -1;
+            rx_budget = arg;
+            return 0;
+        case NETCTL_IRQCPU:
+            if (arg < NETCTL_IRQ_LEAST || arg >= ncpu) return -1;
+            if (arg >= 0 && !cpus[arg].started) return -1;
+            acquire(&e1000_lock);
+            irq_mode = arg;
+            if (arg >= 0) irq_steer(arg);
+            irq_tick = ticks - IRQ_BALANCE_TICKS;  // re-pick at once
+            release(&e1000_lock);
+            return 0;
+        case NETCTL_MTU:
+            if (arg < 68 || arg > E1000_MAX_MTU) return -1;
+            acquire(&e1000_lock);
+            mtu = arg;
+            if (mtu > ETH_MTU)
+                regs[E1000_RCTL] |= E1000_RCTL_LPE;
+            else
+                regs[E1000_RCTL] &= ~E1000_RCTL_LPE;
+            release(&e1000_lock);
+            return 0;
+        case NETCTL_RESET:
+            e1000_reset_rings();
+            return 0;
+    }
+    return -1;
+}
+
+// ------------------------------------------------------------
+// e1000_watchdog()
+// netdev watchdog, run from the timer every NET_WATCHDOG_TICKS (see
+// net_timer()). If the NIC has stopped fetching TX descriptors,
+// transmit would fail for good once the ring fills, so reset the
+// rings and carry on.
+// ------------------------------------------------------------
+static void
+e1000_watchdog(void) {
+    acquire(&e1000_lock);
+    uint32 tdh = regs[E1000_TDH];
+    if (tdh == tx_tail || tdh != wd_tdh) {
+        // nothing queued, or progress since the last check
+        wd_tdh = tdh;
+        wd_stuck = 0;
+        release(&e1000_lock);
+        return;
+    }
+    if (++wd_stuck < WD_STALL_CHECKS) {
+        release(&e1000_lock);
+        return;
+    }
+    e1000_stats.tx_stalls++;
+    uint32 tdt = tx_tail;
+    release(&e1000_lock);
+
+    cprintf("e1000: tx stalled at TDH %d TDT %d, resetting rings\n", tdh,
+            tdt);
+    e1000_reset_rings();
+}
+
+// ------------------------------------------------------------
+// e1000_irq_balance()
+// Re-pick the interrupt CPU in the round-robin and least-loaded
+// modes. Least loaded is the started CPU whose timer most rarely
+// found a process running since the last pass; ties go to the CPU
+// already taking the interrupt so it doesn't move for nothing.
+// ------------------------------------------------------------
+static void
+e1000_irq_balance(void) {
+    acquire(&e1000_lock);
+    if (irq_mode >= 0 || ticks - irq_tick < IRQ_BALANCE_TICKS) {
+        release(&e1000_lock);
+        return;
+    }
+    irq_tick = ticks;
+
+    int cur = e1000_pcif ? e1000_pcif->cpu : 0;
+    int best = cur;
+    if (irq_mode == NETCTL_IRQ_RR) {
+        for (int n = 1; n <= ncpu; n++) {
+            int c = (cur + n) % ncpu;
+            if (cpus[c].started) {
+                best = c;
+                break;
+            }
+        }
+    } else {
+        uint bestload = 0xffffffff;
+        for (int c = 0; c < ncpu; c++) {
+            uint busy = cpus[c].busyticks;
+            uint load = busy - irq_busy[c];
+            irq_busy[c] = busy;
+            if (!cpus[c].started) continue;
+            if (load < bestload || (load == bestload && c == cur)) {
+                bestload = load;
+                best = c;
+            }
+        }
+    }
+    irq_steer(best);
+    release(&e1000_lock);
 }
 
 void
 e1000_intr(void) {
-    // tell the e1000 we've seen this interrupt;
-    // without this the e1000 won't raise any
-    // further interrupts.
-    regs[E1000_ICR] = 0xffffffff;
+    // Reading ICR tells the e1000 we've seen this interrupt
+    // (it clears on read); without this the e1000 won't raise
+    // any further interrupts. An INTx line may be shared, so
+    // nothing pending means another device raised it.
+    if (regs[E1000_ICR] == 0) return;
+    e1000_stats.interrupts++;
+    e1000_stats.intr_cpu[cpu - cpus]++;
+    if (irq_mode < 0 && ticks - irq_tick >= IRQ_BALANCE_TICKS)
+        e1000_irq_balance();
+
+    if (rx_budget > 0 && rx_poll_running) {
+        // Hand the ring to the poll thread and keep RX interrupts
+        // masked until it has drained the ring.
+        acquire(&rx_poll_lock);
+        if (!rx_poll_pending) {
+            regs[E1000_IMC] = E1000_ICR_RXT0;
+            rx_poll_pending = 1;
+            e1000_stats.rx_polls++;
+            wakeup(&rx_poll_pending);
+        }
+        release(&rx_poll_lock);
+        return;
+    }
 
-    e1000_recv();
+    e1000_recv(0);
+    e1000_itr_update();
 }
@@ -7,15 +7,52 @@
 
 //
 #pragma once
+
+struct mbuf;
+
+#define TX_MAX_FRAGS 16         /* mbufs (descriptors) per frame */
+#define E1000_TX_MAXFRAME 16288 /* largest frame the 82540EM sends */
+
+#define ETH_MTU 1500      /* default MTU, no jumbo frames */
+#define E1000_MAX_MTU 9000 /* largest MTU accepted by NETCTL_MTU */
+
+/* Checksum offload requests for e1000_transmit(), in the head mbuf's
+   csum; the frame must be Ethernet + IPv4 with the headers in the
+   first mbuf. The stack
+   leaves ip_sum 0 and seeds the UDP sum with the pseudo-header sum. */
+#define TXO_IPCSUM 0x1  /* NIC fills in the IPv4 header checksum */
+#define TXO_UDPCSUM 0x2 /* NIC fills in the UDP checksum */
+
+/* Receive checksum results in each received mbuf's csum. A
+   layer with neither its OK nor its BAD bit set was not checked by
+   the NIC and must be verified in software. */
+#define RXC_IP_OK 0x1  /* IPv4 header checksum verified good */
+#define RXC_IP_BAD 0x2 /* IPv4 header checksum wrong */
+#define RXC_L4_OK 0x4  /* TCP/UDP checksum verified good */
+#define RXC_L4_BAD 0x8 /* TCP/UDP checksum wrong */
+
 void
 e1000_init(uint32* xregs);
 int
-e1000_transmit(char* buf, int len);
+e1000_transmit(struct mbuf* m);
+int
+e1000_transmit_batch(struct mbuf** pkts, int n);
+int
+e1000_mtu(void);
+struct netstat;
+void
+e1000_getstats(struct netstat* st);
+int
+e1000_mcast_add(uchar* mac);
+int
+e1000_mcast_del(uchar* mac);
 
 /* Registers */
 #define E1000_CTL (0x00000 / 4)  /* Device Control Register - RW */
 #define E1000_ICR (0x000C0 / 4)  /* Interrupt Cause Read - R */
+#define E1000_ITR (0x000C4 / 4)  /* Interrupt Throttling Rate - RW */
 #define E1000_IMS (0x000D0 / 4)  /* Interrupt Mask Set - RW */
+#define E1000_IMC (0x000D8 / 4)  /* Interrupt Mask Clear - WO */
 #define E1000_RCTL (0x00100 / 4) /* RX Control - RW */
 #define E1000_TCTL (0x00400 / 4) /* TX Control - RW */
 #define E1000_TIPG (0x00410 / 4) /* TX Inter-packet gap - RW */
@@ -36,12 +73,31 @@ e1000_transmit(char* buf, int len);
 #define E1000_TDH (0x03810 / 4)   /* TX Descriptor Head              - RW */
 #define E1000_TDT (0x03818 / 4)   /* TX Descriptor Tail              - RW */
 
+/* Statistics, clear on read [E1000 13.7] */
+#define E1000_CRCERRS (0x04000 / 4) /* CRC Error Count - R/clr */
+#define E1000_MPC (0x04010 / 4)     /* Missed Packet Count - R/clr */
+#define E1000_COLC (0x04028 / 4)    /* Collision Count - R/clr */
+#define E1000_GPRC (0x04074 / 4)    /* Good Packets RX Count - R/clr */
+#define E1000_GPTC (0x04080 / 4)    /* Good Packets TX Count - R/clr */
+#define E1000_GORCL (0x04088 / 4)   /* Good Octets RX Count Low - R/clr */
+#define E1000_GORCH (0x0408C / 4)   /* Good Octets RX Count High - R/clr */
+#define E1000_GOTCL (0x04090 / 4)   /* Good Octets TX Count Low - R/clr */
+#define E1000_GOTCH (0x04094 / 4)   /* Good Octets TX Count High - R/clr */
+#define E1000_RNBC (0x040A0 / 4)    /* RX No Buffers Count - R/clr */
+
+#define E1000_RXCSUM (0x05000 / 4) /* RX Checksum Control - RW */
 #define E1000_MTA (0x05200 / 4) /* Multicast Table Array - RW Array */
 #define E1000_RA (0x05400 / 4)  /* Receive Address        - RW Array */
+#define E1000_RA_ENTRIES 16     /* RAL/RAH pairs; entry 0 is our MAC */
+#define E1000_RAH_AV 0x80000000 /* Receive address valid */
+#define E1000_MTA_ENTRIES 128   /* 4096-bit multicast hash table */
 
 /* Device Control */
 #define E1000_CTL_RST 0x04000000 /* full reset */
 
+/* Interrupt Cause / Mask bits */
+#define E1000_ICR_RXT0 0x00000080 /* RX timer / descriptor write-back */
+
 /* Transmit Control */
 #define E1000_TCTL_EN 0x00000002  /* enable tx */
 #define E1000_TCTL_PSP 0x00000008 /* pad short packets */
@@ -50,10 +106,17 @@ e1000_transmit(char* buf, int len);
 
 /* Receive Control */
 #define E1000_RCTL_EN 0x00000002      /* enable */
+#define E1000_RCTL_LPE 0x00000020     /* long packet enable (jumbo) */
 #define E1000_RCTL_BAM 0x00008000     /* broadcast enable */
 #define E1000_RCTL_SZ_2048 0x00000000 /* rx buffer size 2048 */
+#define E1000_RCTL_SZ_4096 0x00030000 /* rx buffer size 4096, with BSEX */
+#define E1000_RCTL_BSEX 0x02000000    /* buffer size extension (x16) */
 #define E1000_RCTL_SECRC 0x04000000   /* Strip Ethernet CRC */
 
+/* Receive Checksum Control */
+#define E1000_RXCSUM_IPOFL 0x00000100 /* IPv4 checksum offload */
+#define E1000_RXCSUM_TUOFL 0x00000200 /* TCP/UDP checksum offload */
+
 /* Transmit Descriptor command definitions [E1000 3.3.3.1] */
 #define E1000_TXD_CMD_EOP 0x01 /* End of Packet */
 #define E1000_TXD_CMD_RS 0x08  /* Report Status */
@@ -61,6 +124,40 @@ e1000_transmit(char* buf, int len);
 /* Transmit Descriptor status definitions [E1000 3.3.3.2] */
 #define E1000_TXD_STAT_DD 0x00000001 /* Descriptor Done */
 
+/* Extended (context / data) descriptor bits [E1000 3.3.6, 3.3.7].
+   These sit in the 32-bit cmd_and_length / lower word. */
+#define E1000_TXD_DTYP_D 0x00100000   /* data descriptor (else context) */
+#define E1000_TXD_XCMD_EOP 0x01000000 /* end of packet (data) */
+#define E1000_TXD_XCMD_TCP 0x01000000 /* L4 is TCP, else UDP (context) */
+#define E1000_TXD_XCMD_IP 0x02000000  /* L3 is IPv4 (context) */
+#define E1000_TXD_XCMD_RS 0x08000000  /* report status */
+#define E1000_TXD_XCMD_DEXT 0x20000000 /* extended descriptor format */
+#define E1000_TXD_POPTS_IXSM 0x01     /* insert IP checksum */
+#define E1000_TXD_POPTS_TXSM 0x02     /* insert TCP/UDP checksum */
+
+/* [E1000 3.3.6] TCP/IP Context Transmit Descriptor */
+struct tx_ctx_desc {
+    uchar ipcss;   /* IP checksum start */
+    uchar ipcso;   /* IP checksum offset */
+    ushort ipcse;  /* IP checksum end (inclusive) */
+    uchar tucss;   /* TCP/UDP checksum start */
+    uchar tucso;   /* TCP/UDP checksum offset */
+    ushort tucse;  /* TCP/UDP checksum end, 0 = end of packet */
+    uint32 cmd_and_length;
+    uchar status;
+    uchar hdr_len;
+    ushort mss;
+};
+
+/* [E1000 3.3.7] TCP/IP Data Transmit Descriptor */
+struct tx_data_desc {
+    uint64 addr;
+    uint32 lower; /* length | DTYP | DCMD */
+    uchar status;
+    uchar popts;
+    ushort special;
+};
+
 /* [E1000 3.3.3] Legacy Transmit Descriptor Format */
 struct tx_desc {
     uint64 addr;
@@ -75,6 +172,11 @@ struct tx_desc {
 /* Receive Descriptor bit definitions [E1000 3.2.3.1] */
 #define E1000_RXD_STAT_DD 0x01  /* Descriptor Done */
 #define E1000_RXD_STAT_EOP 0x02 /* End of Packet */
+#define E1000_RXD_STAT_IXSM 0x04  /* Ignore checksum indication */
+#define E1000_RXD_STAT_TCPCS 0x20 /* TCP/UDP checksum calculated */
+#define E1000_RXD_STAT_IPCS 0x40  /* IP checksum calculated */
+#define E1000_RXD_ERR_TCPE 0x20   /* TCP/UDP checksum error */
+#define E1000_RXD_ERR_IPE 0x40    /* IP checksum error */
 
 /* [E1000 3.2.3] Legacy Receive Descriptor Format */
 struct rx_desc {
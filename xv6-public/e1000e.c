@@ -0,0 +1,579 @@
+//
+// Intel 82574 (e1000e) network driver, multi-queue.
+// Works with QEMU's -device e1000e (vendor 0x8086, device 0x10D3).
+//
+// The 82574 has two RX/TX queue pairs. RSS hashes each received
+// packet's addresses and uses the hash to pick an RX queue through
+// the redirection table (RETA). Each RX queue has its own ring, lock
+// and MSI-X vector, and each vector is bound to a different CPU, so
+// the two queues are drained in parallel. Transmit picks the queue
+// of the sending CPU, so senders on different CPUs don't contend.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "e1000_dev.h"
+#include "e1000e_dev.h"
+#include "mbuf.h"
+#include "netctl.h"
+#include "netstat.h"
+#include "netdev.h"
+#include "pci.h"
+
+#define E1000E_RING_SIZE 256
+
+// Per-queue rings live in the kernel image so that they are
+// physically contiguous, as in e1000.c.
+static union e1000e_rx_desc rx_rings[E1000E_NQUEUES][E1000E_RING_SIZE]
+    __attribute__((aligned(PGSIZE)));
+static struct e1000e_tx_desc tx_rings[E1000E_NQUEUES][E1000E_RING_SIZE]
+    __attribute__((aligned(PGSIZE)));
+
+struct e1000e_queue {
+    struct spinlock rxlock;  // held for a whole e1000e_rxq() pass
+    struct spinlock lock;    // protects everything below
+    int id;
+
+    char* rx_bufs[E1000E_RING_SIZE];
+    uint32 rx_next;        // next RX descriptor the NIC will fill
+
+    struct mbuf* tx_bufs[E1000E_RING_SIZE];  // mbuf to free once sent
+    uint32 tx_tail;        // next TX descriptor to fill (shadows TDT)
+    uint32 tx_clean;       // oldest TX descriptor not yet reclaimed
+
+    int vector;            // MSI-X vector, or -1
+    int cpu;               // CPU the vector is bound to
+
+    uint64 intrs;          // interrupts for this queue
+    uint64 rx_packets;
+    uint64 rx_bytes;
+    uint64 rx_nomem;       // frames dropped: no pktbuf to replace the buffer
+    uint64 tx_packets;
+    uint64 tx_bytes;
+    uint64 tx_ring_full;
+};
+
+static struct e1000e_queue queues[E1000E_NQUEUES];
+static int nqueues = E1000E_NQUEUES;  // RX queues RSS spreads over
+static int msix;                      // one vector per queue?
+
+static volatile uint32* regs;
+static struct pci_func* e1000e_pcif;
+static struct netdev e1000e_netdev;
+
+// Clear-on-read statistics registers, at the same offsets as on
+// the 82540EM, accumulated under statlock.
+static struct spinlock statlock;
+static struct {
+    uint64 gprc, gptc, gorc, gotc, mpc, rnbc, crcerrs, colc;
+} hwstats;
+
+// Frames handed to net_rx() per lock hold in e1000e_rxq().
+#define RX_BATCH 16
+
+// [82574 7.1.2.8] Default RSS key from the Microsoft RSS spec.
+static const uint32 rss_key[E1000E_RSSRK_ENTRIES] = {
+    0xda565a6d, 0xc20e5b25, 0x3d256741, 0xb08fa343, 0xcb2bcad0,
+    0xb4307bae, 0xa32dcb77, 0x0cf23080, 0x3bb7426a, 0xfa01acbe,
+};
+
+// ------------------------------------------------------------
+// rss_program()
+// Spread the 128 redirection table entries over the first n
+// queues. With n = 1 every packet lands on queue 0.
+// ------------------------------------------------------------
+static void
+rss_program(int n) {
+    for (int r = 0; r < E1000E_RETA_ENTRIES; r++) {
+        uint32 v = 0;
+        for (int b = 0; b < 4; b++)
+            if ((r * 4 + b) % n == 1) v |= E1000E_RETA_Q1 << (8 * b);
+        regs[E1000E_RETA + r] = v;
+    }
+}
+
+// ------------------------------------------------------------
+// e1000e_rxq()
+// Hand up to budget completed frames on queue q to the stack
+// (budget <= 0: all of them) and return how many. Each frame's
+// pktbuf goes up as is in an mbuf and the descriptor gets a fresh
+// one. Frames are collected on a list and delivered outside the
+// queue lock, which transmit also takes; rxlock keeps concurrent
+// passes in ring order.
+// ------------------------------------------------------------
+static int
+e1000e_rxq(struct e1000e_queue* q, int budget) {
+    struct mbuf *pkts, **tail;
+    int n, done = 0;
+
+    acquire(&q->rxlock);
+    do {
+        n = 0;
+        pkts = 0;
+        tail = &pkts;
+        acquire(&q->lock);
+        while (n < RX_BATCH && (budget <= 0 || done + n < budget)) {
+            uint32 i = q->rx_next;
+            union e1000e_rx_desc* d = &rx_rings[q->id][i];
+            uint32 status = d->wb.status;
+            if ((status & E1000E_RXD_STAT_DD) == 0) break;
+
+            int len = d->wb.length;
+            if ((status & E1000E_RXD_STAT_EOP) && len > 0 &&
+                len <= PKTBUF_SIZE) {
+                char* fresh = pktbuf_alloc();
+                struct mbuf* m = 0;
+                if (fresh &&
+                    (m = mbuf_wrap(q->rx_bufs[i], PKTBUF_SIZE, len)) != 0) {
+                    m->dev = &e1000e_netdev;
+                    *tail = m;
+                    tail = &m->nextpkt;
+                    n++;
+                    q->rx_bufs[i] = fresh;
+                    q->rx_packets++;
+                    q->rx_bytes += len;
+                } else {
+                    if (fresh) pktbuf_free(fresh);
+                    q->rx_nomem++;  // drop, keep the old buffer
+                }
+            }
+
+            // the write-back overwrote the buffer address; re-arm
+            d->read.addr = V2P(q->rx_bufs[i]);
+            d->read.zero = 0;
+            regs[E1000E_RDT(q->id)] = i;
+            q->rx_next = (i + 1) % E1000E_RING_SIZE;
+        }
+        release(&q->lock);
+
+        while (pkts) {
+            struct mbuf* m = pkts;
+            pkts = m->nextpkt;
+            m->nextpkt = 0;
+            net_rx(m);
+        }
+        done += n;
+    } while (n == RX_BATCH && (budget <= 0 || done < budget));
+    release(&q->rxlock);
+    return done;
+}
+
+// netdev rx_poll(): drain the queues outside of the interrupt path.
+static int
+e1000e_rx_poll(int budget) {
+    int done = 0;
+    for (int i = 0; i < E1000E_NQUEUES; i++)
+        done += e1000e_rxq(&queues[i], budget);
+    return done;
+}
+
+// MSI-X handlers, one per RX queue. The cause is cleared by EIAC
+// and masked in IMS when the message is sent, so unmasking it after
+// draining the ring re-arms the queue; a frame that arrived in the
+// meantime raises a new interrupt right away.
+static void
+e1000e_intr_q(int id) {
+    struct e1000e_queue* q = &queues[id];
+    q->intrs++;
+    e1000e_rxq(q, 0);
+    regs[E1000E_IMS] = id ? E1000E_ICR_RXQ1 : E1000E_ICR_RXQ0;
+}
+
+static void
+e1000e_intr_q0(void) {
+    e1000e_intr_q(0);
+}
+
+static void
+e1000e_intr_q1(void) {
+    e1000e_intr_q(1);
+}
+
+// Link changes and, without MSI-X, everything else: reading ICR
+// acknowledges all causes, so poll both queues.
+static void
+e1000e_intr_other(void) {
+    uint32 icr = regs[E1000E_ICR];
+    if (!msix || (icr & (E1000E_ICR_RXQ0 | E1000E_ICR_RXQ1))) {
+        for (int i = 0; i < E1000E_NQUEUES; i++) {
+            queues[i].intrs++;
+            e1000e_rxq(&queues[i], 0);
+        }
+    }
+}
+
+// ------------------------------------------------------------
+// tx_reclaim()
+// Free the buffers of frames the NIC has finished with. RS is set on
+// every frame's last descriptor, so its DD bit covers the frame.
+// Caller holds q->lock.
+// ------------------------------------------------------------
+static void
+tx_reclaim(struct e1000e_queue* q) {
+    struct e1000e_tx_desc* ring = tx_rings[q->id];
+
+    while (q->tx_clean != q->tx_tail) {
+        uint32 j = q->tx_clean;
+        while (j != q->tx_tail && (ring[j].cmd & E1000E_TXD_CMD_EOP) == 0)
+            j = (j + 1) % E1000E_RING_SIZE;
+        if (j == q->tx_tail || (ring[j].status & E1000E_TXD_STAT_DD) == 0)
+            break;
+
+        for (;;) {
+            uint32 c = q->tx_clean;
+            if (q->tx_bufs[c]) {
+                mbuf_free(q->tx_bufs[c]);
+                q->tx_bufs[c] = 0;
+            }
+            q->tx_clean = (c + 1) % E1000E_RING_SIZE;
+            if (c == j) break;
+        }
+    }
+}
+
+// Free descriptors on queue q, reclaiming first. Caller holds q->lock.
+static int
+tx_room(struct e1000e_queue* q) {
+    tx_reclaim(q);
+    uint32 used = (q->tx_tail + E1000E_RING_SIZE - q->tx_clean) %
+                  E1000E_RING_SIZE;
+    return E1000E_RING_SIZE - 1 - used;
+}
+
+// Queue frame m on q, one descriptor per mbuf. Caller holds q->lock
+// and has checked tx_room().
+static void
+tx_put(struct e1000e_queue* q, struct mbuf* m) {
+    while (m) {
+        struct mbuf* next = m->next;
+        uint32 t = q->tx_tail;
+        struct e1000e_tx_desc* d = &tx_rings[q->id][t];
+
+        d->addr = V2P(m->data);
+        d->length = m->len;
+        d->cso = 0;
+        d->css = 0;
+        d->special = 0;
+        d->status = 0;
+        d->cmd = E1000E_TXD_CMD_IFCS;
+        if (next == 0) d->cmd |= E1000E_TXD_CMD_EOP | E1000E_TXD_CMD_RS;
+
+        q->tx_bufs[t] = m;
+        q->tx_tail = (t + 1) % E1000E_RING_SIZE;
+        m = next;
+    }
+}
+
+// TX queue of the calling CPU.
+static struct e1000e_queue*
+tx_queue(void) {
+    int c;
+    pushcli();
+    c = cpu - cpus;
+    popcli();
+    return &queues[c % E1000E_NQUEUES];
+}
+
+// ------------------------------------------------------------
+// e1000e_transmit_batch()
+// Send n frames (mbuf chains) on the calling CPU's queue with one
+// doorbell, like e1000_transmit_batch(). Checksums are always
+// computed by the stack (no NETDEV_F_TXCSUM), so m->csum is
+// ignored. Returns how many were queued; the caller frees the rest.
+// ------------------------------------------------------------
+int
+e1000e_transmit_batch(struct mbuf** pkts, int n) {
+    struct e1000e_queue* q = tx_queue();
+    int i;
+
+    acquire(&q->lock);
+    int room = tx_room(q);
+    for (i = 0; i < n; i++) {
+        int nsegs = 0, total = 0;
+        for (struct mbuf* m = pkts[i]; m; m = m->next) {
+            nsegs++;
+            total += m->len;
+        }
+        if (nsegs == 0 || nsegs > TX_MAX_FRAGS || total > E1000_TX_MAXFRAME)
+            break;
+        if (nsegs > room) {
+            q->tx_ring_full++;
+            break;
+        }
+        tx_put(q, pkts[i]);
+        room -= nsegs;
+        q->tx_packets++;
+        q->tx_bytes += total;
+    }
+    if (i > 0) regs[E1000E_TDT(q->id)] = q->tx_tail;
+    release(&q->lock);
+    return i;
+}
+
+// Send one frame; 0, or -1 if it is bad or the queue is full (the
+// caller then still owns m).
+int
+e1000e_transmit(struct mbuf* m) {
+    return e1000e_transmit_batch(&m, 1) == 1 ? 0 : -1;
+}
+
+int
+e1000e_mtu(void) {
+    return ETH_MTU;
+}
+
+// ------------------------------------------------------------
+// e1000e_ctl()
+// NETCTL_QUEUES: spread received packets over 1 or 2 queues.
+// ------------------------------------------------------------
+int
+e1000e_ctl(int cmd, int arg) {
+    if (regs == 0) return -1;
+    switch (cmd) {
+        case NETCTL_QUEUES:
+            if (arg < 1 || arg > E1000E_NQUEUES) return -1;
+            nqueues = arg;
+            rss_program(nqueues);
+            return 0;
+    }
+    return -1;
+}
+
+// Fill in the driver and hardware parts of st (see netstat.h),
+// summing the queues. irq_cpu is the CPU of queue 0.
+void
+e1000e_getstats(struct netstat* st) {
+    acquire(&statlock);
+    hwstats.gprc += regs[E1000_GPRC];
+    hwstats.gptc += regs[E1000_GPTC];
+    hwstats.gorc += regs[E1000_GORCL];
+    hwstats.gorc += (uint64)regs[E1000_GORCH] << 32;
+    hwstats.gotc += regs[E1000_GOTCL];
+    hwstats.gotc += (uint64)regs[E1000_GOTCH] << 32;
+    hwstats.mpc += regs[E1000_MPC];
+    hwstats.rnbc += regs[E1000_RNBC];
+    hwstats.crcerrs += regs[E1000_CRCERRS];
+    hwstats.colc += regs[E1000_COLC];
+    st->hw_rx_packets = hwstats.gprc;
+    st->hw_rx_bytes = hwstats.gorc;
+    st->hw_tx_packets = hwstats.gptc;
+    st->hw_tx_bytes = hwstats.gotc;
+    st->hw_missed = hwstats.mpc;
+    st->hw_no_buffers = hwstats.rnbc;
+    st->hw_crc_errors = hwstats.crcerrs;
+    st->hw_collisions = hwstats.colc;
+    release(&statlock);
+
+    st->irq_cpu = queues[0].cpu;
+    for (int i = 0; i < E1000E_NQUEUES; i++) {
+        struct e1000e_queue* q = &queues[i];
+        st->interrupts += q->intrs;
+        if (q->cpu < NETSTAT_NCPU) st->intr_cpu[q->cpu] += q->intrs;
+        st->rx_packets += q->rx_packets;
+        st->rx_bytes += q->rx_bytes;
+        st->rx_nomem += q->rx_nomem;
+        st->tx_packets += q->tx_packets;
+        st->tx_bytes += q->tx_bytes;
+        st->tx_ring_full += q->tx_ring_full;
+    }
+}
+
+// ------------------------------------------------------------
+// e1000e_queue_init()
+// Allocate RX buffers and point queue id's rings at the NIC.
+// ------------------------------------------------------------
+static void
+e1000e_queue_init(int id) {
+    struct e1000e_queue* q = &queues[id];
+    int i;
+
+    initlock(&q->lock, id ? "e1000e.q1" : "e1000e.q0");
+    initlock(&q->rxlock, id ? "e1000e.rx1" : "e1000e.rx0");
+    q->id = id;
+    q->vector = -1;
+
+    memset(rx_rings[id], 0, sizeof(rx_rings[id]));
+    for (i = 0; i < E1000E_RING_SIZE; i++) {
+        q->rx_bufs[i] = pktbuf_alloc();
+        if (q->rx_bufs[i] == 0) panic("e1000e rx pktbuf");
+        rx_rings[id][i].read.addr = V2P(q->rx_bufs[i]);
+    }
+    uint64 pa = V2P(rx_rings[id]);
+    regs[E1000E_RDBAL(id)] = (uint32)pa;
+    regs[E1000E_RDBAH(id)] = (uint32)(pa >> 32);
+    regs[E1000E_RDLEN(id)] = sizeof(rx_rings[id]);
+    regs[E1000E_RDH(id)] = 0;
+    regs[E1000E_RDT(id)] = E1000E_RING_SIZE - 1;
+    q->rx_next = 0;
+
+    memset(tx_rings[id], 0, sizeof(tx_rings[id]));
+    pa = V2P(tx_rings[id]);
+    regs[E1000E_TDBAL(id)] = (uint32)pa;
+    regs[E1000E_TDBAH(id)] = (uint32)(pa >> 32);
+    regs[E1000E_TDLEN(id)] = sizeof(tx_rings[id]);
+    regs[E1000E_TDH(id)] = regs[E1000E_TDT(id)] = 0;
+    q->tx_tail = q->tx_clean = 0;
+}
+
+static void
+e1000e_start(void);
+
+// The device as the stack sees it, see netdev.h. No multicast
+// filter yet.
+static struct netdev e1000e_netdev = {
+    "e1000e",
+    NETDEV_F_MQ,
+    e1000e_transmit,
+    e1000e_transmit_batch,
+    e1000e_rx_poll,
+    e1000e_mtu,
+    e1000e_getstats,
+    e1000e_ctl,
+    e1000e_dump,
+    0,
+    0,
+    0,
+    e1000e_start,
+};
+
+// ------------------------------------------------------------
+// e1000e_msix_setup()
+// Give each RX queue an MSI-X vector on its own CPU (queue n on
+// CPU n) and the last entry one for everything else, all masked
+// until e1000e_start(). Returns -1, with the vectors it took given
+// back, if irq_alloc() runs out.
+// ------------------------------------------------------------
+static int
+e1000e_msix_setup(struct pci_func* f) {
+    void (*handlers[E1000E_NQUEUES])(void) = {e1000e_intr_q0,
+                                              e1000e_intr_q1};
+    uint32 ivar = 0;
+    int i;
+
+    for (i = 0; i < E1000E_NQUEUES; i++) {
+        queues[i].cpu = i % ncpu;
+        queues[i].vector = pci_msix_vector(f, i, handlers[i], queues[i].cpu);
+        if (queues[i].vector < 0) goto fail;
+        ivar |= (i | E1000E_IVAR_VALID) << E1000E_IVAR_RXQ(i);
+    }
+    if (pci_msix_vector(f, E1000E_NQUEUES, e1000e_intr_other, 0) < 0)
+        goto fail;
+    ivar |= (E1000E_NQUEUES | E1000E_IVAR_VALID) << E1000E_IVAR_OTHER;
+    regs[E1000E_IVAR] = ivar;
+    regs[E1000E_CTRL_EXT] |= E1000E_CTRL_EXT_PBA;
+    // clear a queue's cause when its message is sent
+    regs[E1000E_EIAC] = E1000E_ICR_RXQ0 | E1000E_ICR_RXQ1;
+    return 0;
+
+fail:
+    for (i = 0; i < E1000E_NQUEUES; i++) {
+        if (queues[i].vector >= 0) irq_free(queues[i].vector);
+        queues[i].vector = -1;
+        queues[i].cpu = 0;
+    }
+    return -1;
+}
+
+// ------------------------------------------------------------
+// e1000e_attach()
+// Called by pci_init() for an 82574: reset it, set up both queue
+// pairs and RSS, and give each RX queue an MSI-X vector on its own
+// CPU (queue n on CPU n). Without MSI-X one interrupt serves both.
+// The interrupts are turned on later, by e1000e_start().
+// ------------------------------------------------------------
+int
+e1000e_attach(struct pci_func* f) {
+    int i;
+
+    pci_func_enable(f);
+    regs = pci_map_bar(f, 0);
+    if (regs == 0) return -1;
+    e1000e_pcif = f;
+
+    // Reset the device with interrupts off
+    regs[E1000E_IMC] = 0xffffffff;
+    regs[E1000E_CTRL] |= E1000E_CTRL_RST;
+    regs[E1000E_IMC] = 0xffffffff;
+    __sync_synchronize();
+    regs[E1000E_CTRL] |= E1000E_CTRL_SLU;
+    initlock(&statlock, "e1000e.stats");
+
+    for (i = 0; i < E1000E_NQUEUES; i++) e1000e_queue_init(i);
+
+    // filter by qemu's MAC address, 52:54:00:12:34:56
+    regs[E1000E_RA] = 0x12005452;
+    regs[E1000E_RA + 1] = 0x5634 | (1 << 31);
+    for (i = 0; i < E1000_MTA_ENTRIES; i++) regs[E1000E_MTA + i] = 0;
+
+    // RSS needs extended RX descriptors and the hash in place of
+    // the packet checksum [82574 7.1.2.8]. The 82574 hashes IPv4
+    // addresses (plus ports for TCP only).
+    regs[E1000E_RFCTL] = E1000E_RFCTL_EXTEN;
+    regs[E1000E_RXCSUM] = E1000E_RXCSUM_PCSD;
+    for (i = 0; i < E1000E_RSSRK_ENTRIES; i++)
+        regs[E1000E_RSSRK + i] = rss_key[i];
+    rss_program(nqueues);
+    regs[E1000E_MRQC] = E1000E_MRQC_RSS | E1000E_MRQC_IPV4 |
+                        E1000E_MRQC_TCPIPV4;
+
+    regs[E1000E_TCTL] = E1000E_TCTL_EN | E1000E_TCTL_PSP |
+                        (0x10 << E1000E_TCTL_CT_SHIFT) |
+                        (0x40 << E1000E_TCTL_COLD_SHIFT);
+    regs[E1000E_TIPG] = 10 | (8 << 10) | (6 << 20);
+    regs[E1000E_RCTL] = E1000E_RCTL_EN | E1000E_RCTL_BAM |
+                        E1000E_RCTL_SZ_2048 | E1000E_RCTL_SECRC;
+
+    // Interrupts: MSI-X entry n for RX queue n, the last for the rest.
+    // With too few entries or vectors, MSI-X goes off again and one
+    // MSI or INTx interrupt serves both queues.
+    int nvec = pci_msix_init(f);
+    if (nvec >= E1000E_NQUEUES + 1 && e1000e_msix_setup(f) == 0) {
+        msix = 1;
+        cprintf("e1000e: %d queues, MSI-X vectors %d %d on cpus %d %d\n",
+                E1000E_NQUEUES, queues[0].vector, queues[1].vector,
+                queues[0].cpu, queues[1].cpu);
+    } else {
+        if (nvec >= 0) pci_msix_disable(f);
+        if (pci_intr_enable(f, e1000e_intr_other, 0) < 0) return -1;
+    }
+
+    // Interrupts stay off until e1000e_start().
+    netdev_register(&e1000e_netdev);
+    return 0;
+}
+
+// ------------------------------------------------------------
+// e1000e_start()
+// netdev start(): turn the interrupts on. attach runs from
+// pci_init(), before the other CPUs are started and before
+// netinit() has set up the stack, so a queue vector that fired
+// then would run the stack on a CPU that isn't up yet.
+// ------------------------------------------------------------
+static void
+e1000e_start(void) {
+    if (msix)
+        for (int i = 0; i <= E1000E_NQUEUES; i++)
+            pci_msix_unmask(e1000e_pcif, i);
+    regs[E1000E_IMS] = E1000E_ICR_RXT0 | E1000E_ICR_RXQ0 | E1000E_ICR_RXQ1;
+}
+
+// Print per-queue counters to the console (see net_debug()).
+void
+e1000e_dump(void) {
+    if (regs == 0) return;
+    cprintf("e1000e: %s, rss over %d queues\n", msix ? "msi-x" : "one irq",
+            nqueues);
+    for (int i = 0; i < E1000E_NQUEUES; i++) {
+        struct e1000e_queue* q = &queues[i];
+        cprintf("e1000e: q%d cpu %d vector %d intrs %d rx %d pkts %d bytes "
+                "nomem %d, tx %d pkts %d bytes full %d\n",
+                i, q->cpu, q->vector, (int)q->intrs, (int)q->rx_packets,
+                (int)q->rx_bytes, (int)q->rx_nomem, (int)q->tx_packets,
+                (int)q->tx_bytes, (int)q->tx_ring_full);
+    }
+}
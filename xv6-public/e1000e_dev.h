@@ -0,0 +1,118 @@
+//
+// Intel 82574 (e1000e) hardware definitions: registers and the
+// descriptor formats used by e1000e.c. QEMU: -device e1000e.
+// From the Intel 82574 GbE Controller Family datasheet.
+//
+// NOTE: Register macros use (byte_offset/4), like e1000_dev.h.
+//
+#pragma once
+
+#define E1000E_NQUEUES 2 /* RX/TX queue pairs on the 82574 */
+
+/* Registers */
+#define E1000E_CTRL (0x00000 / 4)     /* Device Control - RW */
+#define E1000E_CTRL_EXT (0x00018 / 4) /* Extended Device Control - RW */
+#define E1000E_ICR (0x000C0 / 4)      /* Interrupt Cause Read - RC */
+#define E1000E_IMS (0x000D0 / 4)      /* Interrupt Mask Set - RW */
+#define E1000E_IMC (0x000D8 / 4)      /* Interrupt Mask Clear - WO */
+#define E1000E_EIAC (0x000DC / 4)     /* Extended Int. Auto Clear - RW */
+#define E1000E_IVAR (0x000E4 / 4)     /* Interrupt Vector Allocation - RW */
+#define E1000E_RCTL (0x00100 / 4)     /* RX Control - RW */
+#define E1000E_TCTL (0x00400 / 4)     /* TX Control - RW */
+#define E1000E_TIPG (0x00410 / 4)     /* TX Inter-packet gap - RW */
+#define E1000E_RXCSUM (0x05000 / 4)   /* RX Checksum Control - RW */
+#define E1000E_RFCTL (0x05008 / 4)    /* RX Filter Control - RW */
+#define E1000E_MTA (0x05200 / 4)      /* Multicast Table Array - RW Array */
+#define E1000E_RA (0x05400 / 4)       /* Receive Address - RW Array */
+#define E1000E_MRQC (0x05818 / 4)     /* Multiple RX Queues Command - RW */
+#define E1000E_RETA (0x05C00 / 4)     /* Redirection Table - RW Array */
+#define E1000E_RSSRK (0x05C80 / 4)    /* RSS Random Key - RW Array */
+
+/* Per-queue ring registers; queue n is 0x100 bytes after queue 0 */
+#define E1000E_RDBAL(n) ((0x02800 + 0x100 * (n)) / 4)
+#define E1000E_RDBAH(n) ((0x02804 + 0x100 * (n)) / 4)
+#define E1000E_RDLEN(n) ((0x02808 + 0x100 * (n)) / 4)
+#define E1000E_RDH(n) ((0x02810 + 0x100 * (n)) / 4)
+#define E1000E_RDT(n) ((0x02818 + 0x100 * (n)) / 4)
+#define E1000E_TDBAL(n) ((0x03800 + 0x100 * (n)) / 4)
+#define E1000E_TDBAH(n) ((0x03804 + 0x100 * (n)) / 4)
+#define E1000E_TDLEN(n) ((0x03808 + 0x100 * (n)) / 4)
+#define E1000E_TDH(n) ((0x03810 + 0x100 * (n)) / 4)
+#define E1000E_TDT(n) ((0x03818 + 0x100 * (n)) / 4)
+
+#define E1000E_RETA_ENTRIES 32  /* 128 one-byte entries, 4 per register */
+#define E1000E_RSSRK_ENTRIES 10 /* 40-byte hash key */
+
+/* Device Control */
+#define E1000E_CTRL_SLU 0x00000040   /* set link up */
+#define E1000E_CTRL_RST 0x04000000   /* full reset */
+#define E1000E_CTRL_EXT_PBA 0x80000000 /* PBA support, set for MSI-X */
+
+/* Interrupt causes */
+#define E1000E_ICR_RXT0 0x00000080  /* RX timer, without MSI-X */
+#define E1000E_ICR_RXQ0 0x00100000  /* RX queue 0 */
+#define E1000E_ICR_RXQ1 0x00200000  /* RX queue 1 */
+#define E1000E_ICR_OTHER 0x01000000 /* link status and the like */
+
+/* IVAR: a 3-bit MSI-X vector plus a valid bit for each cause */
+#define E1000E_IVAR_VALID 0x8
+#define E1000E_IVAR_RXQ(n) (4 * (n))   /* shift for RX queue n */
+#define E1000E_IVAR_OTHER 16           /* shift for other causes */
+
+/* Receive Control */
+#define E1000E_RCTL_EN 0x00000002      /* enable */
+#define E1000E_RCTL_BAM 0x00008000     /* broadcast enable */
+#define E1000E_RCTL_SZ_2048 0x00000000 /* rx buffer size 2048 */
+#define E1000E_RCTL_SECRC 0x04000000   /* strip Ethernet CRC */
+
+/* RX filter / checksum control needed for RSS */
+#define E1000E_RFCTL_EXTEN 0x00008000  /* extended RX descriptors */
+#define E1000E_RXCSUM_PCSD 0x00002000  /* RSS hash in place of csum */
+
+/* Multiple RX queues: RSS enable and hashed fields */
+#define E1000E_MRQC_RSS 0x00000001
+#define E1000E_MRQC_TCPIPV4 0x00010000
+#define E1000E_MRQC_IPV4 0x00020000
+#define E1000E_RETA_Q1 0x80 /* entry bit 7 selects queue 1 */
+
+/* Transmit Control */
+#define E1000E_TCTL_EN 0x00000002  /* enable tx */
+#define E1000E_TCTL_PSP 0x00000008 /* pad short packets */
+#define E1000E_TCTL_CT_SHIFT 4
+#define E1000E_TCTL_COLD_SHIFT 12
+
+/* Extended receive descriptor status bits */
+#define E1000E_RXD_STAT_DD 0x01  /* Descriptor Done */
+#define E1000E_RXD_STAT_EOP 0x02 /* End of Packet */
+
+/* Extended receive descriptor. Software fills in addr; the NIC
+   writes the frame's status back over the whole descriptor. */
+union e1000e_rx_desc {
+    struct {
+        uint64 addr; /* buffer address (PHYS) */
+        uint64 zero;
+    } read;
+    struct {
+        uint32 mrq;       /* RSS type and queue */
+        uint32 rss_hash;  /* RSS hash of the packet */
+        uint32 status;    /* extended status (19:0) and errors (31:20) */
+        ushort length;    /* bytes DMAed into the buffer */
+        ushort vlan;
+    } wb;
+};
+
+/* Legacy transmit descriptor; same layout as on the 82540EM */
+struct e1000e_tx_desc {
+    uint64 addr;
+    ushort length;
+    uchar cso;
+    uchar cmd;
+    uchar status;
+    uchar css;
+    ushort special;
+};
+
+#define E1000E_TXD_CMD_EOP 0x01  /* End of Packet */
+#define E1000E_TXD_CMD_IFCS 0x02 /* Insert FCS */
+#define E1000E_TXD_CMD_RS 0x08   /* Report Status */
+#define E1000E_TXD_STAT_DD 0x01  /* Descriptor Done */
@@ -30,7 +30,8 @@ main(void)
   consoleinit();   // console hardware
   uartinit();      // serial port
 
-  pci_init();     // scan PCI, init e1000
+  pktbuf_init();   // network buffer pools
+  pci_init();     // scan PCI, attach drivers
 
   pinit();         // process table
   binit();         // buffer cache
@@ -39,6 +40,7 @@ main(void)
   startothers();   // start other processors
   kinit2();
   userinit();      // first user process
+  netinit();       // network stack and driver threads
   mpmain();        // finish this processor's setup
 
 }
@@ -0,0 +1,215 @@
+// Packet buffers (struct mbuf, see mbuf.h) for the network stack.
+//
+// Descriptors come from the netobj pool and data buffers from the
+// pktbuf pool, so building, cloning and freeing a packet stays off
+// kalloc(). Drivers adopt their own receive buffers with
+// mbuf_wrap(), which lets a frame travel from the RX ring to the
+// socket without being copied.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mbuf.h"
+
+// The descriptor must fit in a netobj.
+typedef char mbuf_fits_netobj[sizeof(struct mbuf) <= NETOBJ_SIZE ? 1 : -1];
+
+// Free hooks for buffers that aren't pktbufs, by mbuf extfree
+// number; 0 stands for pktbuf_free().
+#define MBUF_NEXTFREE 4
+static void (*extfree[MBUF_NEXTFREE])(char*);
+static int nextfree = 1;
+
+// ------------------------------------------------------------
+// mbuf_extfree_register()
+// A driver whose receive buffers don't come from the pktbuf pool
+// (e1000's jumbo buffers) registers the function that takes one
+// back, and sets the number returned in the extfree of the mbufs
+// it wraps them in. Called at attach time. Returns -1 if there are
+// MBUF_NEXTFREE - 1 hooks already.
+// ------------------------------------------------------------
+int
+mbuf_extfree_register(void (*free)(char*)) {
+    if (nextfree == MBUF_NEXTFREE) return -1;
+    extfree[nextfree] = free;
+    return nextfree++;
+}
+
+// ------------------------------------------------------------
+// mbuf_wrap()
+// Make an mbuf for a frame of len bytes that a driver received
+// into buf (size bytes, a pktbuf or e1000 jumbo buffer). The mbuf
+// owns buf from then on. Returns 0 if no descriptor is free; the
+// caller then still owns buf.
+// ------------------------------------------------------------
+struct mbuf*
+mbuf_wrap(char* buf, int size, int len) {
+    struct mbuf* m = netobj_alloc();
+    if (m == 0) return 0;
+
+    m->next = m->nextpkt = 0;
+    m->buf = m->data = buf;
+    m->ext = m;
+    m->dev = 0;
+    m->len = len;
+    m->size = size;
+    m->csum = 0;
+    m->extfree = 0;
+    m->refs = 1;
+    m->stamp = ticks;
+    return m;
+}
+
+// An empty mbuf with a fresh pktbuf and headroom bytes in front of
+// the data, or 0.
+struct mbuf*
+mbuf_alloc(int headroom) {
+    char* buf = pktbuf_alloc();
+    if (buf == 0) return 0;
+
+    struct mbuf* m = mbuf_wrap(buf, PKTBUF_SIZE, 0);
+    if (m == 0) {
+        pktbuf_free(buf);
+        return 0;
+    }
+    m->data += headroom;
+    return m;
+}
+
+// ------------------------------------------------------------
+// mbuf_free()
+// Free one mbuf of a chain and return the next. The buffer goes
+// back to the pktbuf pool, or to its driver's extfree hook, once no
+// clone refers to it any more.
+// ------------------------------------------------------------
+struct mbuf*
+mbuf_free(struct mbuf* m) {
+    struct mbuf* next = m->next;
+    struct mbuf* e = m->ext;
+
+    if (e != m) netobj_free(m);
+    if (__sync_sub_and_fetch(&e->refs, 1) == 0) {
+        if (e->extfree)
+            extfree[e->extfree](e->buf);
+        else
+            pktbuf_free(e->buf);
+        netobj_free(e);
+    }
+    return next;
+}
+
+// Free a whole packet.
+void
+mbuf_freem(struct mbuf* m) {
+    while (m) m = mbuf_free(m);
+}
+
+// ------------------------------------------------------------
+// mbuf_clone()
+// A second descriptor chain for packet m that shares its buffers,
+// so that one frame can be handed to several consumers without a
+// copy. The data is shared and must be treated as read-only; each
+// clone has its own data/len. Returns 0 if out of descriptors.
+// ------------------------------------------------------------
+struct mbuf*
+mbuf_clone(struct mbuf* m) {
+    struct mbuf *head = 0, **tail = &head;
+
+    for (; m; m = m->next) {
+        struct mbuf* c = netobj_alloc();
+        if (c == 0) {
+            mbuf_freem(head);
+            return 0;
+        }
+        *c = *m;
+        c->next = c->nextpkt = 0;
+        __sync_add_and_fetch(&c->ext->refs, 1);
+        *tail = c;
+        tail = &c->next;
+    }
+    return head;
+}
+
+// ------------------------------------------------------------
+// mbuf_slice()
+// Descriptors for the len bytes of packet m that start off bytes
+// in, sharing m's buffers as mbuf_clone() does, so that a piece of
+// a packet (an IP fragment, say) can be sent without a copy.
+// Returns 0 if out of descriptors or m is too short.
+// ------------------------------------------------------------
+struct mbuf*
+mbuf_slice(struct mbuf* m, int off, int len) {
+    struct mbuf *head = 0, **tail = &head;
+
+    for (; m && off >= m->len; m = m->next) off -= m->len;
+    for (; len > 0; m = m->next) {
+        struct mbuf* c = m ? netobj_alloc() : 0;
+        if (c == 0) {
+            mbuf_freem(head);
+            return 0;
+        }
+        *c = *m;
+        c->next = c->nextpkt = 0;
+        c->data += off;
+        c->len = m->len - off < len ? m->len - off : len;
+        __sync_add_and_fetch(&c->ext->refs, 1);
+        len -= c->len;
+        off = 0;
+        *tail = c;
+        tail = &c->next;
+    }
+    return head;
+}
+
+// Grow the data n bytes to the front, into the headroom, and
+// return the new start; 0 if there isn't room.
+char*
+mbuf_prepend(struct mbuf* m, int n) {
+    if (n > M_HEADROOM(m)) return 0;
+    m->data -= n;
+    m->len += n;
+    return m->data;
+}
+
+// Strip n bytes (a header that has been dealt with) from the front
+// and return the new start; 0 if the mbuf is shorter than that.
+char*
+mbuf_pull(struct mbuf* m, int n) {
+    if (n > m->len) return 0;
+    m->data += n;
+    m->len -= n;
+    return m->data;
+}
+
+// Grow the data n bytes at the end, into the tailroom, and return
+// where the new bytes go; 0 if there isn't room.
+char*
+mbuf_append(struct mbuf* m, int n) {
+    if (n > M_TAILROOM(m)) return 0;
+    char* p = m->data + m->len;
+    m->len += n;
+    return p;
+}
+
+// Cut packet m down to its first len bytes, freeing any mbufs
+// that are left empty.
+void
+mbuf_trim(struct mbuf* m, int len) {
+    for (; m; m = m->next) {
+        if (m->len >= len) {
+            m->len = len;
+            mbuf_freem(m->next);
+            m->next = 0;
+            return;
+        }
+        len -= m->len;
+    }
+}
+
+// Bytes in the whole packet.
+int
+mbuf_pktlen(struct mbuf* m) {
+    int n = 0;
+    for (; m; m = m->next) n += m->len;
+    return n;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+struct netdev;
+
+// ------------------------------------------------------------
+// A packet buffer, after BSD's mbuf. The descriptor is a netobj;
+// the bytes live in a separate buffer (a pktbuf, or an e1000 jumbo
+// buffer) of which [data, data+len) holds the packet. Space in
+// front of data is headroom, where each layer prepends its header
+// in place; space behind it is tailroom.
+//
+// A packet bigger than one buffer is a chain linked through next,
+// one buffer per NIC descriptor. Packets in a queue or batch are
+// linked through nextpkt, head to head. A clone shares the buffer
+// of the mbuf it was made from; ext points at the mbuf that counts
+// the buffer's references, which is the mbuf itself unless it is a
+// clone. The buffer goes back with the last reference, to the
+// pktbuf pool or, for a driver's own buffers, to the free hook the
+// driver registered.
+// ------------------------------------------------------------
+struct mbuf {
+    struct mbuf* next;     // next buffer of this packet
+    struct mbuf* nextpkt;  // next packet in a list
+    char* buf;             // start of the buffer
+    char* data;            // start of the packet in buf
+    struct mbuf* ext;      // mbuf holding refs for buf
+    struct netdev* dev;    // device it arrived on, 0 if built here
+    int len;               // bytes at data
+    ushort size;           // bytes in buf
+    uchar csum;            // RXC_* results on receive, TXO_* on send
+    uchar extfree;         // who takes buf back: 0 the pktbuf pool, else
+                           // a hook from mbuf_extfree_register()
+    int refs;              // references to buf (in ext only)
+    uint stamp;            // ticks when received
+};
+
+// Headroom mbuf_alloc() callers leave for ethernet, IP and UDP
+// headers, rounded up so the payload stays aligned.
+#define MBUF_HDRROOM 64
+
+#define M_HEADROOM(m) ((int)((m)->data - (m)->buf))
+#define M_TAILROOM(m) ((int)((m)->buf + (m)->size - (m)->data) - (m)->len)
@@ -11,6 +11,11 @@
 #include "net.h"
 #include "mmu.h"
 #include "e1000_dev.h"
+#include "mbuf.h"
+#include "netctl.h"
+#include "netstat.h"
+#include "netdev.h"
+#include "route.h"
 
 
 // Helper to copy from a user virtual address into a kernel buffer,
@@ -18,6 +23,10 @@
 static int
 copyin_user(pml4e_t* pgdir, void* dst, addr_t srcva, uint64 len);
 
+static void arp_timer(void);
+static void ping_timer(void);
+static void ipq_timer(void);
+
 
 
 // xv6's Ethernet (MAC) address.
@@ -28,20 +37,163 @@ static uchar local_mac[ETHADDR_LEN] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
 // MAKE_IP_ADDR encodes it in a 32-bit integer in network order layout.
 static uint32 local_ip = MAKE_IP_ADDR(10, 0, 2, 15);
 
-// QEMU “host” MAC address (the other endpoint of the virtual link).
-// This is where we send Ethernet frames destined to the outside world.
-static uchar host_mac[ETHADDR_LEN] = {0x52, 0x55, 0x0a, 0x00, 0x02, 0x02};
 
-// Lock to protect global network data structures (e.g., UDP port queues).
+// Lock for changes to the port table and the multicast groups. Each
+// port's queue has a lock of its own, so receiving on one port
+// doesn't hold up another; the table is read without a lock.
 static struct spinlock netlock;
 
+// Devices registered by the NIC drivers' attach functions (see
+// netdev.h), indexed by the routes' ifindex. netdev, the first one,
+// is the one netctl(), netstat() and recv() polling work on.
+static struct netdev* netdevs[NNETDEV];
+static int nnetdevs;
+static struct netdev* netdev;
+
+// Frames recv() asks the device for before it sleeps.
+#define RECV_POLL_BUDGET 16
+
+// Clock ticks between runs of the device's watchdog (0.5s).
+#define NET_WATCHDOG_TICKS 50
+
+// Clock ticks between ARP cache sweeps (0.1s).
+#define ARP_TIMER_TICKS 10
+
 #define MAX_QUEUED_PER_PORT 16
 
-// queued UDP packet
+// Time to live of the IP packets we send.
+#define IP_TTL 100
+
+// Reassembly: datagrams whose fragments can wait at once, the
+// buffer memory they may hold, and how long each may wait (30s).
+#define IPQ_MAX 16
+#define IPQ_MAXBYTES (512 * 1024)
+#define IPQ_TIMEOUT_TICKS 3000
+
+// ICMP errors we send at most, per second and in one burst.
+#define ICMP_ERR_RATE 100
+#define ICMP_ERR_BURST 10
+
+// ping() requests that can be waiting for their replies at once.
+#define MAX_PINGS 8
+
+// receive-side drop counters, shown by net_debug() (^N)
+static struct {
+  uint64 rx_sw_csum;    // packets whose checksums we verified ourselves
+  uint64 rx_bad_csum;   // dropped: IP or UDP checksum wrong
+  uint64 rx_bad_len;    // dropped: header lengths don't fit the frame
+  uint64 rx_no_port;    // dropped: port not bound, or connected elsewhere
+  uint64 rx_queue_full; // dropped: port queue already full
+  uint64 rx_mcast;      // multicast packets for a joined group
+  uint64 rx_mcast_drop; // dropped: multicast group we haven't joined
+  uint64 arp_requests;  // ARP requests sent
+  uint64 arp_replies;   // ARP replies sent
+  uint64 arp_unresolved; // dropped: no ARP reply, or too many waiting
+  uint64 tx_no_route;   // sends refused: no route to the destination
+  uint64 icmp_echo_replies; // echo replies sent
+  uint64 icmp_unreach;  // port unreachable errors sent
+  uint64 icmp_ratelimited; // errors not sent: over ICMP_ERR_RATE
+  uint64 tx_frags;      // fragments sent
+  uint64 rx_frags;      // fragments received
+  uint64 rx_reassembled; // datagrams put back together
+  uint64 rx_reass_drops; // fragments dropped: bad, timed out or no room
+} net_stats;
+
+// ip_id of the next packet we send
+static ushort ip_id_next;
+
+// IPv4 reassembly (RFC 815). Fragments of a datagram wait in an
+// ipq, sorted by offset, until all have arrived; the datagram then
+// goes up as a chain of the fragments' own buffers, so nothing is
+// copied. Protected by reasslock.
+static struct spinlock reasslock;
+static struct ipq {
+  int    used;
+  uint32 src, dst;      // network order, as in the header
+  ushort id;
+  uchar  proto;
+  struct mbuf *frags;   // by offset through nextpkt, data at IP header
+  struct mbuf *last;    // the fragment furthest in
+  int    have;          // data bytes received
+  int    total;         // data bytes in the datagram, -1 until known
+  int    bytes;         // buffer memory held
+  uint   expire;        // ticks when the datagram is given up on
+} ipqs[IPQ_MAX];
+static int ipq_bytes;   // buffer memory held by all ipqs
+
+#define FRAG_HLEN(ip) (((ip)->ip_vhl & 0x0f) * 4)
+#define FRAG_OFF(ip) ((ntohs((ip)->ip_off) & IP_OFFMASK) * 8)
+#define FRAG_END(ip) (FRAG_OFF(ip) + ntohs((ip)->ip_len) - FRAG_HLEN(ip))
+
+// token bucket for ICMP errors (see icmp_error())
+static struct spinlock icmplock;
+static int icmp_tokens = ICMP_ERR_BURST;
+static uint icmp_stamp;  // ticks when last refilled
+
+// ping() requests waiting for an echo reply, under pinglock
+static struct spinlock pinglock;
+static struct ping {
+  int    used;
+  uint32 dst;     // host order
+  ushort id;      // caller's pid
+  ushort seq;
+  uint64 sent;    // rdtsc() when sent
+  uint64 rtt;     // TSC cycles to the reply; 0 while waiting
+  uint   timeout; // ticks when ping() gives up
+} pings[MAX_PINGS];
+
+// TSC cycles per second, measured against the clock by net_timer()
+// so ping() can report round trips in microseconds.
+static uint64 tsc_per_sec;
+
+
+// IPv4 multicast groups joined with join(). The NIC filters by MAC,
+// and 32 groups share each multicast MAC, so udp_rx() still checks
+// the destination against this list. join() and leave() change it
+// under netlock; udp_rx() reads it without a lock, guarded by
+// mcast_seq (spinlock.h).
+#define MAX_MCAST_GROUPS 16
+static struct {
+  uint32 addr;  // group address, host order
+  int    refs;  // join() calls not yet matched by leave()
+} mcast_groups[MAX_MCAST_GROUPS];
+static uint mcast_seq;
+
+#define IP_MULTICAST(a) (((a) & 0xf0000000) == 0xe0000000)  // 224.0.0.0/4
+
+// ARP neighbour cache (RFC 826): the MACs of hosts on our subnet.
+// An address lives in one of ARP_PROBES slots from ARP_HASH(ip).
+// Changes are made under arplock; the send path reads entries
+// without it, guarded by each entry's sequence count (spinlock.h).
+#define ARP_CACHE_SIZE 64     // power of two
+#define ARP_PROBES 4
+#define ARP_HASH(ip) (((ip) ^ ((ip) >> 8)) & (ARP_CACHE_SIZE - 1))
+#define ARP_REACHABLE_TICKS 6000  // an answer is good for 60s
+#define ARP_RETRY_TICKS 100       // resend a request after 1s ...
+#define ARP_MAXTRIES 3            // ... and give up after 3
+#define ARP_MAXPENDING 48         // packets held per unresolved host,
+                                  // enough for a 64KB datagram's fragments
+
+enum { ARP_FREE, ARP_INCOMPLETE, ARP_REACHABLE };
+
+struct arp_entry {
+  uint   seq;            // odd while the entry is being changed
+  int    state;          // ARP_*
+  uint32 ip;             // host order
+  uchar  mac[ETHADDR_LEN];
+  struct netdev *dev;    // interface ip is reached through
+  uint   expire;         // ticks: valid until (REACHABLE), next request
+  int    tries;          // requests sent while INCOMPLETE
+  struct mbuf *pending;  // packets awaiting the reply, via nextpkt
+  int    npending;
+};
+
+static struct arp_entry arp_cache[ARP_CACHE_SIZE];
+static struct spinlock arplock;
+
+// queued UDP packet; a netobj, so it must fit in NETOBJ_SIZE bytes
 struct udp_pkt {
-  char *fullbuf;     // pointer to the kalloc()'d page containing the entire frame
-  char *payload;     // pointer into fullbuf where UDP payload starts
-  int   payload_len; // payload length in bytes
+  struct mbuf *m;    // the frame, pulled up to the UDP payload
   uint32 src_ip;     // source IPv4 in host byte order
   ushort src_port;   // source UDP port in host byte order
   struct udp_pkt *next;
@@ -49,34 +201,137 @@ struct udp_pkt {
 
 // per-bound-port queue
 struct port_queue {
+  struct spinlock lock;  // protects head, tail, count and bound
+  int   bound;           // 0 once unbind() has released the slot
   ushort port;           // destination port (host order)
   struct udp_pkt *head;
   struct udp_pkt *tail;
   int   count;           // number of queued packets
-  struct port_queue *next;
-
-
+  struct port_queue *next;  // next in the hash bucket
+  uint64 peer;           // PORT_PEER() of connect(), 0 = any sender
 };
 
-static struct port_queue *port_list = 0;  // linked list of bound ports
-
-// helper: find port_queue for port (must be called with netlock held)
+// Bound ports, hashed by port number. Queues come from ports[].
+// Buckets change only under netlock, and an entry is fully set up
+// before the store that links it in, so the receive path looks
+// ports up without any lock. connect() changes peer with a single
+// 64-bit store. unbind() unlinks an entry without touching its
+// next, so a lookup standing on it carries on down the bucket, and
+// clears bound under the queue lock; whoever found the entry checks
+// bound and port again under that lock before using it, since the
+// slot may since have been bound to another port. A lookup racing
+// with that re-use can miss its port, and the datagram is dropped
+// as if for a closed port.
+#define PORT_HASH_SIZE 64  // power of two
+#define PORT_HASH(p) (((p) ^ ((p) >> 6)) & (PORT_HASH_SIZE - 1))
+#define PORT_PEER(ip, port) (((uint64)(ip) << 16) | (port) | (1ULL << 48))
+static struct port_queue *port_hash[PORT_HASH_SIZE];
+static struct port_queue ports[NPORT];
+static int nports;  // slots of ports[] ever used, under netlock
+
+// helper: find port_queue for port, whoever it is connected to
 static struct port_queue*
 find_port_queue(ushort port)
 {
-  struct port_queue *pq = port_list;
-  for (; pq; pq = pq->next) {
+  struct port_queue *pq = __atomic_load_n(&port_hash[PORT_HASH(port)],
+                                          __ATOMIC_ACQUIRE);
+  for (; pq; pq = __atomic_load_n(&pq->next, __ATOMIC_ACQUIRE)) {
     if (pq->port == port)
       return pq;
   }
   return 0;
 }
 
+// helper: the port_queue that takes a datagram for lport from
+// rip:rport (host order): a wildcard bind, or one connected to
+// exactly that sender.
+static struct port_queue*
+port_lookup(ushort lport, uint32 rip, ushort rport)
+{
+  struct port_queue *pq = find_port_queue(lport);
+  if (pq == 0)
+    return 0;
+  uint64 peer = __atomic_load_n(&pq->peer, __ATOMIC_RELAXED);
+  if (peer != 0 && peer != PORT_PEER(rip, rport))
+    return 0;
+  return pq;
+}
+
+//
+// netdev_register
+//
+// Called by a NIC driver once its device is up. Devices become
+// interfaces 0, 1, ... in the order they register; the default
+// routes (see netinit()) use interface 0.
+//
+void
+netdev_register(struct netdev* dev)
+{
+  if (nnetdevs == NNETDEV) {
+    cprintf("net: too many interfaces, not using %s\n", dev->name);
+    return;
+  }
+  cprintf("net: using %s as interface %d\n", dev->name, nnetdevs);
+  netdevs[nnetdevs] = dev;
+  __atomic_store_n(&nnetdevs, nnetdevs + 1, __ATOMIC_RELEASE);
+  if (netdev == 0)
+    netdev = dev;
+}
+
+// helper: the interface with index i, or 0
+static struct netdev*
+netdev_get(int i)
+{
+  if (i < 0 || i >= __atomic_load_n(&nnetdevs, __ATOMIC_ACQUIRE))
+    return 0;
+  return netdevs[i];
+}
+
+//
+// net_timer
+//
+// Called on every clock tick on CPU 0 (see trap.c), in the timer
+// interrupt. Runs the devices' watchdogs every NET_WATCHDOG_TICKS,
+// and ages the ARP cache and times out ping() and reassembly every
+// ARP_TIMER_TICKS.
+//
+void
+net_timer(void)
+{
+  if (ticks % NET_WATCHDOG_TICKS == 0) {
+    for (int i = 0; i < nnetdevs; i++)
+      if (netdevs[i]->watchdog)
+        netdevs[i]->watchdog();
+  }
+  if (ticks % ARP_TIMER_TICKS == 0) {
+    arp_timer();
+    ping_timer();
+    ipq_timer();
+  }
+}
+
 void
 netinit(void)
 {
   // Initialize the global network spinlock.
   initlock(&netlock, "netlock");
+  initlock(&arplock, "arp");
+  initlock(&icmplock, "icmp");
+  initlock(&pinglock, "ping");
+  initlock(&reasslock, "reass");
+
+  // Routes: our subnet, 10.0.2.0/24, is on the link; everything
+  // else goes through QEMU's "host" at 10.0.2.2.
+  rt_init();
+  struct rtentry rt = {MAKE_IP_ADDR(10, 0, 2, 0), 24, 0, local_ip, 0};
+  rt_add(&rt);
+  struct rtentry def = {0, 0, MAKE_IP_ADDR(10, 0, 2, 2), local_ip, 0};
+  rt_add(&def);
+
+  // Let the drivers start receiving: poll threads, interrupts.
+  for (int i = 0; i < nnetdevs; i++)
+    if (netdevs[i]->start)
+      netdevs[i]->start();
 }
 
 // 
@@ -102,20 +357,33 @@ sys_bind(void)
     return (uint64)-1;
   }
 
-  struct port_queue *pq = (struct port_queue*)kalloc();
+  // a slot unbind() released, or a fresh one
+  struct port_queue *pq = 0;
+  for (int i = 0; i < nports && pq == 0; i++)
+    if (!ports[i].bound)
+      pq = &ports[i];
   if (pq == 0) {
-    release(&netlock);
-    return (uint64)-1;
+    if (nports == NPORT) {
+      release(&netlock);
+      return (uint64)-1;
+    }
+    pq = &ports[nports];
+    initlock(&pq->lock, "port");
+    __atomic_store_n(&nports, nports + 1, __ATOMIC_RELEASE);
   }
 
-
-  memset(pq, 0, PGSIZE);
+  acquire(&pq->lock);
   pq->port  = (ushort)port;
   pq->head  = pq->tail = 0;
   pq->count = 0;
+  pq->peer  = 0;
+  pq->bound = 1;
+  release(&pq->lock);
 
-  pq->next  = port_list;
-  port_list = pq;
+  // publish: readers see the entry only once it is complete
+  int b = PORT_HASH(pq->port);
+  pq->next  = port_hash[b];
+  __atomic_store_n(&port_hash[b], pq, __ATOMIC_RELEASE);
 
   release(&netlock);
   return 0;
@@ -124,14 +392,177 @@ sys_bind(void)
 //
 // unbind(int port)
 //
-// Not required by the tests; left as a stub.
+// Undo bind(port): queued datagrams are dropped, a recv() waiting
+// on the port returns -1, and the slot can be bound again.
 // 
 uint64
 sys_unbind(void)
 {
+  int port;
+  if (argint(0, &port) < 0) return (uint64)-1;
+  if (port < 0 || port > 0xFFFF) return (uint64)-1;
+
+  acquire(&netlock);
+  struct port_queue **pp = &port_hash[PORT_HASH((ushort)port)];
+  for (; *pp && (*pp)->port != (ushort)port; pp = &(*pp)->next)
+    ;
+  struct port_queue *pq = *pp;
+  if (pq == 0) {
+    release(&netlock);
+    return (uint64)-1;
+  }
+  __atomic_store_n(pp, pq->next, __ATOMIC_RELEASE);
+
+  acquire(&pq->lock);
+  struct udp_pkt *pkt = pq->head;
+  pq->head  = pq->tail = 0;
+  pq->count = 0;
+  pq->bound = 0;
+  wakeup((void*)pq);
+  release(&pq->lock);
+  release(&netlock);
+
+  while (pkt) {
+    struct udp_pkt *next = pkt->next;
+    mbuf_freem(pkt->m);
+    netobj_free(pkt);
+    pkt = next;
+  }
+  return 0;
+}
+
+//
+// connect(int port, int ip, int rport)
+//
+// Accept datagrams on bound 'port' only from ip:rport (host order),
+// as with a connected BSD UDP socket; others are dropped. ip 0
+// undoes it.
+//
+uint64
+sys_connect(void)
+{
+  int port, ip, rport;
+
+  if (argint(0, &port) < 0 || argint(1, &ip) < 0 || argint(2, &rport) < 0)
+    return (uint64)-1;
+  if (port < 0 || port > 0xFFFF || rport < 0 || rport > 0xFFFF)
+    return (uint64)-1;
+
+  acquire(&netlock);
+  struct port_queue *pq = find_port_queue((ushort)port);
+  if (pq == 0) {
+    release(&netlock);
+    return (uint64)-1;
+  }
+  uint64 peer = ip ? PORT_PEER((uint32)ip, (ushort)rport) : 0;
+  __atomic_store_n(&pq->peer, peer, __ATOMIC_RELAXED);
+  release(&netlock);
+  return 0;
+}
+
+// RFC 1112: 01:00:5e followed by the low 23 bits of the group.
+static void
+mcast_mac(uint32 group, uchar* mac)
+{
+  mac[0] = 0x01;
+  mac[1] = 0x00;
+  mac[2] = 0x5e;
+  mac[3] = (group >> 16) & 0x7f;
+  mac[4] = (group >> 8) & 0xff;
+  mac[5] = group & 0xff;
+}
+
+// is group joined? Needs no lock (see mcast_seq).
+static int
+mcast_joined(uint32 group)
+{
+  uint seq;
+  int hit;
+  do {
+    seq = seq_read_begin(&mcast_seq);
+    hit = 0;
+    for (int i = 0; i < MAX_MCAST_GROUPS && !hit; i++)
+      hit = mcast_groups[i].refs && mcast_groups[i].addr == group;
+  } while (seq_read_retry(&mcast_seq, seq));
+  return hit;
+}
+
+//
+// join(uint32 group)
+//
+// Receive UDP packets sent to IPv4 multicast address 'group' (host
+// order) on ports bound with bind(). Joins nest; each needs a leave().
+//
+uint64
+sys_join(void)
+{
+  int arg;
+  if (argint(0, &arg) < 0) return (uint64)-1;
+  uint32 group = (uint32)arg;
+  if (!IP_MULTICAST(group)) return (uint64)-1;
+
+  acquire(&netlock);
+  int slot = -1;
+  for (int i = 0; i < MAX_MCAST_GROUPS; i++) {
+    if (mcast_groups[i].refs && mcast_groups[i].addr == group) {
+      seq_write_begin(&mcast_seq);
+      mcast_groups[i].refs++;
+      seq_write_end(&mcast_seq);
+      release(&netlock);
+      return 0;
+    }
+    if (mcast_groups[i].refs == 0 && slot < 0)
+      slot = i;
+  }
+
+  // first join: program the NIC's filter for the group's MAC
+  uchar mac[ETHADDR_LEN];
+  mcast_mac(group, mac);
+  if (slot < 0 || netdev == 0 || !(netdev->features & NETDEV_F_MCAST) ||
+      netdev->mcast_add(mac) < 0) {
+    release(&netlock);
+    return (uint64)-1;
+  }
+  seq_write_begin(&mcast_seq);
+  mcast_groups[slot].addr = group;
+  mcast_groups[slot].refs = 1;
+  seq_write_end(&mcast_seq);
+  release(&netlock);
   return 0;
 }
 
+//
+// leave(uint32 group)
+//
+// Undo one join(group); the NIC filter goes away with the last one.
+//
+uint64
+sys_leave(void)
+{
+  int arg;
+  if (argint(0, &arg) < 0) return (uint64)-1;
+  uint32 group = (uint32)arg;
+
+  acquire(&netlock);
+  for (int i = 0; i < MAX_MCAST_GROUPS; i++) {
+    if (mcast_groups[i].refs && mcast_groups[i].addr == group) {
+      seq_write_begin(&mcast_seq);
+      int refs = --mcast_groups[i].refs;
+      seq_write_end(&mcast_seq);
+      if (refs == 0) {
+        uchar mac[ETHADDR_LEN];
+        mcast_mac(group, mac);
+        if (netdev && (netdev->features & NETDEV_F_MCAST))
+          netdev->mcast_del(mac);
+      }
+      release(&netlock);
+      return 0;
+    }
+  }
+  release(&netlock);
+  return (uint64)-1;
+}
+
 //
 // recv(int dport, int *src, short *sport, char *buf, int maxlen)
 //
@@ -158,19 +589,25 @@ sys_recv(void)
 
   ushort port = (ushort)dport;
 
-  acquire(&netlock);
+  // Collect frames the device already has, e.g. ones whose
+  // interrupt is held back by moderation, before sleeping.
+  if (netdev && netdev->rx_poll)
+    netdev->rx_poll(RECV_POLL_BUDGET);
 
   struct port_queue* pq = find_port_queue(port);
-  if (!pq) {
-    release(&netlock);
+  if (!pq)
     return (uint64)-1;
-  }
 
+  acquire(&pq->lock);
 
-  // wait until there is a packet
-  while (pq->count == 0) {
-    sleep((void*)pq, &netlock);  // releases netlock internally
-    // when woken, netlock is acquired again
+  // wait until there is a packet, or the port is unbound
+  while (pq->count == 0 && pq->bound && pq->port == port) {
+    sleep((void*)pq, &pq->lock);  // releases pq->lock internally
+    // when woken, pq->lock is acquired again
+  }
+  if (!pq->bound || pq->port != port) {
+    release(&pq->lock);
+    return (uint64)-1;
   }
 
 
@@ -180,7 +617,7 @@ sys_recv(void)
   if (pq->head == 0) pq->tail = 0;
   pq->count--;
 
-  release(&netlock);
+  release(&pq->lock);
 
   // Copy metadata/payload to user space.
   uint32 src_ip   = pkt->src_ip;
@@ -188,56 +625,109 @@ sys_recv(void)
 
   // copy src ip
   if (copyout(p->pgdir, src_uaddr, &src_ip, sizeof(src_ip)) < 0) {
-    kfree(pkt->fullbuf);
-    kfree((char*)pkt);
+    mbuf_freem(pkt->m);
+    netobj_free(pkt);
 
     return (uint64)-1;
   }
 
   // copy src port (16-bit). The syscall expects a short pointer.
   if (copyout(p->pgdir, sport_uaddr, &src_port, sizeof(src_port)) < 0) {
-    kfree(pkt->fullbuf);
-    kfree((char*)pkt);
+    mbuf_freem(pkt->m);
+    netobj_free(pkt);
 
     return (uint64)-1;
   }
 
-  // how many payload bytes we will copy
-  int tocpy = pkt->payload_len;
+  // how many payload bytes we will copy; a reassembled datagram
+  // is a chain of mbufs
+  int tocpy = mbuf_pktlen(pkt->m);
   if (tocpy > maxlen)  tocpy = maxlen;
   if (tocpy < 0)       tocpy = 0;
-  if (tocpy > 1500)    tocpy = 1500;
 
-  if (tocpy > 0) {
-    if (copyout(p->pgdir, bufaddr, pkt->payload, (uint64)tocpy) < 0) {
-      kfree(pkt->fullbuf);
-      kfree((char*)pkt);
+  int off = 0;
+  for (struct mbuf* seg = pkt->m; seg && off < tocpy; seg = seg->next) {
+    int n = tocpy - off < seg->len ? tocpy - off : seg->len;
+    if (copyout(p->pgdir, bufaddr + off, seg->data, (uint64)n) < 0) {
+      mbuf_freem(pkt->m);
+      netobj_free(pkt);
 
       return (uint64)-1;
     }
+    off += n;
   }
 
-  // free the stored page and the pkt node
-  kfree(pkt->fullbuf);
-  kfree((char*)pkt);
+  // free the stored frame and the pkt node
+  mbuf_freem(pkt->m);
+  netobj_free(pkt);
 
 
   return (uint64)tocpy;
 }
 
 // 
-// in_cksum
+// cksum_add
 //
-// Compute the 16-bit Internet checksum over a buffer.
-// Used here for the IPv4 header checksum in sys_send().
+// Add the 16-bit words of a buffer to a running 32-bit checksum
+// accumulator, so a checksum can span several fragments. Only the
+// last piece may have an odd length.
+//
+// The one's complement sum doesn't care how wide the words are that
+// it is taken over, as long as carries wrap around, so the buffer is
+// summed 64 bits at a time: eight words a pass in one add-with-carry
+// chain, then single words, then the tail zero-padded. Loads needn't
+// be aligned on x86. The 64-bit result folds back to 32 bits.
 // 
-static unsigned short
-in_cksum(const unsigned char* addr, int len)
+static unsigned int
+cksum_add(unsigned int sum, const unsigned char* addr, int len)
+{
+  uint64 acc = sum;
+  const uint64* w = (const uint64*)addr;
+
+  // The first adcq $0 can itself carry out (acc all ones plus a
+  // carry); the second takes that last carry in.
+  for (; len >= 64; len -= 64, w += 8)
+    asm("addq 0(%[w]), %[acc]\n\t"
+        "adcq 8(%[w]), %[acc]\n\t"
+        "adcq 16(%[w]), %[acc]\n\t"
+        "adcq 24(%[w]), %[acc]\n\t"
+        "adcq 32(%[w]), %[acc]\n\t"
+        "adcq 40(%[w]), %[acc]\n\t"
+        "adcq 48(%[w]), %[acc]\n\t"
+        "adcq 56(%[w]), %[acc]\n\t"
+        "adcq $0, %[acc]\n\t"
+        "adcq $0, %[acc]"
+        : [acc] "+r" (acc)
+        : [w] "r" (w), "m" (*(const struct { char b[64]; }*)w)
+        : "cc");
+
+  for (; len >= 8; len -= 8, w++) {
+    acc += *w;
+    acc += acc < *w;  // end-around carry
+  }
+
+  // The last 0-7 bytes, in memory order: an odd byte out is padded
+  // with zero as the low byte of its word.
+  if (len > 0) {
+    uint64 t = 0;
+    memmove(&t, w, len);
+    acc += t;
+    acc += acc < t;
+  }
+
+  acc = (acc & 0xffffffff) + (acc >> 32);
+  acc = (acc & 0xffffffff) + (acc >> 32);
+  return (unsigned int)acc;
+}
+
+// The plain 16-bit loop cksum_add() replaced, kept for
+// cksum_bench() to check and time it against.
+static unsigned int
+cksum_add_ref(unsigned int sum, const unsigned char* addr, int len)
 {
   int nleft = len;
   const unsigned short* w = (const unsigned short*)addr;
-  unsigned int sum = 0;
-  unsigned short answer = 0;
+  unsigned short odd = 0;
 
   // Add 16-bit words to a 32-bit accumulator
   while (nleft > 1) {
@@ -247,22 +737,695 @@ in_cksum(const unsigned char* addr, int len)
 
   // If there's a remaining odd byte, pad it with zero and add
   if (nleft == 1) {
-    *(unsigned char*)(&answer) = *(const unsigned char*)w;
-    sum += answer;
+    *(unsigned char*)(&odd) = *(const unsigned char*)w;
+    sum += odd;
   }
+  return sum;
+}
 
-  // Fold 32-bit sum to 16 bits, then invert
+// Fold a 32-bit accumulator to 16 bits (not inverted).
+static unsigned short
+cksum_fold(unsigned int sum)
+{
   sum = (sum & 0xffff) + (sum >> 16);
   sum += (sum >> 16);
-  answer = (unsigned short)~sum;
-  return answer;
+  return (unsigned short)sum;
+}
+
+// Add packet m, from off bytes into its first mbuf on, to sum. Every
+// mbuf but the last must hold an even number of those bytes, as a
+// reassembled datagram's fragments do.
+static unsigned int
+cksum_chain(unsigned int sum, struct mbuf* m, int off)
+{
+  for (; m; m = m->next, off = 0)
+    sum = cksum_add(sum, (const unsigned char*)m->data + off, m->len - off);
+  return sum;
+}
+
+// 
+// in_cksum
+//
+// Compute the 16-bit Internet checksum over a buffer.
+// Used here for the IPv4 header checksum in sys_send().
+// 
+static unsigned short
+in_cksum(const unsigned char* addr, int len)
+{
+  return (unsigned short)~cksum_fold(cksum_add(0, addr, len));
+}
+
+// 
+// udp_pseudo_sum
+//
+// Sum of the UDP pseudo-header (addresses, protocol, length), all
+// in network byte order as they appear in the IP/UDP headers.
+// 
+static unsigned int
+udp_pseudo_sum(uint32 src, uint32 dst, ushort ulen)
+{
+  return (src & 0xffff) + (src >> 16) + (dst & 0xffff) + (dst >> 16) +
+         htons(IPPROTO_UDP) + ulen;
+}
+
+// RFC 1624: checksum sum after a 16-bit word it covers changed from
+// old to new (both as they lie in memory).
+static ushort
+cksum_update(ushort sum, ushort old, ushort new)
+{
+  return (ushort)~cksum_fold((ushort)~sum + (ushort)~old + new);
+}
+
+// keeps cksum_bench()'s sums from being optimized away
+static volatile unsigned int cksum_bench_sink;
+
+//
+// cksum_bench
+//
+// The CPU cycles one checksum of len bytes takes with cksum_add(),
+// or with cksum_add_ref() if ref is set: the best of 8 runs of 64
+// sums each, so interrupts don't skew it. First checks that both
+// give the same sum at each alignment and at len and len-1 bytes;
+// -1 if not, or if len is out of range. See NETCTL_CKSUM_BENCH.
+//
+static int
+cksum_bench(int len, int ref)
+{
+  if (len < 1 || len > PGSIZE - 8)
+    return -1;
+  unsigned char* buf = (unsigned char*)kalloc();
+  if (buf == 0)
+    return -1;
+  for (int i = 0; i < PGSIZE; i++)
+    buf[i] = (i * 2654435761U) >> 13;
+
+  for (int off = 0; off < 8; off++)
+    for (int n = len - 1; n <= len; n++)
+      if (cksum_fold(cksum_add(0xfffe, buf + off, n)) !=
+          cksum_fold(cksum_add_ref(0xfffe, buf + off, n))) {
+        kfree((char*)buf);
+        return -1;
+      }
+
+  uint64 best = ~0ULL;
+  for (int r = 0; r < 8; r++) {
+    uint64 t0 = rdtsc();
+    for (int i = 0; i < 64; i++)
+      cksum_bench_sink += ref ? cksum_add_ref(0, buf, len)
+                              : cksum_add(0, buf, len);
+    uint64 t = rdtsc() - t0;
+    if (t < best)
+      best = t;
+  }
+  kfree((char*)buf);
+  return (int)(best / 64);
+}
+
+//
+// arp_send
+//
+// Send an ARP packet of type op from us to tip (host order) out of
+// dev, at Ethernet address dhost with target hardware address tha.
+//
+static void
+arp_send(struct netdev* dev, int op, const uchar* dhost, const uchar* tha,
+         uint32 tip)
+{
+  struct mbuf* m = mbuf_alloc(0);
+  if (m == 0)
+    return;
+
+  // Ethernet header
+  struct eth* eth = (struct eth*)mbuf_append(m, sizeof(*eth));
+  memmove(eth->dhost, dhost, ETHADDR_LEN);
+  memmove(eth->shost, local_mac, ETHADDR_LEN);
+  eth->type = htons(ETHTYPE_ARP);
+
+  // ARP header
+  struct arp* arp = (struct arp*)mbuf_append(m, sizeof(*arp));
+  arp->hrd = htons(ARP_HRD_ETHER);  // hardware = Ethernet
+  arp->pro = htons(ETHTYPE_IP);     // protocol = IPv4
+  arp->hln = ETHADDR_LEN;           // MAC length = 6
+  arp->pln = sizeof(uint32);        // IPv4 length = 4
+  arp->op  = htons(op);
+
+  // sender hardware/IP = us (xv6)
+  memmove(arp->sha, local_mac, ETHADDR_LEN);
+  arp->sip = htonl(local_ip);
+  memmove(arp->tha, tha, ETHADDR_LEN);
+  arp->tip = htonl(tip);
+
+  if (dev->xmit(m) < 0)
+    mbuf_freem(m);
+}
+
+// Broadcast "who has ip?" on dev.
+static void
+arp_request(struct netdev* dev, uint32 ip)
+{
+  static const uchar bcast[ETHADDR_LEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+  static const uchar zero[ETHADDR_LEN];
+
+  __sync_fetch_and_add(&net_stats.arp_requests, 1);
+  arp_send(dev, ARP_OP_REQUEST, bcast, zero, ip);
+}
+
+//
+// arp_lookup
+//
+// Copy ip's MAC (ip in host order) to mac if the cache has a live
+// answer for it. Takes no lock. Returns 0 on a hit, -1 otherwise.
+//
+static int
+arp_lookup(uint32 ip, uchar* mac)
+{
+  for (int i = 0; i < ARP_PROBES; i++) {
+    struct arp_entry* e = &arp_cache[(ARP_HASH(ip) + i) & (ARP_CACHE_SIZE - 1)];
+    uint seq;
+    int hit;
+    do {
+      seq = seq_read_begin(&e->seq);
+      hit = e->state == ARP_REACHABLE && e->ip == ip &&
+            (int)(e->expire - ticks) > 0;
+      if (hit)
+        memmove(mac, e->mac, ETHADDR_LEN);
+    } while (seq_read_retry(&e->seq, seq));
+    if (hit)
+      return 0;
+  }
+  return -1;
+}
+
+//
+// arp_slot
+//
+// The entry for ip (host order); arplock held. If there is none and
+// create is set, a slot for it: a free one, or else the answer
+// closest to expiry. Never one with packets waiting. 0 if nothing fits.
+//
+static struct arp_entry*
+arp_slot(uint32 ip, int create)
+{
+  struct arp_entry* victim = 0;
+
+  for (int i = 0; i < ARP_PROBES; i++) {
+    struct arp_entry* e = &arp_cache[(ARP_HASH(ip) + i) & (ARP_CACHE_SIZE - 1)];
+    if (e->state != ARP_FREE && e->ip == ip)
+      return e;
+    if (e->state == ARP_FREE) {
+      if (victim == 0 || victim->state != ARP_FREE)
+        victim = e;
+    } else if (e->state == ARP_REACHABLE && e->npending == 0) {
+      if (victim == 0 ||
+          (victim->state != ARP_FREE &&
+           (int)(e->expire - victim->expire) < 0))
+        victim = e;
+    }
+  }
+  return create ? victim : 0;
+}
+
+// Fill in the destination MAC and transmit each packet of list
+// on dev.
+static void
+arp_flush(struct mbuf* list, const uchar* mac, struct netdev* dev)
+{
+  while (list) {
+    struct mbuf* m = list;
+    list = m->nextpkt;
+    m->nextpkt = 0;
+    memmove(((struct eth*)m->data)->dhost, mac, ETHADDR_LEN);
+    if (dev->xmit(m) < 0)
+      mbuf_freem(m);
+  }
+}
+
+//
+// arp_update
+//
+// ip (host order) is at mac, reached through dev. Record it if ip
+// has an entry, or if create is set, and send the packets that were
+// waiting for it.
+//
+static void
+arp_update(uint32 ip, const uchar* mac, struct netdev* dev, int create)
+{
+  acquire(&arplock);
+  struct arp_entry* e = arp_slot(ip, create);
+  if (e == 0) {
+    release(&arplock);
+    return;
+  }
+  struct mbuf* pending = e->pending;
+
+  seq_write_begin(&e->seq);
+  e->state = ARP_REACHABLE;
+  e->ip = ip;
+  memmove(e->mac, mac, ETHADDR_LEN);
+  e->dev = dev;
+  e->expire = ticks + ARP_REACHABLE_TICKS;
+  e->tries = 0;
+  e->pending = 0;
+  e->npending = 0;
+  seq_write_end(&e->seq);
+  release(&arplock);
+
+  arp_flush(pending, mac, dev);
+}
+
+//
+// arp_output
+//
+// Send frame m, whose Ethernet header is complete but for the
+// destination, to nexthop (host order) on dev's link. If nexthop's
+// MAC isn't known, m waits in the cache while we ask for it. m is
+// consumed either way; returns -1 if it had to be dropped.
+//
+static int
+arp_output(struct mbuf* m, uint32 nexthop, struct netdev* dev)
+{
+  struct eth* eth = (struct eth*)m->data;
+
+  if (arp_lookup(nexthop, eth->dhost) == 0) {
+    if (dev->xmit(m) < 0) {
+      mbuf_freem(m);
+      return -1;
+    }
+    return 0;
+  }
+
+  acquire(&arplock);
+  struct arp_entry* e = arp_slot(nexthop, 1);
+  if (e && e->state == ARP_REACHABLE && e->ip == nexthop &&
+      (int)(e->expire - ticks) > 0) {
+    // answered since the lookup
+    uchar mac[ETHADDR_LEN];
+    memmove(mac, e->mac, ETHADDR_LEN);
+    release(&arplock);
+    m->nextpkt = 0;
+    arp_flush(m, mac, dev);
+    return 0;
+  }
+  if (e == 0 || (e->state == ARP_INCOMPLETE && e->npending == ARP_MAXPENDING)) {
+    release(&arplock);
+    __sync_fetch_and_add(&net_stats.arp_unresolved, 1);
+    mbuf_freem(m);
+    return -1;
+  }
+
+  int ask = 0;
+  if (e->state != ARP_INCOMPLETE) {
+    // new, or its answer went stale
+    seq_write_begin(&e->seq);
+    e->state = ARP_INCOMPLETE;
+    e->ip = nexthop;
+    e->dev = dev;
+    e->expire = ticks + ARP_RETRY_TICKS;
+    e->tries = 1;
+    e->pending = 0;
+    e->npending = 0;
+    seq_write_end(&e->seq);
+    ask = 1;
+  }
+  struct mbuf** tail = &e->pending;
+  while (*tail)
+    tail = &(*tail)->nextpkt;
+  m->nextpkt = 0;
+  *tail = m;
+  e->npending++;
+  release(&arplock);
+
+  if (ask)
+    arp_request(dev, nexthop);
+  return 0;
+}
+
+//
+// arp_timer
+//
+// Resend requests that got no answer, and after ARP_MAXTRIES drop
+// the packets waiting on them; forget answers older than
+// ARP_REACHABLE_TICKS. Called from net_timer().
+//
+static void
+arp_timer(void)
+{
+  // requests to resend once arplock is dropped; any beyond these
+  // wait for the next sweep
+  struct {
+    uint32 ip;
+    struct netdev *dev;
+  } retry[16];
+  int nretry = 0;
+  struct mbuf* dead = 0;
+
+  acquire(&arplock);
+  for (int i = 0; i < ARP_CACHE_SIZE; i++) {
+    struct arp_entry* e = &arp_cache[i];
+    if (e->state == ARP_FREE || (int)(e->expire - ticks) > 0)
+      continue;
+    if (e->state == ARP_INCOMPLETE && e->tries < ARP_MAXTRIES) {
+      if (nretry == NELEM(retry))
+        continue;
+      e->tries++;
+      e->expire = ticks + ARP_RETRY_TICKS;
+      retry[nretry].ip = e->ip;
+      retry[nretry++].dev = e->dev;
+      continue;
+    }
+    while (e->pending) {
+      struct mbuf* m = e->pending;
+      e->pending = m->nextpkt;
+      m->nextpkt = dead;
+      dead = m;
+      __sync_fetch_and_add(&net_stats.arp_unresolved, 1);
+    }
+    seq_write_begin(&e->seq);
+    e->state = ARP_FREE;
+    e->npending = 0;
+    seq_write_end(&e->seq);
+  }
+  release(&arplock);
+
+  for (int i = 0; i < nretry; i++)
+    arp_request(retry[i].dev, retry[i].ip);
+  while (dead) {
+    struct mbuf* m = dead;
+    dead = m->nextpkt;
+    mbuf_freem(m);
+  }
+}
+
+//
+// eth_output
+//
+// Address IP frame m to dst (host order) and transmit it on dev
+// along route rt: multicast and broadcast straight away, anything
+// else through the ARP cache, to rt's gateway if it has one.
+// Consumes m.
+//
+static int
+eth_output(struct mbuf* m, uint32 dst, struct rtentry* rt, struct netdev* dev)
+{
+  struct eth* eth = (struct eth*)m->data;
+  uint32 host = rt->prefixlen < 32 ? ~0U >> rt->prefixlen : 0;
+
+  if (IP_MULTICAST(dst)) {
+    mcast_mac(dst, eth->dhost);
+  } else if (dst == 0xffffffff ||
+             (rt->gateway == 0 && rt->prefixlen < 31 &&
+              (dst & host) == host)) {
+    // limited, or directed at a subnet on the link
+    memset(eth->dhost, 0xff, ETHADDR_LEN);
+  } else {
+    return arp_output(m, rt->gateway ? rt->gateway : dst, dev);
+  }
+  if (dev->xmit(m) < 0) {
+    mbuf_freem(m);
+    return -1;
+  }
+  return 0;
+}
+
+//
+// ip_send
+//
+// Prepend IPv4 and Ethernet headers to m, which holds a whole proto
+// packet for dst (host order) or, with ip_off set, a fragment of
+// one, and send it along route rt out of dev. The IP checksum is
+// left to the NIC if m->csum asks for TXO_IPCSUM. Consumes m.
+//
+static int
+ip_send(struct mbuf* m, uint32 dst, int proto, ushort id, ushort ip_off,
+        struct rtentry* rt, struct netdev* dev)
+{
+  int len = mbuf_pktlen(m);
+  struct eth* eth = (struct eth*)mbuf_prepend(m, sizeof(*eth) + sizeof(struct ip));
+  if (eth == 0) {
+    mbuf_freem(m);
+    return -1;
+  }
+
+  // Ethernet header; eth_output() fills in the destination MAC
+  memmove(eth->shost, local_mac, ETHADDR_LEN);  // source MAC = xv6's MAC
+  eth->type = htons(ETHTYPE_IP);                // EtherType = IPv4
+
+  // IP header
+  struct ip* ip = (struct ip*)(eth + 1);  // immediately after Ethernet
+  ip->ip_vhl = 0x45;                      // version 4, header length 5 * 4 bytes
+  ip->ip_tos = 0;                         // type of service (unused)
+  ip->ip_len = htons(sizeof(struct ip) + len);
+  ip->ip_id  = htons(id);                 // identifies the fragments
+  ip->ip_off = htons(ip_off);             // IP_MF and offset of a fragment
+  ip->ip_ttl = IP_TTL;                    // time to live
+  ip->ip_p   = proto;
+  ip->ip_sum = 0;
+  ip->ip_src = htonl(rt->src);            // route's source, network order
+  ip->ip_dst = htonl(dst);                // destination IP in network order
+  if ((m->csum & TXO_IPCSUM) == 0)
+    ip->ip_sum = in_cksum((const unsigned char*)ip, sizeof(*ip));
+
+  return eth_output(m, dst, rt, dev);
+}
+
+//
+// ip_output
+//
+// Send m, a proto packet (the transport header and payload) for dst
+// (host order), along route rt out of dev. A packet too big for the
+// interface MTU goes as fragments: each gets a fresh header mbuf
+// followed by a slice of m's buffers, so the payload isn't copied.
+// Checksum offloads (m->csum) can't work across fragments, so
+// callers mustn't ask for them on such packets. Consumes m.
+//
+static int
+ip_output(struct mbuf* m, uint32 dst, int proto, struct rtentry* rt,
+          struct netdev* dev)
+{
+  int len = mbuf_pktlen(m);
+  ushort id = __sync_fetch_and_add(&ip_id_next, 1);
+
+  if (sizeof(struct ip) + len <= dev->mtu())
+    return ip_send(m, dst, proto, id, 0, rt, dev);
+
+  // all but the last fragment carry a multiple of 8 bytes
+  int max = (dev->mtu() - sizeof(struct ip)) & ~7;
+  int r = 0;
+  for (int off = 0; off < len && r == 0; off += max) {
+    int n = len - off < max ? len - off : max;
+    struct mbuf* f = mbuf_alloc(MBUF_HDRROOM);
+    if (f == 0 || (f->next = mbuf_slice(m, off, n)) == 0) {
+      if (f)
+        mbuf_freem(f);
+      r = -1;
+      break;
+    }
+    __sync_fetch_and_add(&net_stats.tx_frags, 1);
+    r = ip_send(f, dst, proto, id, (off + n < len ? IP_MF : 0) | (off >> 3),
+                rt, dev);
+  }
+  mbuf_freem(m);
+  return r;
+}
+
+//
+// icmp_error
+//
+// Tell the sender of datagram in (its data at the IP header) that it
+// could not be delivered, with an ICMP error of type and code. At
+// most ICMP_ERR_RATE errors a second go out, in bursts of up to
+// ICMP_ERR_BURST, so a flood of bad datagrams can't become a flood
+// of replies.
+//
+static void
+icmp_error(struct mbuf* in, int type, int code)
+{
+  struct ip* inip = (struct ip*)in->data;
+  int inlen = (inip->ip_vhl & 0x0f) * 4 + 8;  // IP header + 8 bytes
+  if (inlen > in->len)
+    inlen = in->len;
+
+  // Token bucket: refill ICMP_ERR_RATE tokens a second.
+  acquire(&icmplock);
+  uint now = ticks;
+  icmp_tokens += (now - icmp_stamp) * ICMP_ERR_RATE / 100;
+  if (icmp_tokens > ICMP_ERR_BURST)
+    icmp_tokens = ICMP_ERR_BURST;
+  icmp_stamp = now;
+  int ok = icmp_tokens > 0;
+  if (ok)
+    icmp_tokens--;
+  release(&icmplock);
+  if (!ok) {
+    __sync_fetch_and_add(&net_stats.icmp_ratelimited, 1);
+    return;
+  }
+
+  uint32 dst = ntohl(inip->ip_src);
+  struct rtentry rt;
+  struct netdev* dev;
+  if (rt_lookup(dst, &rt) < 0 || (dev = netdev_get(rt.ifindex)) == 0)
+    return;
+  struct mbuf* m = mbuf_alloc(MBUF_HDRROOM);
+  if (m == 0)
+    return;
+
+  struct icmp* icmp = (struct icmp*)mbuf_append(m, sizeof(*icmp) + inlen);
+  icmp->type = type;
+  icmp->code = code;
+  icmp->sum  = 0;
+  icmp->id   = 0;
+  icmp->seq  = 0;
+  memmove(icmp + 1, inip, inlen);
+  icmp->sum = in_cksum((const unsigned char*)icmp, sizeof(*icmp) + inlen);
+
+  __sync_fetch_and_add(&net_stats.icmp_unreach, 1);
+  ip_output(m, dst, IPPROTO_ICMP, &rt, dev);
+}
+
+//
+// ping_reply
+//
+// An echo reply from src arrived: complete the ping() it answers.
+//
+static void
+ping_reply(uint32 src, ushort id, ushort seq)
+{
+  uint64 now = rdtsc();
+
+  acquire(&pinglock);
+  for (int i = 0; i < MAX_PINGS; i++) {
+    struct ping* pg = &pings[i];
+    if (pg->used && pg->rtt == 0 && pg->dst == src && pg->id == id &&
+        pg->seq == seq) {
+      pg->rtt = now - pg->sent;
+      if (pg->rtt == 0)
+        pg->rtt = 1;
+      wakeup(pg);
+    }
+  }
+  release(&pinglock);
+}
+
+// Wake ping() callers whose replies are overdue. Called from
+// net_timer(), which also keeps tsc_per_sec up to date.
+static void
+ping_timer(void)
+{
+  static uint64 last;
+  uint64 now = rdtsc();
+
+  if (last)
+    tsc_per_sec = (now - last) * (100 / ARP_TIMER_TICKS);
+  last = now;
+
+  acquire(&pinglock);
+  for (int i = 0; i < MAX_PINGS; i++)
+    if (pings[i].used && (int)(ticks - pings[i].timeout) >= 0)
+      wakeup(&pings[i]);
+  release(&pinglock);
+}
+
+//
+// ping(uint32 dst, int seq, int len, int timeout)
+//
+// Send an ICMP echo request with len bytes of data and sequence
+// number seq to dst (host order), and wait up to timeout ticks for
+// the reply. Returns the round trip time in microseconds, or -1 if
+// no reply came.
+//
+uint64
+sys_ping(void)
+{
+  int dst, seq, len, timeout;
+
+  if (argint(0, &dst) < 0 || argint(1, &seq) < 0 || argint(2, &len) < 0 ||
+      argint(3, &timeout) < 0)
+    return (uint64)-1;
+
+  struct rtentry rt;
+  struct netdev* dev;
+  if (rt_lookup((uint32)dst, &rt) < 0 || (dev = netdev_get(rt.ifindex)) == 0) {
+    __sync_fetch_and_add(&net_stats.tx_no_route, 1);
+    return (uint64)-1;
+  }
+  if (len < 0 || sizeof(struct ip) + sizeof(struct icmp) + len > IP_MAXPACKET)
+    return (uint64)-1;
+
+  acquire(&pinglock);
+  struct ping* pg = 0;
+  for (int i = 0; i < MAX_PINGS && pg == 0; i++)
+    if (!pings[i].used)
+      pg = &pings[i];
+  if (pg == 0) {
+    release(&pinglock);
+    return (uint64)-1;
+  }
+  pg->used = 1;
+  pg->dst = (uint32)dst;
+  pg->id = (ushort)myproc()->pid;
+  pg->seq = (ushort)seq;
+  pg->rtt = 0;
+  pg->timeout = ticks + timeout;
+  release(&pinglock);
+
+  // The payload may take several mbufs; each but the last is
+  // filled to the brim, an even number of bytes, as cksum_chain()
+  // wants.
+  struct mbuf* m = mbuf_alloc(MBUF_HDRROOM);
+  if (m == 0)
+    goto out;
+  struct icmp* icmp = (struct icmp*)mbuf_append(m, sizeof(*icmp));
+  struct mbuf* seg = m;
+  for (int off = 0; off < len; ) {
+    int n = len - off;
+    if (n > M_TAILROOM(seg))
+      n = M_TAILROOM(seg);
+    if (n == 0) {
+      if ((seg->next = mbuf_alloc(0)) == 0) {
+        mbuf_freem(m);
+        goto out;
+      }
+      seg = seg->next;
+      continue;
+    }
+    uchar* p = (uchar*)mbuf_append(seg, n);
+    for (int i = 0; i < n; i++)
+      p[i] = off + i;
+    off += n;
+  }
+  icmp->type = ICMP_ECHO;
+  icmp->code = 0;
+  icmp->sum  = 0;
+  icmp->id   = htons(pg->id);
+  icmp->seq  = htons(pg->seq);
+  icmp->sum = ~cksum_fold(cksum_chain(0, m, 0));
+
+  pg->sent = rdtsc();
+  if (ip_output(m, (uint32)dst, IPPROTO_ICMP, &rt, dev) < 0)
+    goto out;
+
+  acquire(&pinglock);
+  while (pg->rtt == 0 && (int)(ticks - pg->timeout) < 0 && !myproc()->killed)
+    sleep(pg, &pinglock);
+  release(&pinglock);
+
+out:
+  acquire(&pinglock);
+  uint64 rtt = pg->rtt;
+  pg->used = 0;
+  release(&pinglock);
+  if (rtt == 0 || tsc_per_sec == 0)
+    return (uint64)-1;
+  return rtt * 1000000 / tsc_per_sec;
 }
 
 // 
 // send(int sport, int dst, int dport, char *buf, int len)
 //
-// Constructs [Ethernet][IPv4][UDP][payload] into a kernel page
-// and hands it to the e1000 driver.
+// Copies the payload into an mbuf chain and prepends a UDP header
+// in the first mbuf's headroom, then hands the chain to ip_output()
+// for the [IPv4] and [Ethernet] ones.
 // 
 uint64
 sys_send(void)
@@ -281,138 +1444,254 @@ sys_send(void)
   argaddr(3, &bufaddr);
   argint(4, &len);
 
-  // Total bytes we will transmit
-  int total = len + sizeof(struct eth) + sizeof(struct ip) + sizeof(struct udp);
-  if (total > PGSIZE) return (uint64)-1;
-
-  // Allocate a page for the outgoing packet.
-  char* buf = kalloc();
-  if (buf == 0) {
-    cprintf("sys_send: kalloc failed\n");
+  // The route says which interface and source address to use.
+  struct rtentry rt;
+  struct netdev* dev;
+  if (rt_lookup((uint32)dst, &rt) < 0 || (dev = netdev_get(rt.ifindex)) == 0) {
+    __sync_fetch_and_add(&net_stats.tx_no_route, 1);
     return (uint64)-1;
   }
-  memset(buf, 0, PGSIZE);
-
-  // Ethernet header 
-  struct eth* eth = (struct eth*)buf;
-  // destination MAC = host (QEMU) MAC
-  memmove(eth->dhost, host_mac, ETHADDR_LEN);
-  // source MAC = xv6's MAC
-  memmove(eth->shost, local_mac, ETHADDR_LEN);
-  // EtherType = IPv4 (in network byte order)
-  eth->type = htons(ETHTYPE_IP);
 
-  // IP header 
-  struct ip* ip = (struct ip*)(eth + 1);  // immediately after Ethernet
-  ip->ip_vhl = 0x45;                      // version 4, header length 5 * 4 bytes
-  ip->ip_tos = 0;                         // type of service (unused)
-  ip->ip_len = htons(sizeof(struct ip) + sizeof(struct udp) + len);
-  ip->ip_id  = 0;                         // no fragmentation logic in this lab
-  ip->ip_off = 0;                         // no fragmentation
-  ip->ip_ttl = 100;                       // time to live
-  ip->ip_p   = IPPROTO_UDP;               // UDP payload
-  ip->ip_src = htonl(local_ip);           // our IP in network order
-  ip->ip_dst = htonl(dst);                // destination IP in network order
+  // Datagrams bigger than the interface MTU (see netctl mtu) go out
+  // as fragments, up to the IPv4 limit.
+  if (len < 0 || sizeof(struct ip) + sizeof(struct udp) + len > IP_MAXPACKET)
+    return (uint64)-1;
 
-  ip->ip_sum = in_cksum((const unsigned char*)ip, sizeof(*ip));
+  // Copy the payload from user memory into as many mbufs as it
+  // takes, leaving headroom for the headers in the first one.
+  struct mbuf* m = mbuf_alloc(MBUF_HDRROOM);
+  if (m == 0) {
+    cprintf("sys_send: out of packet buffers\n");
+    return (uint64)-1;
+  }
+  struct mbuf* seg = m;
+  for (int off = 0; off < len; ) {
+    int n = len - off;
+    if (n > M_TAILROOM(seg)) n = M_TAILROOM(seg);
+    if (n == 0) {
+      if ((seg->next = mbuf_alloc(0)) == 0) {
+        cprintf("sys_send: out of packet buffers\n");
+        goto bad;
+      }
+      seg = seg->next;
+      continue;
+    }
+    if (copyin_user(p->pgdir, mbuf_append(seg, n), bufaddr + off, n) < 0) {
+      cprintf("send: copyin failed\n");
+      goto bad;
+    }
+    off += n;
+  }
 
   // UDP header
-  struct udp* udp = (struct udp*)(ip + 1);      // right after IP header
+  struct udp* udp = (struct udp*)mbuf_prepend(m, sizeof(struct udp));
   udp->sport = htons((ushort)sport);           // source port
   udp->dport = htons((ushort)dport);           // dest port
   udp->ulen  = htons((ushort)(len + sizeof(struct udp)));  // header + data
-  // UDP checksum is optional; we leave udp->sum as 0.
-
-  //  Payload 
-  char* payload = (char*)(udp + 1);
-
-  // Copy payload from user memory into kernel buffer.
-  if (copyin_user(p->pgdir, payload, bufaddr, len) < 0) {
-    kfree(buf);
-    cprintf("send: copyin failed\n");
-    return (uint64)-1;
+  unsigned int sum = udp_pseudo_sum(htonl(rt.src), htonl(dst), udp->ulen);
+
+  // Checksums. With offload the NIC sums the IP header and the UDP
+  // header + payload itself; the UDP sum is seeded with the
+  // (uninverted) pseudo-header sum. Otherwise, and always for a
+  // datagram that will be fragmented, we walk every mbuf here, and
+  // ip_output() does the IP header.
+  if ((dev->features & NETDEV_F_TXCSUM) &&
+      sizeof(struct ip) + sizeof(struct udp) + len <= dev->mtu()) {
+    m->csum = TXO_IPCSUM | TXO_UDPCSUM;
+    udp->sum = cksum_fold(sum);
+  } else {
+    udp->sum = 0;
+    udp->sum = ~cksum_fold(cksum_chain(sum, m, 0));
+    if (udp->sum == 0)
+      udp->sum = 0xffff;  // 0 means "no checksum" in UDP
   }
 
-  // Hand the fully built packet to the e1000 NIC driver.
-  int txret = e1000_transmit(buf, total);
-  if (txret < 0) {
-    // transmission failed; free the page ourselves
-    kfree(buf);
+  // Hand the chain on towards the NIC driver, which frees it once
+  // sent; ip_output() frees it itself if it can't be sent.
+  if (ip_output(m, dst, IPPROTO_UDP, &rt, dev) < 0)
     return (uint64)-1;
-  }
 
-  (void)txret;
   return 0;
+
+bad:
+  // building the packet failed; free the chain ourselves
+  mbuf_freem(m);
+  return (uint64)-1;
 }
 
-// 
-// ip_rx
 //
-// Called by net_rx() when an Ethernet frame with EtherType=IP arrives.
-// 
-void
-ip_rx(char* buf, int len)
+// icmp_rx
+//
+// An ICMP message for us; m's data starts at the IP header. Echo
+// requests are turned into replies in the buffer they arrived in
+// and sent straight back; echo replies complete a ping().
+//
+static void
+icmp_rx(struct mbuf* m, struct ip* ip, int ip_hdr_len)
 {
-  // don't delete this printf; make grade depends on it.
-  static int seen_ip = 0;
-  if (seen_ip == 0) cprintf("ip_rx: received an IP packet\n");
-  seen_ip = 1;
+  struct icmp* icmp = (struct icmp*)((char*)ip + ip_hdr_len);
 
-  struct eth* eth = (struct eth*)buf;
-  struct ip*  ip  = (struct ip*)(eth + 1);
+  if (m->len - ip_hdr_len < (int)sizeof(struct icmp)) {
+    __sync_fetch_and_add(&net_stats.rx_bad_len, 1);
+    mbuf_freem(m);
+    return;
+  }
+  if (cksum_fold(cksum_chain(0, m, ip_hdr_len)) != 0xffff) {
+    __sync_fetch_and_add(&net_stats.rx_bad_csum, 1);
+    mbuf_freem(m);
+    return;
+  }
 
-  // not UDP
-  if (ip->ip_p != IPPROTO_UDP) {
-    kfree(buf);
+  // A reassembled request may need fragmenting on the way back, so
+  // it goes out through ip_output() rather than in place.
+  if (icmp->type == ICMP_ECHO && ntohl(ip->ip_dst) == local_ip && m->next) {
+    uint32 dst = ntohl(ip->ip_src);
+    struct rtentry rt;
+    struct netdev* dev;
+    if (rt_lookup(dst, &rt) < 0 || (dev = netdev_get(rt.ifindex)) == 0) {
+      mbuf_freem(m);
+      return;
+    }
+    ushort old = *(ushort*)icmp;
+    icmp->type = ICMP_ECHOREPLY;
+    icmp->sum = cksum_update(icmp->sum, old, *(ushort*)icmp);
+    mbuf_pull(m, ip_hdr_len);
+    m->csum = 0;
+    __sync_fetch_and_add(&net_stats.icmp_echo_replies, 1);
+    ip_output(m, dst, IPPROTO_ICMP, &rt, dev);
     return;
   }
 
-  int ihl = (ip->ip_vhl & 0x0f);  // header length in 32-bit words
-  int ip_hdr_len = ihl * 4;
+  if (icmp->type == ICMP_ECHO && ntohl(ip->ip_dst) == local_ip) {
+    // swap the addresses; the IP header changes enough to re-sum
+    uint32 a = ip->ip_src;
+    ip->ip_src = ip->ip_dst;
+    ip->ip_dst = a;
+    ip->ip_ttl = IP_TTL;
+    ip->ip_sum = 0;
+    ip->ip_sum = in_cksum((const unsigned char*)ip, ip_hdr_len);
+
+    // only the type changes in the ICMP message
+    ushort old = *(ushort*)icmp;
+    icmp->type = ICMP_ECHOREPLY;
+    icmp->sum = cksum_update(icmp->sum, old, *(ushort*)icmp);
+
+    // and back to the MAC it came from, on the device it came in on
+    struct eth* eth = (struct eth*)mbuf_prepend(m, sizeof(struct eth));
+    memmove(eth->dhost, eth->shost, ETHADDR_LEN);
+    memmove(eth->shost, local_mac, ETHADDR_LEN);
+    struct netdev* dev = m->dev ? m->dev : netdev;
+    m->csum = 0;
+    __sync_fetch_and_add(&net_stats.icmp_echo_replies, 1);
+    if (dev->xmit(m) < 0)
+      mbuf_freem(m);
+    return;
+  }
+
+  if (icmp->type == ICMP_ECHOREPLY)
+    ping_reply(ntohl(ip->ip_src), ntohs(icmp->id), ntohs(icmp->seq));
+  mbuf_freem(m);
+}
 
+//
+// udp_rx
+//
+// A UDP datagram; m's data starts at the IP header, and csum holds
+// the NIC's RXC_* results. Queue it on its port.
+//
+static void
+udp_rx(struct mbuf* m, struct ip* ip, int ip_hdr_len, int csum)
+{
   // locate UDP header using actual IP header length
   struct udp* udp = (struct udp*)((char*)ip + ip_hdr_len);
 
   // UDP length from header (network byte order)
   int ulen = ntohs(udp->ulen);
-  int payload_len = ulen - sizeof(struct udp);
+
+  // Make sure the header describes something inside the packet
+  // before trusting its length. A reassembled datagram is a chain,
+  // but the UDP header is always in the first mbuf.
+  int avail = mbuf_pktlen(m) - ip_hdr_len;
+  if (m->len - ip_hdr_len < (int)sizeof(struct udp) ||
+      ulen < sizeof(struct udp) || ulen > avail) {
+    __sync_fetch_and_add(&net_stats.rx_bad_len, 1);
+    mbuf_freem(m);
+    return;
+  }
+  mbuf_trim(m, ip_hdr_len + ulen);
+
+  // Drop corrupt packets before queueing them. The NIC usually
+  // checked the sum already (csum); if not it is summed here. A
+  // UDP sum of 0 means the sender didn't compute one.
+  if (csum & RXC_L4_BAD)
+    goto badsum;
+  if ((csum & RXC_L4_OK) == 0 && udp->sum != 0) {
+    if (csum & RXC_IP_OK)  // else ip_rx() counted it already
+      __sync_fetch_and_add(&net_stats.rx_sw_csum, 1);
+    unsigned int sum = udp_pseudo_sum(ip->ip_src, ip->ip_dst, udp->ulen);
+    if (cksum_fold(cksum_chain(sum, m, ip_hdr_len)) != 0xffff)
+      goto badsum;
+  }
 
   // destination and source ports (host order)
   ushort dport = ntohs(udp->dport);
   ushort sport = ntohs(udp->sport);
 
-  // payload pointer is after UDP header
-  char* payload = (char*)udp + sizeof(struct udp);
+  uint32 src = ntohl(ip->ip_src);
+  uint32 dst = ntohl(ip->ip_dst);
 
-  acquire(&netlock);
-  struct port_queue* pq = find_port_queue(dport);
+  // The port lookup itself needs no lock (see port_hash). Unicast
+  // senders to a closed port hear so.
+  struct port_queue* pq = port_lookup(dport, src, sport);
   if (!pq) {
-    release(&netlock);
-    kfree(buf);
+    __sync_fetch_and_add(&net_stats.rx_no_port, 1);
+    if (dst == local_ip)
+      icmp_error(m, ICMP_UNREACH, ICMP_UNREACH_PORT);
+    mbuf_freem(m);
     return;
   }
 
-  if (pq->count >= MAX_QUEUED_PER_PORT) {
-    release(&netlock);
-    kfree(buf);
-    return;
+  // Leave just the payload: strip the IP and UDP headers.
+  mbuf_pull(m, ip_hdr_len + sizeof(struct udp));
+
+  // Multicast: the NIC's hash filter is imperfect, so deliver only
+  // groups that were actually joined.
+  if (IP_MULTICAST(dst)) {
+    if (!mcast_joined(dst)) {
+      __sync_fetch_and_add(&net_stats.rx_mcast_drop, 1);
+      mbuf_freem(m);
+      return;
+    }
+    __sync_fetch_and_add(&net_stats.rx_mcast, 1);
   }
 
-  struct udp_pkt* pkt = (struct udp_pkt*)kalloc();
+  struct udp_pkt* pkt = (struct udp_pkt*)netobj_alloc();
   if (pkt == 0) {
-    release(&netlock);
-    kfree(buf);
+    mbuf_freem(m);
     return;
   }
 
+  acquire(&pq->lock);
 
+  // unbound, or even bound to another port, since the lookup
+  if (!pq->bound || pq->port != dport) {
+    release(&pq->lock);
+    __sync_fetch_and_add(&net_stats.rx_no_port, 1);
+    netobj_free(pkt);
+    mbuf_freem(m);
+    return;
+  }
 
+  if (pq->count >= MAX_QUEUED_PER_PORT) {
+    release(&pq->lock);
+    __sync_fetch_and_add(&net_stats.rx_queue_full, 1);
+    netobj_free(pkt);
+    mbuf_freem(m);
+    return;
+  }
 
-  memset(pkt, 0, PGSIZE);
-  pkt->fullbuf     = buf;
-  pkt->payload     = payload;
-  pkt->payload_len = payload_len;
-  pkt->src_ip      = ntohl(ip->ip_src);  // host order
+  pkt->m           = m;
+  pkt->src_ip      = src;  // host order
   pkt->src_port    = sport;
   pkt->next        = 0;
 
@@ -425,89 +1704,448 @@ ip_rx(char* buf, int len)
   pq->count++;
 
   wakeup((void*)pq);
-  release(&netlock);
+  release(&pq->lock);
+  return;
+
+badsum:
+  __sync_fetch_and_add(&net_stats.rx_bad_csum, 1);
+  mbuf_freem(m);
+}
+
+// Drop q's fragments and free it; reasslock held.
+static void
+ipq_free(struct ipq* q)
+{
+  while (q->frags) {
+    struct mbuf* m = q->frags;
+    q->frags = m->nextpkt;
+    mbuf_freem(m);
+    __sync_fetch_and_add(&net_stats.rx_reass_drops, 1);
+  }
+  ipq_bytes -= q->bytes;
+  q->used = 0;
+}
+
+// Give up on datagrams whose fragments have waited too long.
+// Called from net_timer().
+static void
+ipq_timer(void)
+{
+  acquire(&reasslock);
+  for (int i = 0; i < IPQ_MAX; i++)
+    if (ipqs[i].used && (int)(ticks - ipqs[i].expire) >= 0)
+      ipq_free(&ipqs[i]);
+  release(&reasslock);
+}
+
+//
+// ip_reass
+//
+// Fragment m (data at its IP header, trimmed to ip_len) arrived.
+// Returns the whole datagram, a chain holding the first fragment's
+// IP header and then all the data, once m completes it; 0 until
+// then, or if m had to be dropped.
+//
+static struct mbuf*
+ip_reass(struct mbuf* m)
+{
+  struct ip* ip = (struct ip*)m->data;
+  int off = FRAG_OFF(ip), end = FRAG_END(ip);
+  int more = ntohs(ip->ip_off) & IP_MF;
+
+  __sync_fetch_and_add(&net_stats.rx_frags, 1);
+
+  // All but the last fragment carry a multiple of 8 bytes, and a
+  // datagram is at most IP_MAXPACKET bytes.
+  if (end <= off || (more && (end - off) % 8 != 0) ||
+      FRAG_HLEN(ip) + end > IP_MAXPACKET)
+    goto drop;
+
+  acquire(&reasslock);
+  struct ipq* q = 0;
+  struct ipq* oldest = 0;
+  for (int i = 0; i < IPQ_MAX && q == 0; i++) {
+    struct ipq* p = &ipqs[i];
+    if (p->used && p->src == ip->ip_src && p->dst == ip->ip_dst &&
+        p->id == ip->ip_id && p->proto == ip->ip_p)
+      q = p;
+    else if (oldest == 0 || (oldest->used && (!p->used ||
+             (int)(p->expire - oldest->expire) < 0)))
+      oldest = p;
+  }
+  // Check m against the memory cap and what is known of its
+  // datagram before taking a slot for it, so that a fragment
+  // that's dropped anyway neither evicts another datagram nor
+  // leaves an empty entry behind.
+  if (ipq_bytes + m->size > IPQ_MAXBYTES ||
+      (q && q->total >= 0 && (end > q->total || (!more && end != q->total))) ||
+      (q && !more && q->last && FRAG_END((struct ip*)q->last->data) > end))
+    goto drop_locked;
+
+  if (q == 0) {
+    // a new datagram, in a free slot or else the oldest one's
+    q = oldest;
+    if (q->used)
+      ipq_free(q);
+    q->used   = 1;
+    q->src    = ip->ip_src;
+    q->dst    = ip->ip_dst;
+    q->id     = ip->ip_id;
+    q->proto  = ip->ip_p;
+    q->frags  = q->last = 0;
+    q->have   = 0;
+    q->total  = -1;
+    q->bytes  = 0;
+    q->expire = ticks + IPQ_TIMEOUT_TICKS;
+  }
+
+  // Find m's place. Fragments usually come in order, so try after
+  // the last one first. Overlaps and duplicates are dropped.
+  struct mbuf** pp;
+  struct mbuf* prev = 0;
+  if (q->last && FRAG_END((struct ip*)q->last->data) <= off) {
+    prev = q->last;
+    pp = &prev->nextpkt;
+  } else {
+    for (pp = &q->frags; *pp && FRAG_OFF((struct ip*)(*pp)->data) < off;
+         pp = &(*pp)->nextpkt)
+      prev = *pp;
+  }
+  if ((prev && FRAG_END((struct ip*)prev->data) > off) ||
+      (*pp && FRAG_OFF((struct ip*)(*pp)->data) < end))
+    goto drop_locked;
+
+  m->nextpkt = *pp;
+  *pp = m;
+  if (m->nextpkt == 0)
+    q->last = m;
+  if (!more)
+    q->total = end;
+  q->have += end - off;
+  q->bytes += m->size;
+  ipq_bytes += m->size;
+  if (q->total < 0 || q->have < q->total) {
+    release(&reasslock);
+    return 0;
+  }
+
+  // Complete. Hang the other fragments' data off the first one.
+  struct mbuf* head = q->frags;
+  ipq_bytes -= q->bytes;
+  q->frags = 0;
+  q->used = 0;
+  release(&reasslock);
+
+  struct mbuf* tail = head;
+  for (struct mbuf* f = head->nextpkt; f; f = f->nextpkt) {
+    mbuf_pull(f, FRAG_HLEN((struct ip*)f->data));
+    tail->next = f;
+    tail = f;
+  }
+  for (struct mbuf* f = head; f; f = f->next)
+    f->nextpkt = 0;
+
+  ip = (struct ip*)head->data;
+  ip->ip_len = htons(FRAG_HLEN(ip) + q->total);
+  ip->ip_off = 0;
+  ip->ip_sum = 0;
+  ip->ip_sum = in_cksum((const unsigned char*)ip, FRAG_HLEN(ip));
+  head->csum &= ~(RXC_L4_OK | RXC_L4_BAD);  // only covered a fragment
+  __sync_fetch_and_add(&net_stats.rx_reassembled, 1);
+  return head;
+
+drop_locked:
+  release(&reasslock);
+drop:
+  __sync_fetch_and_add(&net_stats.rx_reass_drops, 1);
+  mbuf_freem(m);
+  return 0;
 }
 
 // 
-// arp_rx
+// ip_rx
 //
-// Called when an ARP request is received for our IP.
+// Called by net_rx() when an Ethernet frame with EtherType=IP arrives.
 // 
 void
-arp_rx(char* inbuf)
+ip_rx(struct mbuf* m)
 {
-  static int seen_arp = 0;
+  // don't delete this printf; make grade depends on it.
+  static int seen_ip = 0;
+  if (seen_ip == 0) cprintf("ip_rx: received an IP packet\n");
+  seen_ip = 1;
 
-  // Only handle the first ARP we see; afterwards, just drop & free.
-  if (seen_arp) {
-    kfree(inbuf);
+  // strip the Ethernet header; net_rx() checked there is an IP one
+  struct ip* ip  = (struct ip*)mbuf_pull(m, sizeof(struct eth));
+  int csum = m->csum;
+
+  int ihl = (ip->ip_vhl & 0x0f);  // header length in 32-bit words
+  int ip_hdr_len = ihl * 4;
+  int ip_len = ntohs(ip->ip_len);
+
+  // Make sure the header describes something inside the frame
+  // before trusting any of its lengths, then drop any Ethernet
+  // padding after the packet.
+  if (ip_hdr_len < sizeof(struct ip) || ip_len < ip_hdr_len ||
+      ip_len > m->len) {
+    __sync_fetch_and_add(&net_stats.rx_bad_len, 1);
+    mbuf_freem(m);
     return;
   }
-  cprintf("arp_rx: received an ARP packet\n");
-  seen_arp = 1;
-
-  struct eth* ineth = (struct eth*)inbuf;
-  struct arp* inarp = (struct arp*)(ineth + 1);
+  m->len = ip_len;
+
+  // The NIC usually checked the header sum already (csum).
+  if (csum & RXC_IP_BAD)
+    goto badsum;
+  if ((csum & RXC_IP_OK) == 0) {
+    __sync_fetch_and_add(&net_stats.rx_sw_csum, 1);
+    if (in_cksum((const unsigned char*)ip, ip_hdr_len) != 0)
+      goto badsum;
+  }
 
-  // Allocate a new buffer for the ARP reply.
-  char* buf = kalloc();
-  if (buf == 0) panic("send_arp_reply");
+  // Fragments wait in ip_reass() until the datagram is whole.
+  if (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) {
+    if ((m = ip_reass(m)) == 0)
+      return;
+    ip = (struct ip*)m->data;
+    ip_hdr_len = FRAG_HLEN(ip);
+    csum = m->csum;
+  }
 
-  // Ethernet header 
-  struct eth* eth = (struct eth*)buf;
-  // dest MAC = original sender's MAC
-  memmove(eth->dhost, ineth->shost, ETHADDR_LEN);
-  // src MAC = our MAC
-  memmove(eth->shost, local_mac, ETHADDR_LEN);
-  eth->type = htons(ETHTYPE_ARP);
+  switch (ip->ip_p) {
+  case IPPROTO_UDP:
+    udp_rx(m, ip, ip_hdr_len, csum);
+    return;
+  case IPPROTO_ICMP:
+    icmp_rx(m, ip, ip_hdr_len);
+    return;
+  }
+  mbuf_freem(m);
+  return;
 
-  // ARP header
-  struct arp* arp = (struct arp*)(eth + 1);
-  arp->hrd = htons(ARP_HRD_ETHER);  // hardware = Ethernet
-  arp->pro = htons(ETHTYPE_IP);     // protocol = IPv4
-  arp->hln = ETHADDR_LEN;           // MAC length = 6
-  arp->pln = sizeof(uint32);        // IPv4 length = 4
-  arp->op  = htons(ARP_OP_REPLY);   // we are sending a reply
+badsum:
+  __sync_fetch_and_add(&net_stats.rx_bad_csum, 1);
+  mbuf_freem(m);
+}
 
-  // sender hardware/IP = us (xv6)
-  memmove(arp->sha, local_mac, ETHADDR_LEN);
-  arp->sip = htonl(local_ip);
 
-  // target hardware = original sender
-  memmove(arp->tha, ineth->shost, ETHADDR_LEN);
-  // target IP = original sender's IP
-  arp->tip = inarp->sip;
+// 
+// arp_rx
+//
+// Called when an ARP packet arrives: learn the sender's MAC, and
+// answer requests for our IP.
+// 
+void
+arp_rx(struct mbuf* in)
+{
+  // don't delete this printf; make grade depends on it.
+  static int seen_arp = 0;
+  if (seen_arp == 0) cprintf("arp_rx: received an ARP packet\n");
+  seen_arp = 1;
 
-  // Transmit ARP reply and free the received buffer.
-  e1000_transmit(buf, sizeof(*eth) + sizeof(*arp));
-  kfree(inbuf);
+  struct arp* inarp = (struct arp*)(in->data + sizeof(struct eth));
+  if (ntohs(inarp->hrd) != ARP_HRD_ETHER || ntohs(inarp->pro) != ETHTYPE_IP ||
+      inarp->hln != ETHADDR_LEN || inarp->pln != sizeof(uint32)) {
+    mbuf_freem(in);
+    return;
+  }
+  int op = ntohs(inarp->op);
+  uint32 sip = ntohl(inarp->sip);
+  uint32 tip = ntohl(inarp->tip);
+  uchar sha[ETHADDR_LEN];
+  memmove(sha, inarp->sha, ETHADDR_LEN);
+  struct netdev* dev = in->dev ? in->dev : netdev;
+  mbuf_freem(in);
+
+  // RFC 826: refresh the sender's entry if it has one, and add one
+  // if the packet is meant for us, since a reply is likely wanted.
+  if (sip != 0)
+    arp_update(sip, sha, dev, tip == local_ip);
+
+  if (op == ARP_OP_REQUEST && tip == local_ip) {
+    __sync_fetch_and_add(&net_stats.arp_replies, 1);
+    arp_send(dev, ARP_OP_REPLY, sha, sha, sip);
+  }
 }
 
 // 
 // net_rx
 //
-// Entry point from the e1000 driver when *any* Ethernet frame is received.
+// Entry point from the NIC driver when *any* Ethernet frame is received.
 // 
 void
-net_rx(char* buf, int len)
+net_rx(struct mbuf* m)
 {
-  struct eth* eth = (struct eth*)buf;
+  struct eth* eth = (struct eth*)m->data;
 
-  if (len >= (int)(sizeof(struct eth) + sizeof(struct arp)) &&
+  if (m->len >= (int)(sizeof(struct eth) + sizeof(struct arp)) &&
       ntohs(eth->type) == ETHTYPE_ARP) {
     // Ethernet type = ARP
-    arp_rx(buf);
-  } else if (len >= (int)(sizeof(struct eth) + sizeof(struct ip)) &&
+    arp_rx(m);
+  } else if (m->len >= (int)(sizeof(struct eth) + sizeof(struct ip)) &&
              ntohs(eth->type) == ETHTYPE_IP) {
     // Ethernet type = IPv4
-    ip_rx(buf, len);
+    ip_rx(m);
   } else {
     // Unknown or too short; just drop.
-    kfree(buf);
+    mbuf_freem(m);
   }
 }
 
 
+//
+// netctl(int cmd, int arg)
+//
+// Run-time tuning knobs for the network driver; see netctl.h.
+// The checksum benchmarks are the stack's own.
+//
+uint64
+sys_netctl(void)
+{
+  int cmd, arg;
+
+  if (argint(0, &cmd) < 0) return (uint64)-1;
+  if (argint(1, &arg) < 0) return (uint64)-1;
+
+  if (cmd == NETCTL_CKSUM_BENCH || cmd == NETCTL_CKSUM_BENCH_REF)
+    return (uint64)cksum_bench(arg, cmd == NETCTL_CKSUM_BENCH_REF);
+
+  if (netdev == 0) return (uint64)-1;
+  return (uint64)netdev->ctl(cmd, arg);
+}
+
+//
+// route(int op, struct rtentry *rt, int n)
+//
+// Change, list or query the routing table; see route.h.
+//
+uint64
+sys_route(void)
+{
+  int op, n;
+  struct rtentry* urt;
+  struct rtentry rt;
+
+  if (argint(0, &op) < 0 || argint(2, &n) < 0 ||
+      argptr(1, (char**)&urt, sizeof(*urt)) < 0)
+    return (uint64)-1;
+  rt = *urt;
+
+  switch (op) {
+  case RT_ADD:
+    if (netdev_get(rt.ifindex) == 0)
+      return (uint64)-1;
+    if (rt.src == 0)
+      rt.src = local_ip;
+    return (uint64)rt_add(&rt);
+  case RT_DEL:
+    return (uint64)rt_del(rt.dst, rt.prefixlen);
+  case RT_GET:
+    if (rt_get(n, &rt) < 0)
+      return (uint64)-1;
+    break;
+  case RT_LOOKUP:
+    if (rt_lookup(rt.dst, &rt) < 0)
+      return (uint64)-1;
+    break;
+  case RT_BENCH:
+  case RT_BENCH_CACHED:
+    return (uint64)rt_bench(rt.dst, rt.prefixlen, n, op == RT_BENCH_CACHED);
+  default:
+    return (uint64)-1;
+  }
+  *urt = rt;
+  return 0;
+}
+
+//
+// netstat(struct netstat *st)
+//
+// Copy the driver, NIC and stack counters (see netstat.h) out to
+// user space.
+//
+uint64
+sys_netstat(void)
+{
+  struct netstat st;
+  uint64 addr;
+
+  if (argaddr(0, &addr) < 0) return (uint64)-1;
+
+  memset(&st, 0, sizeof(st));
+  if (netdev)
+    netdev->getstats(&st);
+  st.rx_bad_csum   = net_stats.rx_bad_csum;
+  st.rx_bad_len    = net_stats.rx_bad_len;
+  st.rx_no_port    = net_stats.rx_no_port;
+  st.rx_queue_full = net_stats.rx_queue_full;
+  st.arp_requests  = net_stats.arp_requests;
+  st.arp_replies   = net_stats.arp_replies;
+  st.arp_unresolved = net_stats.arp_unresolved;
+  st.tx_no_route   = net_stats.tx_no_route;
+  st.icmp_echo_replies = net_stats.icmp_echo_replies;
+  st.icmp_unreach  = net_stats.icmp_unreach;
+  st.icmp_ratelimited = net_stats.icmp_ratelimited;
+  st.tx_frags      = net_stats.tx_frags;
+  st.rx_frags      = net_stats.rx_frags;
+  st.rx_reassembled = net_stats.rx_reassembled;
+  st.rx_reass_drops = net_stats.rx_reass_drops;
+  rt_getstats(&st);
+  st.netlock_acquires  = netlock.nacquire;
+  st.netlock_contended = netlock.ncontended;
+  for (int i = 0; i < nports; i++) {
+    st.portlock_acquires  += ports[i].lock.nacquire;
+    st.portlock_contended += ports[i].lock.ncontended;
+  }
+
+  if (copyout(myproc()->pgdir, addr, &st, sizeof(st)) < 0)
+    return (uint64)-1;
+  return 0;
+}
+
+//
+// net_debug
+//
+// Dump network driver counters to the console (^N on the console).
+//
+void
+net_debug(void)
+{
+  if (netdev)
+    netdev->dump();
+  cprintf("net: rx sw csum %d, dropped bad csum %d bad len %d\n",
+          (int)net_stats.rx_sw_csum, (int)net_stats.rx_bad_csum,
+          (int)net_stats.rx_bad_len);
+  cprintf("net: rx dropped no port %d queue full %d\n",
+          (int)net_stats.rx_no_port, (int)net_stats.rx_queue_full);
+  cprintf("net: rx multicast %d, dropped unjoined %d\n",
+          (int)net_stats.rx_mcast, (int)net_stats.rx_mcast_drop);
+  uint64 acq = 0, cont = 0;
+  for (int i = 0; i < nports; i++) {
+    acq  += ports[i].lock.nacquire;
+    cont += ports[i].lock.ncontended;
+  }
+  cprintf("net: netlock %d acquires %d contended, port locks %d / %d\n",
+          (int)netlock.nacquire, (int)netlock.ncontended, (int)acq,
+          (int)cont);
+  cprintf("net: arp requests %d replies %d unresolved drops %d\n",
+          (int)net_stats.arp_requests, (int)net_stats.arp_replies,
+          (int)net_stats.arp_unresolved);
+  for (int i = 0; i < ARP_CACHE_SIZE; i++) {
+    struct arp_entry* e = &arp_cache[i];
+    if (e->state == ARP_FREE)
+      continue;
+    cprintf("  %d.%d.%d.%d ", e->ip >> 24, (e->ip >> 16) & 0xff,
+            (e->ip >> 8) & 0xff, e->ip & 0xff);
+    if (e->state == ARP_REACHABLE)
+      cprintf("%x:%x:%x:%x:%x:%x %d ticks left\n", e->mac[0], e->mac[1],
+              e->mac[2], e->mac[3], e->mac[4], e->mac[5],
+              (int)(e->expire - ticks));
+    else
+      cprintf("incomplete, %d tries, %d waiting\n", e->tries, e->npending);
+  }
+  pktbuf_dump();
+}
 
 // 
 // copyin_user (file-local helper)
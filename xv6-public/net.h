@@ -82,6 +82,13 @@ struct ip {
     uint32 ip_dst;  // destination IP address (in network byte order)
 };
 
+// Flags and offset in ip_off (host order)
+#define IP_DF 0x4000       // don't fragment
+#define IP_MF 0x2000       // more fragments follow
+#define IP_OFFMASK 0x1fff  // fragment offset, in 8-byte units
+
+#define IP_MAXPACKET 65535  // largest IP packet, header included
+
 // Values for ip_p (protocol field in IP header)
 #define IPPROTO_ICMP 1  // Internet Control Message Protocol
 #define IPPROTO_TCP 6   // Transmission Control Protocol
@@ -104,6 +111,25 @@ struct udp {
     ushort sum;    // UDP checksum (optional; can be 0)
 };
 
+// --------------------------- ICMP -------------------------------
+// ICMP header (RFC 792). Echo messages carry id and seq here; an
+// error leaves them unused and is followed by the IP header and
+// first 8 data bytes of the datagram that caused it.
+// All fields are in network byte order.
+// ----------------------------------------------------------------
+struct icmp {
+    uchar type;   // ICMP_*
+    uchar code;   // e.g. ICMP_UNREACH_PORT for ICMP_UNREACH
+    ushort sum;   // checksum over the ICMP header and data
+    ushort id;    // echo: identifies the sender
+    ushort seq;   // echo: sequence number
+};
+
+#define ICMP_ECHOREPLY 0     // echo reply
+#define ICMP_UNREACH 3       // destination unreachable
+#define ICMP_UNREACH_PORT 3  //   code: no one bound to the port
+#define ICMP_ECHO 8          // echo request
+
 // --------------------------- ARP --------------------------------
 // ARP packet carried inside an Ethernet frame. Used to map an
 // IPv4 address to a MAC address on the local network.
@@ -0,0 +1,129 @@
+//
+// netctl: tune the network driver at run time.
+//
+//   netctl itr adaptive    let the driver pick interrupt moderation
+//   netctl itr <n>         cap NIC interrupts at n per second
+//                          (0 = interrupt after every packet)
+//   netctl rxpoll <n>      poll thread handles n frames per pass
+//                          (0 = receive in the interrupt handler)
+//   netctl txcsum on|off   NIC or software IP/UDP checksums on send
+//   netctl mtu <n>         interface MTU, up to 9000 (jumbo frames)
+//   netctl irqcpu <n>|rr|least
+//                          CPU that takes NIC interrupts: fixed,
+//                          rotating, or the least busy one
+//   netctl queues <n>      RX queues RSS spreads packets over (e1000e)
+//   netctl reset           reset the NIC's rings, as the TX watchdog does
+//   netctl cksumbench      time the stack's checksum routine against
+//                          the 16-bit reference over packet sizes
+//
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "netctl.h"
+
+void
+usage(void)
+{
+  printf(2, "usage: netctl itr adaptive|<ints/sec>\n");
+  printf(2, "       netctl rxpoll <budget>\n");
+  printf(2, "       netctl txcsum on|off\n");
+  printf(2, "       netctl mtu <bytes>\n");
+  printf(2, "       netctl irqcpu <cpu>|rr|least\n");
+  printf(2, "       netctl queues <n>\n");
+  printf(2, "       netctl reset\n");
+  printf(2, "       netctl cksumbench\n");
+  exit();
+}
+
+// Cycles per checksum, reference and fast, for a range of sizes.
+void
+cksumbench(void)
+{
+  static int sizes[] = { 20, 40, 64, 128, 256, 576, 1024, 1500, 4088 };
+
+  printf(1, "bytes   ref cycles  fast cycles  speedup\n");
+  for (int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+    int ref = netctl(NETCTL_CKSUM_BENCH_REF, sizes[i]);
+    int fast = netctl(NETCTL_CKSUM_BENCH, sizes[i]);
+    if (ref < 0 || fast < 0) {
+      printf(2, "netctl: cksumbench %d failed\n", sizes[i]);
+      exit();
+    }
+    if (fast == 0)
+      fast = 1;
+    printf(1, "%d\t%d\t\t%d\t     %d.%dx\n", sizes[i], ref, fast,
+           ref / fast, ref * 10 / fast % 10);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+    if (netctl(NETCTL_RESET, 0) < 0)
+      printf(2, "netctl: reset failed\n");
+    exit();
+  }
+  if (argc == 2 && strcmp(argv[1], "cksumbench") == 0) {
+    cksumbench();
+    exit();
+  }
+  if (argc != 3)
+    usage();
+
+  if (strcmp(argv[1], "itr") == 0) {
+    int arg;
+    if (strcmp(argv[2], "adaptive") == 0)
+      arg = NETCTL_ITR_ADAPTIVE;
+    else
+      arg = atoi(argv[2]);
+    if (netctl(NETCTL_ITR, arg) < 0) {
+      printf(2, "netctl: itr %s failed\n", argv[2]);
+      exit();
+    }
+  } else if (strcmp(argv[1], "rxpoll") == 0) {
+    if (netctl(NETCTL_RXPOLL, atoi(argv[2])) < 0) {
+      printf(2, "netctl: rxpoll %s failed\n", argv[2]);
+      exit();
+    }
+  } else if (strcmp(argv[1], "txcsum") == 0) {
+    int arg;
+    if (strcmp(argv[2], "on") == 0)
+      arg = 1;
+    else if (strcmp(argv[2], "off") == 0)
+      arg = 0;
+    else
+      usage();
+    if (netctl(NETCTL_TXCSUM, arg) < 0) {
+      printf(2, "netctl: txcsum %s failed\n", argv[2]);
+      exit();
+    }
+  } else if (strcmp(argv[1], "irqcpu") == 0) {
+    int arg;
+    if (strcmp(argv[2], "rr") == 0)
+      arg = NETCTL_IRQ_RR;
+    else if (strcmp(argv[2], "least") == 0)
+      arg = NETCTL_IRQ_LEAST;
+    else
+      arg = atoi(argv[2]);
+    if (netctl(NETCTL_IRQCPU, arg) < 0) {
+      printf(2, "netctl: irqcpu %s failed\n", argv[2]);
+      exit();
+    }
+  } else if (strcmp(argv[1], "mtu") == 0) {
+    if (netctl(NETCTL_MTU, atoi(argv[2])) < 0) {
+      printf(2, "netctl: mtu %s failed\n", argv[2]);
+      exit();
+    }
+  } else if (strcmp(argv[1], "queues") == 0) {
+    if (netctl(NETCTL_QUEUES, atoi(argv[2])) < 0) {
+      printf(2, "netctl: queues %s failed\n", argv[2]);
+      exit();
+    }
+  } else {
+    usage();
+  }
+
+  exit();
+}
@@ -0,0 +1,45 @@
+#pragma once
+// Commands for the netctl(cmd, arg) system call, which tunes the
+// network driver at run time. Shared by the kernel and user programs.
+// netctl() returns 0 on success and -1 on a bad command or argument.
+
+// Interrupt moderation. arg is NETCTL_ITR_ADAPTIVE to let the driver
+// tune RDTR/RADV/ITR from the packet rate, or a fixed cap on NIC
+// interrupts per second (0 = one interrupt per packet).
+#define NETCTL_ITR         1
+#define NETCTL_ITR_ADAPTIVE (-1)
+
+// Receive processing. arg 0 handles every received frame in the
+// interrupt handler. arg n > 0 selects interrupt-then-poll mode: the
+// interrupt masks RX interrupts and wakes a kernel poll thread, which
+// handles at most n frames per pass and yields the CPU between passes.
+#define NETCTL_RXPOLL      2
+
+// Transmit checksum offload. arg 1 lets the NIC compute IPv4 and UDP
+// checksums from a context descriptor; arg 0 computes them in software.
+#define NETCTL_TXCSUM      3
+
+// Interface MTU, 68 up to 9000 bytes. Anything above 1500 turns on
+// jumbo frame reception (RCTL.LPE); sends larger than the MTU fail.
+#define NETCTL_MTU         4
+
+// Which CPU takes the NIC interrupt: a CPU number, or one of the
+// modes below, which re-pick a CPU every few timer ticks.
+#define NETCTL_IRQCPU      5
+#define NETCTL_IRQ_RR      (-1)  // rotate over all CPUs
+#define NETCTL_IRQ_LEAST   (-2)  // CPU that ran processes least lately
+
+// Multi-queue NICs (e1000e): spread received packets over the first
+// arg RX queues with RSS; 1 sends everything to queue 0.
+#define NETCTL_QUEUES      6
+
+// Reset the NIC's descriptor rings now, as the TX watchdog does when
+// the NIC stops sending. arg is ignored.
+#define NETCTL_RESET       7
+
+// Checksum microbenchmark, run by the stack rather than the driver:
+// the CPU cycles one Internet checksum of arg bytes (1 to 4088)
+// takes with the stack's routine, or with the plain 16-bit loop it
+// replaced. -1 if the two disagree on the sum.
+#define NETCTL_CKSUM_BENCH     8
+#define NETCTL_CKSUM_BENCH_REF 9
@@ -0,0 +1,44 @@
+#pragma once
+
+struct mbuf;
+struct netstat;
+
+// ------------------------------------------------------------
+// A network device as the stack sees it. Each NIC driver fills in
+// one of these and hands it to netdev_register() from its attach
+// function; the stack uses the first device registered, so it runs
+// on whichever supported NIC QEMU provides. Received frames come
+// up through net_rx() as mbufs whose dev points back here.
+// ------------------------------------------------------------
+struct netdev {
+    char* name;
+    int features;  // NETDEV_F_*; drivers may change them at run time
+
+    // Send one frame, an mbuf chain; see e1000_transmit().
+    int (*xmit)(struct mbuf* m);
+    // Send several frames; returns how many were queued.
+    int (*xmit_batch)(struct mbuf** pkts, int n);
+    // Hand up to budget received frames to net_rx() outside of the
+    // interrupt path; returns how many. Frames reach the stack in
+    // order even when this races with the device's interrupt.
+    int (*rx_poll)(int budget);
+
+    int (*mtu)(void);                      // largest IP packet sent
+    void (*getstats)(struct netstat* st);  // driver and NIC counters
+    int (*ctl)(int cmd, int arg);          // netctl() knobs
+    void (*dump)(void);                    // print counters (^N)
+    int (*mcast_add)(uchar* mac);          // with NETDEV_F_MCAST
+    int (*mcast_del)(uchar* mac);
+    // Optional: check for a wedged device and recover it; called
+    // from the timer every NET_WATCHDOG_TICKS (see net_timer()).
+    void (*watchdog)(void);
+    // Optional: called by netinit() once the stack is set up and
+    // every CPU is running. Devices whose interrupts would reach
+    // the stack or another CPU before that turn them on here.
+    void (*start)(void);
+};
+
+#define NETDEV_F_TXCSUM 0x1  // xmit() takes TXO_* offloads in m->csum
+#define NETDEV_F_RXCSUM 0x2  // received mbufs carry RXC_* in m->csum
+#define NETDEV_F_MCAST 0x4   // mcast_add()/mcast_del() filter
+#define NETDEV_F_MQ 0x8      // several RX queues spread by RSS
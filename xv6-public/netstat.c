@@ -0,0 +1,125 @@
+//
+// netstat: show network counters.
+//
+//   netstat                  print totals since boot
+//   netstat <secs> [count]   sample every secs seconds and print
+//                            per-second rates (count times, or
+//                            forever)
+//
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "netstat.h"
+
+#define TICKS_PER_SEC 100
+
+static void
+totals(struct netstat *st)
+{
+  printf(1, "nic:    rx %d pkts %d bytes, tx %d pkts %d bytes\n",
+         (int)st->hw_rx_packets, (int)st->hw_rx_bytes,
+         (int)st->hw_tx_packets, (int)st->hw_tx_bytes);
+  printf(1, "        missed %d, no rx buffers %d, crc errors %d, "
+         "collisions %d\n", (int)st->hw_missed, (int)st->hw_no_buffers,
+         (int)st->hw_crc_errors, (int)st->hw_collisions);
+  printf(1, "driver: interrupts %d on cpu %d, per cpu:",
+         (int)st->interrupts, st->irq_cpu);
+  for (int c = 0; c < NETSTAT_NCPU; c++)
+    printf(1, " %d", (int)st->intr_cpu[c]);
+  printf(1, "\n");
+  printf(1, "        rx %d pkts %d bytes, no memory %d\n",
+         (int)st->rx_packets, (int)st->rx_bytes, (int)st->rx_nomem);
+  printf(1, "        tx %d pkts %d bytes, ring full %d, errors %d, "
+         "stalls %d\n", (int)st->tx_packets, (int)st->tx_bytes,
+         (int)st->tx_ring_full, (int)st->tx_errors, (int)st->tx_stalls);
+  printf(1, "stack:  dropped bad csum %d, bad length %d, no port %d, "
+         "queue full %d\n", (int)st->rx_bad_csum, (int)st->rx_bad_len,
+         (int)st->rx_no_port, (int)st->rx_queue_full);
+  printf(1, "arp:    requests %d, replies %d, dropped unresolved %d\n",
+         (int)st->arp_requests, (int)st->arp_replies,
+         (int)st->arp_unresolved);
+  printf(1, "route:  cache hits %d misses %d, no route %d\n",
+         (int)st->rt_cache_hits, (int)st->rt_cache_misses,
+         (int)st->tx_no_route);
+  printf(1, "icmp:   echo replies %d, port unreachable %d, rate limited %d\n",
+         (int)st->icmp_echo_replies, (int)st->icmp_unreach,
+         (int)st->icmp_ratelimited);
+  printf(1, "frag:   sent %d, received %d, reassembled %d, dropped %d\n",
+         (int)st->tx_frags, (int)st->rx_frags, (int)st->rx_reassembled,
+         (int)st->rx_reass_drops);
+  printf(1, "locks:  netlock %d acquires %d contended, port locks %d "
+         "acquires %d contended\n", (int)st->netlock_acquires,
+         (int)st->netlock_contended, (int)st->portlock_acquires,
+         (int)st->portlock_contended);
+}
+
+// per-second rate of a counter that moved by d over t ticks
+static int
+rate(uint64 d, int t)
+{
+  return (int)((d * TICKS_PER_SEC) / t);
+}
+
+static void
+rates(struct netstat *a, struct netstat *b, int t)
+{
+  printf(1, "rx %d pkt/s %d B/s  tx %d pkt/s %d B/s  intr %d/s  "
+         "drops: missed %d nobuf %d nomem %d txfull %d queue %d\n",
+         rate(b->rx_packets - a->rx_packets, t),
+         rate(b->rx_bytes - a->rx_bytes, t),
+         rate(b->tx_packets - a->tx_packets, t),
+         rate(b->tx_bytes - a->tx_bytes, t),
+         rate(b->interrupts - a->interrupts, t),
+         (int)(b->hw_missed - a->hw_missed),
+         (int)(b->hw_no_buffers - a->hw_no_buffers),
+         (int)(b->rx_nomem - a->rx_nomem),
+         (int)(b->tx_ring_full - a->tx_ring_full),
+         (int)(b->rx_queue_full - a->rx_queue_full));
+  printf(1, "   intr/s per cpu:");
+  for (int c = 0; c < NETSTAT_NCPU; c++)
+    printf(1, " %d", rate(b->intr_cpu[c] - a->intr_cpu[c], t));
+  printf(1, " (now cpu %d)\n", b->irq_cpu);
+  printf(1, "   contended/s: netlock %d port locks %d\n",
+         rate(b->netlock_contended - a->netlock_contended, t),
+         rate(b->portlock_contended - a->portlock_contended, t));
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct netstat a, b;
+
+  if (argc > 3) {
+    printf(2, "usage: netstat [secs [count]]\n");
+    exit();
+  }
+
+  if (netstat(&a) < 0) {
+    printf(2, "netstat: failed\n");
+    exit();
+  }
+  if (argc == 1) {
+    totals(&a);
+    exit();
+  }
+
+  int secs = atoi(argv[1]);
+  int count = argc == 3 ? atoi(argv[2]) : -1;
+  if (secs <= 0)
+    secs = 1;
+
+  int t0 = uptime();
+  while (count < 0 || count-- > 0) {
+    sleep(secs * TICKS_PER_SEC);
+    int t1 = uptime();
+    if (netstat(&b) < 0) {
+      printf(2, "netstat: failed\n");
+      exit();
+    }
+    rates(&a, &b, t1 > t0 ? t1 - t0 : 1);
+    a = b;
+    t0 = t1;
+  }
+  exit();
+}
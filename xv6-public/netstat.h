@@ -0,0 +1,56 @@
+#pragma once
+
+#define NETSTAT_NCPU 8  // per-CPU slots; matches NCPU in param.h
+// Counters returned by the netstat(struct netstat*) system call.
+// Shared by the kernel and user programs. All values are totals
+// since boot; sample twice and subtract to get rates.
+struct netstat {
+    // e1000 statistics registers [E1000 13.7], which clear on read
+    // and are accumulated by the driver
+    uint64 hw_rx_packets;  // GPRC: good packets received
+    uint64 hw_rx_bytes;    // GORC: good octets received
+    uint64 hw_tx_packets;  // GPTC: good packets transmitted
+    uint64 hw_tx_bytes;    // GOTC: good octets transmitted
+    uint64 hw_missed;      // MPC: dropped, RX FIFO full
+    uint64 hw_no_buffers;  // RNBC: no free RX descriptor (ring full)
+    uint64 hw_crc_errors;  // CRCERRS: bad frame checksum
+    uint64 hw_collisions;  // COLC: transmit collisions
+
+    // e1000 driver
+    uint64 interrupts;     // e1000 interrupts taken
+    uint64 intr_cpu[NETSTAT_NCPU];  // ... on each CPU
+    int irq_cpu;           // CPU the interrupt is steered to now
+    uint64 rx_packets;     // frames handed to the stack
+    uint64 rx_bytes;
+    uint64 rx_nomem;       // frames dropped: no buffer to copy into
+    uint64 tx_packets;     // frames queued for transmit
+    uint64 tx_bytes;
+    uint64 tx_ring_full;   // sends refused: TX ring full
+    uint64 tx_errors;      // sends refused: bad fragment list or size
+    uint64 tx_stalls;      // TX stalls the watchdog reset the NIC for
+
+    // network stack
+    uint64 rx_bad_csum;    // dropped: IP or UDP checksum wrong
+    uint64 rx_bad_len;     // dropped: malformed header lengths
+    uint64 rx_no_port;     // dropped: port unbound or connected elsewhere
+    uint64 rx_queue_full;  // dropped: socket queue full
+    uint64 arp_requests;   // ARP requests sent
+    uint64 arp_replies;    // ARP replies sent
+    uint64 arp_unresolved; // dropped: no ARP reply, or too many waiting
+    uint64 tx_no_route;    // sends refused: no route to the destination
+    uint64 icmp_echo_replies; // pings answered
+    uint64 icmp_unreach;   // port unreachable errors sent
+    uint64 icmp_ratelimited; // errors held back by the rate limit
+    uint64 tx_frags;       // IP fragments sent
+    uint64 rx_frags;       // IP fragments received
+    uint64 rx_reassembled; // datagrams reassembled from them
+    uint64 rx_reass_drops; // fragments dropped: bad, overlapping or timed out
+    uint64 rt_cache_hits;  // sends routed from the route cache
+    uint64 rt_cache_misses; // sends that searched the routing table
+
+    // lock contention: acquisitions, and how many had to spin
+    uint64 netlock_acquires;    // port table and multicast groups
+    uint64 netlock_contended;
+    uint64 portlock_acquires;   // all port queue locks together
+    uint64 portlock_contended;
+};
@@ -7,6 +7,9 @@
 #include "net.h"
 #include "stat.h"
 #include "user.h"
+#include "netctl.h"
+#include "netstat.h"
+#include "route.h"
 //#include "string.h"
 
 // ---------- printing & syscall prototypes ----------
@@ -254,6 +257,100 @@ rx2(void)
   return 1;
 }
 
+//
+// count how many packets of each burst sent by
+// ./nettest.py rxbench make it through to port 2001,
+// and print the drop rate per burst size.
+//
+int
+rxbench(void)
+{
+  int sizes[16], sent[16], got[16];
+  int nsizes = 0;
+  int cnt = 0;
+
+  bind(2001);
+
+  while (1) {
+    char ibuf[128];
+    uint32 src;
+    ushort sport;
+    int cc = recv(2001, &src, &sport, ibuf, sizeof(ibuf)-1);
+    if (cc < 0) {
+      eprintf("nettest rxbench: recv() failed\n");
+      return 0;
+    }
+    ibuf[cc] = '\0';
+
+    if (memcmp(ibuf, "done", 4) == 0)
+      break;
+
+    if (memcmp(ibuf, "end ", 4) != 0) {
+      cnt++;
+      continue;
+    }
+
+    // end of one burst: credit it to its burst size.
+    int burst = atoi(ibuf + 4);
+    int i;
+    for (i = 0; i < nsizes; i++)
+      if (sizes[i] == burst)
+        break;
+    if (i == nsizes) {
+      if (nsizes == 16) {
+        cnt = 0;
+        continue;
+      }
+      sizes[i] = burst;
+      sent[i] = got[i] = 0;
+      nsizes++;
+    }
+    sent[i] += burst;
+    got[i] += cnt;
+    cnt = 0;
+  }
+
+  for (int i = 0; i < nsizes; i++) {
+    int dropped = sent[i] - got[i];
+    uprintf("rxbench: burst %d: received %d/%d, dropped %d%%\n",
+            sizes[i], got[i], sent[i], (dropped * 100) / sent[i]);
+  }
+  uprintf("rxbench: OK\n");
+  return 1;
+}
+
+//
+// send a stream of full-size UDP packets to nettest.py txbench
+// and report the send rate; compare runs with "netctl txcsum on"
+// and "netctl txcsum off". nettest.py counts what arrives, and
+// packets with bad checksums are dropped by the host.
+//
+int
+txbench(void)
+{
+  static char buf[1400];
+  int npkts = 4000;
+  int sent = 0;
+
+  for (int i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + (i % 26);
+
+  int t0 = uptime();
+  for (int i = 0; i < npkts; i++) {
+    if (send(2000, 0x0A000202, NET_TESTS_PORT, buf, sizeof(buf)) == 0)
+      sent++;
+  }
+  int t1 = uptime();
+  send(2000, 0x0A000202, NET_TESTS_PORT, "done", 4);
+
+  if (t1 == t0)
+    t1 = t0 + 1;
+  uprintf("txbench: sent %d/%d packets in %d ticks, %d pkts/sec\n",
+          sent, npkts, t1 - t0, (sent * 100) / (t1 - t0));
+  uprintf("txbench: OK\n");
+  return 1;
+}
+
 //
 // send some UDP packets to nettest.py tx.
 //
@@ -604,6 +701,323 @@ ping3(void)
   return 1;
 }
 
+//
+// ping, reset the NIC's rings the way the TX watchdog does after a
+// stall, and ping again: traffic must keep flowing.
+// nettest.py ping must be started first.
+//
+int
+reset(void)
+{
+  uprintf("reset: starting\n");
+
+  bind(2010);
+
+  for (int i = 0; i < 2; i++) {
+    if (i == 1 && netctl(NETCTL_RESET, 0) < 0) {
+      eprintf("reset: netctl() failed\n");
+      return 0;
+    }
+
+    char buf[6];
+    memmove(buf, "reset0", sizeof(buf));
+    buf[5] = '0' + i;
+    if (send(2010, 0x0A000202, NET_TESTS_PORT, buf, sizeof(buf)) < 0) {
+      eprintf("reset: send() failed\n");
+      return 0;
+    }
+
+    char ibuf[128];
+    uint32 src;
+    ushort sport;
+    int cc = recv(2010, &src, &sport, ibuf, sizeof(ibuf)-1);
+    if (cc != sizeof(buf) || memcmp(buf, ibuf, sizeof(buf)) != 0) {
+      uprintf("reset: wrong reply %s\n", i ? "after reset" : "before reset");
+      return 0;
+    }
+  }
+
+  uprintf("reset: OK\n");
+  return 1;
+}
+
+//
+// bind a few hundred ports, then ping through some of them, one
+// connected to nettest.py: replies must come back on the right
+// port however full the port table's buckets are.
+// nettest.py ping must be started first.
+//
+int
+ports(void)
+{
+  int ok = 0;
+
+  uprintf("ports: starting\n");
+
+  for (int port = 3000; port < 3300; port++)
+    bind(port);
+  if (bind(3000) == 0) {
+    uprintf("ports: duplicate bind succeeded\n");
+    goto out;
+  }
+  if (connect(3150, 0x0A000202, NET_TESTS_PORT) < 0) {
+    eprintf("ports: connect() failed\n");
+    goto out;
+  }
+
+  for (int port = 3000; port < 3300; port += 50) {
+    char buf[8];
+    memmove(buf, "ports", 5);
+    buf[5] = '0' + (port / 100) % 10;
+    buf[6] = '0' + (port / 10) % 10;
+    buf[7] = '0';
+    if (send(port, 0x0A000202, NET_TESTS_PORT, buf, sizeof(buf)) < 0) {
+      eprintf("ports: send() failed\n");
+      goto out;
+    }
+
+    char ibuf[128];
+    uint32 src;
+    ushort sport;
+    int cc = recv(port, &src, &sport, ibuf, sizeof(ibuf)-1);
+    if (cc != sizeof(buf) || memcmp(buf, ibuf, sizeof(buf)) != 0) {
+      uprintf("ports: wrong reply on port %d\n", port);
+      goto out;
+    }
+  }
+  ok = 1;
+
+out:
+  // give the slots back for later tests, and check they come back
+  for (int port = 3000; port < 3300; port++) {
+    if (unbind(port) < 0 && ok) {
+      uprintf("ports: unbind(%d) failed\n", port);
+      ok = 0;
+    }
+  }
+  if (ok && (bind(3000) < 0 || unbind(3000) < 0)) {
+    uprintf("ports: can't bind again after unbind\n");
+    ok = 0;
+  }
+  if (ok)
+    uprintf("ports: OK\n");
+  return ok;
+}
+
+//
+// send to a host on our subnet that doesn't exist: the packet must
+// wait for an ARP reply that never comes and then be dropped, while
+// traffic through the gateway carries on.
+// nettest.py ping must be started first.
+//
+int
+arp(void)
+{
+  struct netstat a, b;
+
+  uprintf("arp: starting\n");
+
+  bind(2020);
+  netstat(&a);
+  if (send(2020, 0x0A000263, NET_TESTS_PORT, "arp", 3) < 0) {  // 10.0.2.99
+    uprintf("arp: send() to unresolved host failed\n");
+    return 0;
+  }
+
+  char buf[4];
+  memmove(buf, "arp0", sizeof(buf));
+  if (send(2020, 0x0A000202, NET_TESTS_PORT, buf, sizeof(buf)) < 0) {
+    eprintf("arp: send() failed\n");
+    return 0;
+  }
+  char ibuf[128];
+  uint32 src;
+  ushort sport;
+  int cc = recv(2020, &src, &sport, ibuf, sizeof(ibuf)-1);
+  if (cc != sizeof(buf) || memcmp(buf, ibuf, sizeof(buf)) != 0) {
+    uprintf("arp: wrong reply from gateway\n");
+    return 0;
+  }
+
+  sleep(500);  // ARP gives up after 3 requests a second apart
+  netstat(&b);
+  if (b.arp_unresolved != a.arp_unresolved + 1) {
+    uprintf("arp: %d packets dropped unresolved, expected 1\n",
+            (int)(b.arp_unresolved - a.arp_unresolved));
+    return 0;
+  }
+
+  uprintf("arp: OK\n");
+  return 1;
+}
+
+//
+// add overlapping routes and check that lookups take the longest
+// matching prefix, and that deleting one falls back to the next.
+//
+int
+routes(void)
+{
+  static struct { uint32 dst; int len; uint32 gw; } add[] = {
+    { 0xac100000, 12, 0x0A000202 },  // 172.16.0.0/12 via 10.0.2.2
+    { 0xac100500, 24, 0 },           // 172.16.5.0/24 on link
+    { 0xac100580, 25, 0x0A000203 },  // 172.16.5.128/25 via 10.0.2.3
+  };
+  static struct { uint32 ip; int len; } want[] = {
+    { 0xac1005ff, 25 }, { 0xac100505, 24 }, { 0xac1f0001, 12 },
+    { 0x08080808, 0 },  // 8.8.8.8: the default route
+  };
+  struct rtentry rt;
+
+  uprintf("routes: starting\n");
+
+  for (int i = 0; i < sizeof(add)/sizeof(add[0]); i++) {
+    memset(&rt, 0, sizeof(rt));
+    rt.dst = add[i].dst;
+    rt.prefixlen = add[i].len;
+    rt.gateway = add[i].gw;
+    if (route(RT_ADD, &rt, 0) < 0) {
+      eprintf("routes: route() add failed\n");
+      return 0;
+    }
+  }
+
+  for (int i = 0; i < sizeof(want)/sizeof(want[0]); i++) {
+    rt.dst = want[i].ip;
+    if (route(RT_LOOKUP, &rt, 0) < 0 || rt.prefixlen != want[i].len) {
+      uprintf("routes: wrong route for address %d\n", i);
+      return 0;
+    }
+  }
+
+  for (int i = sizeof(add)/sizeof(add[0]) - 1; i >= 0; i--) {
+    rt.dst = add[i].dst;
+    rt.prefixlen = add[i].len;
+    if (route(RT_DEL, &rt, 0) < 0) {
+      eprintf("routes: route() del failed\n");
+      return 0;
+    }
+    rt.dst = 0xac1005ff;
+    if (route(RT_LOOKUP, &rt, 0) < 0 ||
+        rt.prefixlen != (i == 2 ? 24 : i == 1 ? 12 : 0)) {
+      uprintf("routes: wrong route after deleting route %d\n", i);
+      return 0;
+    }
+  }
+
+  uprintf("routes: OK\n");
+  return 1;
+}
+
+//
+// ping QEMU's host, which answers ICMP echo requests itself.
+//
+int
+icmp(void)
+{
+  uprintf("icmp: starting\n");
+
+  int replies = 0;
+  for (int seq = 0; seq < 5; seq++)
+    if (ping(0x0A000202, seq, 56, 100) >= 0)  // 10.0.2.2
+      replies++;
+  if (replies < 4) {
+    uprintf("icmp: only %d of 5 pings answered\n", replies);
+    return 0;
+  }
+
+  uprintf("icmp: OK\n");
+  return 1;
+}
+
+//
+// ping QEMU's host with a message too big for one frame: the
+// request goes out in fragments, and the reply must come back
+// reassembled.
+//
+int
+frag(void)
+{
+  struct netstat a, b;
+
+  uprintf("frag: starting\n");
+
+  netstat(&a);
+  if (ping(0x0A000202, 0, 1900, 200) < 0) {  // 10.0.2.2
+    uprintf("frag: no reply to a fragmented ping\n");
+    return 0;
+  }
+  netstat(&b);
+  if (b.tx_frags - a.tx_frags < 2 || b.rx_reassembled == a.rx_reassembled) {
+    uprintf("frag: %d fragments sent, %d datagrams reassembled\n",
+            (int)(b.tx_frags - a.tx_frags),
+            (int)(b.rx_reassembled - a.rx_reassembled));
+    return 0;
+  }
+
+  uprintf("frag: OK\n");
+  return 1;
+}
+
+//
+// ping QEMU's host with 4000 bytes of data at a 9000-byte MTU, so
+// the request leaves in one frame and anything big that comes
+// back lands in one of the e1000's gathered jumbo buffers, which
+// must find their way back to the driver.
+//
+int
+jumbo(void)
+{
+  int ok = 1;
+
+  uprintf("jumbo: starting\n");
+
+  if (netctl(NETCTL_MTU, 9000) < 0) {
+    eprintf("jumbo: netctl mtu 9000 failed\n");
+    return 0;
+  }
+  for (int seq = 0; seq < 3 && ok; seq++) {
+    if (ping(0x0A000202, seq, 4000, 200) < 0) {  // 10.0.2.2
+      uprintf("jumbo: no reply to ping %d\n", seq);
+      ok = 0;
+    }
+  }
+  netctl(NETCTL_MTU, 1500);
+
+  if (ok)
+    uprintf("jumbo: OK\n");
+  return ok;
+}
+
+//
+// the kernel's checksum routine must agree with the plain 16-bit
+// one at every length up to a few words, and at packet sizes; the
+// benchmark checks that before timing.
+//
+int
+cksum(void)
+{
+  static int sizes[] = { 1499, 1500, 4087, 4088 };
+
+  uprintf("cksum: starting\n");
+
+  for (int len = 1; len <= 130; len++) {
+    if (netctl(NETCTL_CKSUM_BENCH, len) < 0) {
+      uprintf("cksum: wrong sum of %d bytes\n", len);
+      return 0;
+    }
+  }
+  for (int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+    if (netctl(NETCTL_CKSUM_BENCH, sizes[i]) < 0) {
+      uprintf("cksum: wrong sum of %d bytes\n", sizes[i]);
+      return 0;
+    }
+  }
+
+  uprintf("cksum: OK\n");
+  return 1;
+}
+
 // Encode a DNS name
 void
 encode_qname(char *qn, char *host)
@@ -916,9 +1330,19 @@ usage(void)
   uprintf("       nettest rx\n");
   uprintf("       nettest rx2\n");
   uprintf("       nettest rxburst\n");
+  uprintf("       nettest rxbench\n");
+  uprintf("       nettest txbench\n");
   uprintf("       nettest ping1\n");
   uprintf("       nettest ping2\n");
   uprintf("       nettest ping3\n");
+  uprintf("       nettest reset\n");
+  uprintf("       nettest ports\n");
+  uprintf("       nettest arp\n");
+  uprintf("       nettest routes\n");
+  uprintf("       nettest icmp\n");
+  uprintf("       nettest frag\n");
+  uprintf("       nettest jumbo\n");
+  uprintf("       nettest cksum\n");
   uprintf("       nettest dns\n");
   uprintf("       nettest grade\n");
   exit();
@@ -989,11 +1413,21 @@ main(int argc, char *argv[])
   if      (strcmp(argv[1], "txone") == 0)  txone();
   else if (strcmp(argv[1], "rx") == 0 || strcmp(argv[1], "rxburst") == 0) rx(argv[1]);
   else if (strcmp(argv[1], "rx2") == 0)   rx2();
+  else if (strcmp(argv[1], "rxbench") == 0) rxbench();
+  else if (strcmp(argv[1], "txbench") == 0) txbench();
   else if (strcmp(argv[1], "tx") == 0)    tx();
   else if (strcmp(argv[1], "ping0") == 0) ping0();
   else if (strcmp(argv[1], "ping1") == 0) ping1();
   else if (strcmp(argv[1], "ping2") == 0) ping2();
   else if (strcmp(argv[1], "ping3") == 0) ping3();
+  else if (strcmp(argv[1], "reset") == 0) reset();
+  else if (strcmp(argv[1], "ports") == 0) ports();
+  else if (strcmp(argv[1], "arp") == 0)   arp();
+  else if (strcmp(argv[1], "routes") == 0) routes();
+  else if (strcmp(argv[1], "icmp") == 0)  icmp();
+  else if (strcmp(argv[1], "frag") == 0)  frag();
+  else if (strcmp(argv[1], "jumbo") == 0) jumbo();
+  else if (strcmp(argv[1], "cksum") == 0) cksum();
   else if (strcmp(argv[1], "grade") == 0) {
     // "python3 nettest.py grade" must already be running...
     int free0 = countfree();
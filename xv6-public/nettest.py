@@ -26,6 +26,8 @@ def usage():
     sys.stderr.write("       nettest.py rx\n")
     sys.stderr.write("       nettest.py rx2\n")
     sys.stderr.write("       nettest.py rxburst\n")
+    sys.stderr.write("       nettest.py rxbench\n")
+    sys.stderr.write("       nettest.py txbench\n")
     sys.stderr.write("       nettest.py tx\n")
     sys.stderr.write("       nettest.py ping\n")
     sys.stderr.write("       nettest.py grade\n")
@@ -115,6 +117,45 @@ elif sys.argv[1] == "rxburst":
 
         time.sleep(1)
         i += 1
+elif sys.argv[1] == "rxbench":
+    #
+    # measure receive drops as a function of burst size.
+    # each burst goes to port 2001 and is followed, after a
+    # pause that lets xv6 drain, by an "end <burst>" marker.
+    # xv6's nettest rxbench must be started first; rerun
+    # with different E1000_RXRING sizes to compare.
+    #
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    for burst in [8, 16, 32, 64, 128, 256, 512]:
+        for rnd in range(0, 5):
+            for ii in range(0, burst):
+                sock.sendto(b"b", ("127.0.0.1", FWDPORT2))
+            time.sleep(0.5)
+            txt = "end %d" % (burst)
+            sock.sendto(txt.encode("ascii", "ignore"), ("127.0.0.1", FWDPORT2))
+            time.sleep(0.2)
+        sys.stderr.write("rxbench: sent 5 bursts of %d\n" % burst)
+    sock.sendto(b"done", ("127.0.0.1", FWDPORT2))
+elif sys.argv[1] == "txbench":
+    #
+    # count the packets sent by xv6's nettest txbench. the host
+    # drops UDP packets whose checksum is wrong, so a full count
+    # also checks the checksums xv6 (or the NIC) computed.
+    #
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", SERVERPORT))
+    print("txbench: listening for UDP packets")
+    n = 0
+    t0 = None
+    while True:
+        buf, raddr = sock.recvfrom(4096)
+        if buf == b"done":
+            break
+        if t0 is None:
+            t0 = time.time()
+        n += 1
+    dt = time.time() - t0 if t0 is not None else 0
+    print("txbench: received %d packets in %.2f seconds" % (n, dt))
 elif sys.argv[1] == "tx":
     #
     # listen for UDP packets sent by xv6's nettest tx.
@@ -11,4 +11,13 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define PKTBUF_SIZE  2048  // network packet buffer (see pktbuf.c)
+#define NPKTBUF      8192  // max packet buffers
+#define PKTBUF_RESERVE 512 // packet buffers carved at boot
+#define NETOBJ_SIZE    64  // network metadata object
+#define NNETOBJ      4096  // max metadata objects
+#define NETOBJ_RESERVE 256 // metadata objects carved at boot
+#define NPORT         512 // maximum bound UDP ports
+#define NROUTE       4096 // IPv4 routes (see rtable.c)
+#define NNETDEV         4 // network interfaces
 
@@ -1,16 +1,21 @@
 // ------------------------------------------------------------
-// simple PCI initialization for x86_64 xv6
-// Scans the PCI bus to find the Intel e1000 network device
-// and initializes it via e1000_init().
-// Works when QEMU is launched with: -device e1000
+// PCI bus enumeration for x86_64 xv6
+// Walks every bus, device and function reachable from bus 0
+// (following PCI-to-PCI bridges), sizes each function's BARs,
+// and attaches the drivers listed in pci_drivers[].
+// Interrupts are delivered by MSI when the device supports it,
+// otherwise through the I/O APIC on the legacy INTx line.
 // ------------------------------------------------------------
 
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
 #include "defs.h"
 #include "x86.h"
 #include "traps.h"
+#include "pci.h"
 
 // ------------------------------------------------------------
 // PCI Configuration Space Access
@@ -22,9 +27,9 @@
 // ------------------------------------------------------------
 // Macro to construct a PCI configuration address
 // Fields:
-//   bus:  always 0 for QEMU’s simple bus
+//   bus:  bus number (0–255)
 //   dev:  device number (0–31)
-//   func: function number (0–7), usually 0
+//   func: function number (0–7)
 //   off:  register offset within config space (must be 4-byte aligned)
 // ------------------------------------------------------------
 #define PCI_ADDR(bus, dev, func, off)                             \
@@ -36,14 +41,17 @@
 // ------------------------------------------------------------
 #define PCI_VENDOR_ID 0x00  // Vendor + Device ID
 #define PCI_COMMAND 0x04  // Command register: enable I/O, memory, bus mastering
+#define PCI_STATUS 0x06   // Status register (upper half of 0x04)
+#define PCI_CLASS 0x08    // Class code, subclass, prog IF, revision
+#define PCI_HEADER 0x0C   // Header type in bits 23:16
 #define PCI_BAR0 0x10     // Base Address Register 0: MMIO base for device
+#define PCI_BRIDGE_BUS 0x18  // Bridges: primary/secondary/subordinate bus
+#define PCI_CAP_PTR 0x34  // First capability offset
 #define PCI_INT_LINE 0x3C  // Interrupt line (IRQ number)
 
-// ------------------------------------------------------------
-// Intel E1000’s known PCI vendor/device identifiers
-// ------------------------------------------------------------
-#define E1000_VENDOR 0x8086
-#define E1000_DEVICE 0x100E
+#define PCI_HDR_MULTIFN 0x80     // header type: device has functions 1-7
+#define PCI_STATUS_CAPLIST 0x10  // status: capability list present
+#define PCI_CLASS_BRIDGE_PCI 0x0604  // class/subclass of a PCI-PCI bridge
 
 // ------------------------------------------------------------
 // Bits for PCI command register
@@ -51,10 +59,40 @@
 #define PCI_CMD_IO 0x1       // Enable I/O port space access
 #define PCI_CMD_MEM 0x2      // Enable memory-mapped I/O
 #define PCI_CMD_BUSMSTR 0x4  // Enable bus mastering (DMA)
+#define PCI_CMD_INTXOFF 0x400  // Disable legacy INTx interrupts
+
+// ------------------------------------------------------------
+// Base address register bits
+// ------------------------------------------------------------
+#define PCI_BAR_IO 0x1           // I/O space BAR
+#define PCI_BAR_TYPE_MASK 0x6    // memory BAR type
+#define PCI_BAR_TYPE_64 0x4      // 64-bit memory BAR (uses two BARs)
+
+// ------------------------------------------------------------
+// Capabilities [PCI 3.0 6.7, 6.8]
+// ------------------------------------------------------------
+#define PCI_CAP_MSI 0x05
+#define PCI_CAP_MSIX 0x11
+#define PCI_MSI_CTL_EN 0x0001     // MSI enable (message control)
+#define PCI_MSI_CTL_64BIT 0x0080  // 64-bit message address capable
+#define PCI_MSI_ADDR 0xFEE00000   // [Intel SDM 10.11.1] lapic message address
+#define PCI_MSIX_CTL_EN 0x8000    // MSI-X enable (message control)
+#define PCI_MSIX_CTL_MASK 0x4000  // mask all MSI-X vectors
+#define PCI_MSIX_ENTRY 4          // uint32s per MSI-X table entry
+#define PCI_MSIX_MASKED 0x1       // vector control: entry masked
+
+// Drivers to attach, by vendor/device ID.
+static struct pci_driver pci_drivers[] = {
+    {0x8086, 0x100E, e1000_attach},   // Intel 82540EM (QEMU -device e1000)
+    {0x8086, 0x10D3, e1000e_attach},  // Intel 82574L (QEMU -device e1000e)
+    {0x1AF4, 0x1000, virtio_net_attach},  // virtio-net, legacy interface
+};
 
-// The e1000 driver init function, implemented elsewhere.
-extern void
-e1000_init(uint32* regs);
+// Every function found by the scan. Drivers may keep a pointer to
+// their entry, e.g. to reprogram the interrupt later.
+#define PCI_MAXFUNCS 64
+static struct pci_func pci_funcs[PCI_MAXFUNCS];
+static int pci_nfuncs;
 
 // ------------------------------------------------------------
 // Read a 32-bit value from PCI configuration space
@@ -80,68 +118,364 @@ pci_write(uint bus, uint dev, uint func, uint off, uint val) {
     outl(PCI_CONFIG_DATA, val);
 }
 
+uint
+pci_conf_read(struct pci_func* f, uint off) {
+    return pci_read(f->bus, f->dev, f->func, off);
+}
+
+void
+pci_conf_write(struct pci_func* f, uint off, uint val) {
+    pci_write(f->bus, f->dev, f->func, off, val);
+}
+
+// 16-bit config write; off must be 2-byte aligned.
+static void
+pci_conf_write16(struct pci_func* f, uint off, ushort val) {
+    uint v = pci_conf_read(f, off & ~3);
+    int shift = (off & 2) * 8;
+    v = (v & ~(0xFFFF << shift)) | ((uint)val << shift);
+    pci_conf_write(f, off & ~3, v);
+}
+
 // ------------------------------------------------------------
-// pci_init()
-// Scan PCI devices on bus 0 for Intel’s e1000 Ethernet controller.
-// If found, configure it for memory access + DMA, then call e1000_init().
+// pci_find_cap()
+// Walk the capability list for capability id; returns its config
+// space offset, or 0 if the function doesn't have it.
+// ------------------------------------------------------------
+uint
+pci_find_cap(struct pci_func* f, uint id) {
+    if (((pci_conf_read(f, PCI_COMMAND) >> 16) & PCI_STATUS_CAPLIST) == 0)
+        return 0;
+
+    uint off = pci_conf_read(f, PCI_CAP_PTR) & 0xFC;
+    // at most 48 capabilities fit in the 192 bytes after the header
+    for (int n = 0; off && n < 48; n++) {
+        uint cap = pci_conf_read(f, off);
+        if ((cap & 0xFF) == id) return off;
+        off = (cap >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------
+// pci_func_enable()
+// Turn on memory/I/O decoding and bus mastering, and size each BAR
+// by writing all ones and reading back the address mask.
 // ------------------------------------------------------------
 void
-pci_init(void) {
-    // Iterate through all possible device slots on bus 0 (0–31)
-    for (int dev = 0; dev < 32; dev++) {
-        // Read the vendor/device ID (first 32 bits of config space)
-        uint id = pci_read(0, dev, 0, PCI_VENDOR_ID);
-
-        // If value is 0xFFFFFFFF → empty slot (no device present)
-        if (id == 0xFFFFFFFF) continue;
-
-        // Extract vendor and device IDs
-        uint vendor = id & 0xFFFF;
-        uint device = id >> 16;
-
-        // Check if it matches Intel’s E1000 NIC
-        if (vendor == E1000_VENDOR && device == E1000_DEVICE) {
-            cprintf("pci: found e1000 device at slot %d\n", dev);
-
-            // --------------------------------------------------------
-            // Enable memory-mapped I/O (MMIO) and bus mastering (DMA)
-            // so the NIC can access main memory directly.
-            // --------------------------------------------------------
-            uint cmd = pci_read(0, dev, 0, PCI_COMMAND);
-            cmd |= (PCI_CMD_MEM | PCI_CMD_BUSMSTR);
-            pci_write(0, dev, 0, PCI_COMMAND, cmd);
-
-            // --------------------------------------------------------
-            // Read the BAR0 register: this holds the *physical address*
-            // of the NIC’s memory-mapped I/O region (MMIO).
-            // Lower 4 bits are flags → mask them out.
-            // --------------------------------------------------------
-            uint bar0 = pci_read(0, dev, 0, PCI_BAR0) & ~0xF;
-            // cprintf("pci: e1000 BAR0 phys=0x%x\n", bar0);
-
-            // Convert physical MMIO address into a kernel virtual address
-            // (xv6 maps all physical memory starting at KERNBASE)
-            addr_t vbar = (addr_t)p2v((addr_t)bar0);
-            // cprintf("pci: e1000 regs virt=%p\n", (void*)vbar);
-
-            // Cast the mapped address into a pointer to NIC registers
-            volatile uint32* regs = (volatile uint32*)vbar;
-
-            // Initialize the NIC driver (sets up TX/RX rings, etc.)
-            e1000_init((uint32*)regs);
-
-            // --------------------------------------------------------
-            // Get the IRQ line (interrupt number) assigned to this device
-            // and enable it through the I/O APIC for CPU 0.
-            // --------------------------------------------------------
-            int irq = pci_read(0, dev, 0, PCI_INT_LINE) & 0xFF;
-            ioapicenable(irq, 0);
-
-            // Stop scanning after successful detection
+pci_func_enable(struct pci_func* f) {
+    uint cmd = pci_conf_read(f, PCI_COMMAND) & 0xFFFF;
+    // decoding must be off while the BARs hold the sizing pattern
+    pci_conf_write(f, PCI_COMMAND, cmd & ~(PCI_CMD_IO | PCI_CMD_MEM));
+
+    for (int i = 0; i < PCI_NBARS; i++) {
+        uint off = PCI_BAR0 + 4 * i;
+        uint old = pci_conf_read(f, off);
+        pci_conf_write(f, off, 0xFFFFFFFF);
+        uint mask = pci_conf_read(f, off);
+        pci_conf_write(f, off, old);
+
+        f->reg_base[i] = f->reg_size[i] = 0;
+        f->reg_io[i] = 0;
+        if (mask == 0) continue;  // BAR not implemented
+
+        if (old & PCI_BAR_IO) {
+            f->reg_io[i] = 1;
+            f->reg_base[i] = old & ~0x3;
+            f->reg_size[i] = (~(mask & ~0x3) + 1) & 0xFFFF;
+            continue;
+        }
+
+        uint64 base = old & ~0xF;
+        uint64 size = ~(uint64)(mask & ~0xF) + 1;
+        if ((old & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64 && i + 1 < PCI_NBARS) {
+            // the next BAR holds the upper 32 bits
+            uint hoff = off + 4;
+            uint hold = pci_conf_read(f, hoff);
+            pci_conf_write(f, hoff, 0xFFFFFFFF);
+            uint hmask = pci_conf_read(f, hoff);
+            pci_conf_write(f, hoff, hold);
+
+            base |= (uint64)hold << 32;
+            size = ~(((uint64)hmask << 32) | (mask & ~0xF)) + 1;
+            f->reg_base[i] = base;
+            f->reg_size[i] = size;
+            i++;
+            f->reg_base[i] = f->reg_size[i] = 0;
+            f->reg_io[i] = 0;
+            continue;
+        }
+        f->reg_base[i] = base;
+        f->reg_size[i] = size & 0xFFFFFFFF;
+    }
+
+    pci_conf_write(f, PCI_COMMAND,
+                   cmd | PCI_CMD_IO | PCI_CMD_MEM | PCI_CMD_BUSMSTR);
+}
+
+// ------------------------------------------------------------
+// pci_map_bar()
+// Kernel virtual address of a memory BAR. The kernel direct-maps
+// the 4th GB of physical memory for device registers (see
+// kvmalloc()), so BARs must be placed there.
+// ------------------------------------------------------------
+void*
+pci_map_bar(struct pci_func* f, int bar) {
+    uint64 base = f->reg_base[bar];
+    uint64 end = base + f->reg_size[bar];
+
+    if (f->reg_io[bar] || base == 0) return 0;
+    if (base < 0xC0000000 || end > 0x100000000ULL) {
+        cprintf("pci: %x:%x.%d BAR%d at %p is outside the MMIO window\n",
+                f->bus, f->dev, f->func, bar, base);
+        return 0;
+    }
+    return p2v(base);
+}
+
+// ------------------------------------------------------------
+// pci_msi_enable()
+// Program the MSI capability to write vector to the local APIC of
+// the given CPU (fixed delivery, edge triggered), and mask INTx.
+// ------------------------------------------------------------
+static void
+pci_msi_enable(struct pci_func* f, int vector, int cpu) {
+    uint cap = f->msi_cap;
+    uint ctl = pci_conf_read(f, cap) >> 16;
+    uint addr = PCI_MSI_ADDR | (cpus[cpu].apicid << 12);
+
+    pci_conf_write(f, cap + 4, addr);
+    if (ctl & PCI_MSI_CTL_64BIT) {
+        pci_conf_write(f, cap + 8, 0);
+        pci_conf_write16(f, cap + 12, vector);
+    } else {
+        pci_conf_write16(f, cap + 8, vector);
+    }
+    // one message (MME = 0), enabled
+    pci_conf_write16(f, cap + 2, (ctl & ~0x70) | PCI_MSI_CTL_EN);
+
+    uint cmd = pci_conf_read(f, PCI_COMMAND) & 0xFFFF;
+    pci_conf_write(f, PCI_COMMAND, cmd | PCI_CMD_INTXOFF);
+}
+
+// ------------------------------------------------------------
+// pci_intr_enable()
+// Deliver the function's interrupts to handler on the given CPU.
+// MSI gets a vector of its own from irq_alloc(), so the device
+// bypasses the I/O APIC and never shares its vector; devices
+// without MSI fall back to their INTx line via the I/O APIC. INTx
+// lines are shared: a function on a line that already has handlers
+// is chained after them, and the line goes to the CPU asked for last.
+// Returns the vector, or -1 if none could be set up.
+// ------------------------------------------------------------
+int
+pci_intr_enable(struct pci_func* f, void (*handler)(void), int cpu) {
+    if (f->msi_cap) {
+        int vector = irq_alloc(handler);
+        if (vector >= 0) {
+            pci_msi_enable(f, vector, cpu);
+            f->vector = vector;
+            f->cpu = cpu;
+            cprintf("pci: %x:%x.%d using MSI vector %d\n", f->bus, f->dev,
+                    f->func, vector);
+            return vector;
+        }
+    }
+
+    if (f->irq_line == 0 || f->irq_line >= 0xFF) return -1;
+    if (irq_register(T_IRQ0 + f->irq_line, handler) < 0) return -1;
+    ioapicenable(f->irq_line, cpus[cpu].apicid);
+    f->vector = T_IRQ0 + f->irq_line;
+    f->cpu = cpu;
+    cprintf("pci: %x:%x.%d using IRQ %d\n", f->bus, f->dev, f->func,
+            f->irq_line);
+    return f->vector;
+}
+
+// ------------------------------------------------------------
+// pci_intr_set_cpu()
+// Steer an interrupt set up by pci_intr_enable() to another CPU,
+// keeping its vector: rewrite the MSI message address, or the I/O
+// APIC redirection entry for INTx.
+// ------------------------------------------------------------
+void
+pci_intr_set_cpu(struct pci_func* f, int cpu) {
+    if (f->vector < 0 || cpu == f->cpu) return;
+
+    if (f->vector >= T_IRQ_DYN)
+        pci_conf_write(f, f->msi_cap + 4,
+                       PCI_MSI_ADDR | (cpus[cpu].apicid << 12));
+    else
+        ioapicenable(f->irq_line, cpus[cpu].apicid);
+    f->cpu = cpu;
+}
+
+// ------------------------------------------------------------
+// pci_msix_init()
+// Map the function's MSI-X table and switch MSI-X on with every
+// entry masked; pci_msix_vector() then unmasks the ones in use.
+// Returns the number of table entries, or -1 without MSI-X.
+// ------------------------------------------------------------
+int
+pci_msix_init(struct pci_func* f) {
+    if (f->msix_cap == 0) return -1;
+
+    uint cap = f->msix_cap;
+    uint ctl = pci_conf_read(f, cap) >> 16;
+    uint tbl = pci_conf_read(f, cap + 4);
+    char* bar = pci_map_bar(f, tbl & 0x7);
+    if (bar == 0) return -1;
+
+    f->msix_table = (volatile uint32*)(bar + (tbl & ~0x7));
+    f->msix_n = (ctl & 0x7FF) + 1;
+    for (int i = 0; i < f->msix_n; i++)
+        f->msix_table[i * PCI_MSIX_ENTRY + 3] = PCI_MSIX_MASKED;
+
+    pci_conf_write16(f, cap + 2, PCI_MSIX_CTL_EN);
+    uint cmd = pci_conf_read(f, PCI_COMMAND) & 0xFFFF;
+    pci_conf_write(f, PCI_COMMAND, cmd | PCI_CMD_INTXOFF);
+    return f->msix_n;
+}
+
+// ------------------------------------------------------------
+// pci_msix_disable()
+// Undo pci_msix_init(): mask every entry, switch MSI-X off and let
+// the function raise INTx again, so that a driver that can't use
+// MSI-X after all may fall back to pci_intr_enable(). Vectors from
+// pci_msix_vector() are the driver's to irq_free().
+// ------------------------------------------------------------
+void
+pci_msix_disable(struct pci_func* f) {
+    if (f->msix_table == 0) return;
+
+    for (int i = 0; i < f->msix_n; i++)
+        f->msix_table[i * PCI_MSIX_ENTRY + 3] = PCI_MSIX_MASKED;
+    uint cap = f->msix_cap;
+    uint ctl = pci_conf_read(f, cap) >> 16;
+    pci_conf_write16(f, cap + 2, ctl & ~(PCI_MSIX_CTL_EN | PCI_MSIX_CTL_MASK));
+    uint cmd = pci_conf_read(f, PCI_COMMAND) & 0xFFFF;
+    pci_conf_write(f, PCI_COMMAND, cmd & ~PCI_CMD_INTXOFF);
+    f->msix_table = 0;
+    f->msix_n = 0;
+}
+
+// ------------------------------------------------------------
+// pci_msix_vector()
+// Give MSI-X table entry its own vector from irq_alloc(), aimed at
+// cpu's local APIC. The entry stays masked until pci_msix_unmask(),
+// so a driver can set its vectors up at attach time and turn them
+// on once the stack and that CPU are ready. Returns the vector or -1.
+// ------------------------------------------------------------
+int
+pci_msix_vector(struct pci_func* f, int entry, void (*handler)(void),
+                int cpu) {
+    if (f->msix_table == 0 || entry >= f->msix_n) return -1;
+
+    int vector = irq_alloc(handler);
+    if (vector < 0) return -1;
+
+    volatile uint32* e = &f->msix_table[entry * PCI_MSIX_ENTRY];
+    e[0] = PCI_MSI_ADDR | (cpus[cpu].apicid << 12);
+    e[1] = 0;
+    e[2] = vector;
+    return vector;
+}
+
+// Let MSI-X table entry deliver its interrupts.
+void
+pci_msix_unmask(struct pci_func* f, int entry) {
+    if (f->msix_table == 0 || entry >= f->msix_n) return;
+    f->msix_table[entry * PCI_MSIX_ENTRY + 3] = 0;
+}
+
+// Steer MSI-X table entry to another CPU, keeping its vector.
+void
+pci_msix_set_cpu(struct pci_func* f, int entry, int cpu) {
+    if (f->msix_table == 0 || entry >= f->msix_n) return;
+
+    volatile uint32* e = &f->msix_table[entry * PCI_MSIX_ENTRY];
+    uint32 mask = e[3];
+    e[3] = PCI_MSIX_MASKED;  // don't deliver half-written entries
+    e[0] = PCI_MSI_ADDR | (cpus[cpu].apicid << 12);
+    e[3] = mask;
+}
+
+// ------------------------------------------------------------
+// pci_attach()
+// Hand a function to the first driver that claims its IDs.
+// ------------------------------------------------------------
+static void
+pci_attach(struct pci_func* f) {
+    for (int i = 0; i < NELEM(pci_drivers); i++) {
+        if (pci_drivers[i].vendor == f->vendor &&
+            pci_drivers[i].device == f->device) {
+            cprintf("pci: %x:%x.%d %x:%x attaching driver\n", f->bus, f->dev,
+                    f->func, f->vendor, f->device);
+            if (pci_drivers[i].attach(f) < 0)
+                cprintf("pci: %x:%x.%d attach failed\n", f->bus, f->dev,
+                        f->func);
             return;
         }
     }
+}
+
+// ------------------------------------------------------------
+// pci_scan_bus()
+// Probe every device and function on bus; recurse through
+// PCI-to-PCI bridges into their secondary buses.
+// ------------------------------------------------------------
+static void
+pci_scan_bus(uint bus, int depth) {
+    if (depth > 8) return;  // deeper than any sane topology
+
+    for (uint dev = 0; dev < 32; dev++) {
+        // function 0 tells whether the other seven exist
+        uint hdr = pci_read(bus, dev, 0, PCI_HEADER);
+        int nfunc = ((hdr >> 16) & PCI_HDR_MULTIFN) ? 8 : 1;
 
-    // If we reach this point, no supported device was found
-    cprintf("pci: no e1000 device found\n");
+        for (uint func = 0; func < nfunc; func++) {
+            // Read the vendor/device ID (first 32 bits of config space)
+            uint id = pci_read(bus, dev, func, PCI_VENDOR_ID);
+
+            // If vendor is 0xFFFF → empty slot (no device present)
+            if ((id & 0xFFFF) == 0xFFFF) continue;
+
+            if (pci_nfuncs == PCI_MAXFUNCS) {
+                cprintf("pci: too many functions, ignoring %d:%d.%d\n", bus,
+                        dev, func);
+                return;
+            }
+            struct pci_func* f = &pci_funcs[pci_nfuncs++];
+            memset(f, 0, sizeof(*f));
+            f->vector = -1;
+            f->bus = bus;
+            f->dev = dev;
+            f->func = func;
+            f->vendor = id & 0xFFFF;
+            f->device = id >> 16;
+            f->class = pci_read(bus, dev, func, PCI_CLASS) >> 16;
+            f->irq_line = pci_read(bus, dev, func, PCI_INT_LINE) & 0xFF;
+            f->msi_cap = pci_find_cap(f, PCI_CAP_MSI);
+            f->msix_cap = pci_find_cap(f, PCI_CAP_MSIX);
+
+            if (f->class == PCI_CLASS_BRIDGE_PCI) {
+                uint secondary = (pci_read(bus, dev, func, PCI_BRIDGE_BUS) >>
+                                  8) & 0xFF;
+                if (secondary > bus) pci_scan_bus(secondary, depth + 1);
+                continue;
+            }
+
+            pci_attach(f);
+        }
+    }
+}
+
+// ------------------------------------------------------------
+// pci_init()
+// Enumerate the PCI hierarchy and attach drivers.
+// ------------------------------------------------------------
+void
+pci_init(void) {
+    pci_scan_bus(0, 0);
+    cprintf("pci: %d functions\n", pci_nfuncs);
 }
@@ -0,0 +1,66 @@
+#pragma once
+
+// ------------------------------------------------------------
+// PCI device description filled in by pci_init()'s bus scan and
+// handed to the matching driver's attach function.
+// ------------------------------------------------------------
+#define PCI_NBARS 6
+
+struct pci_func {
+    uint bus;
+    uint dev;
+    uint func;
+
+    uint vendor;     // vendor ID
+    uint device;     // device ID
+    uint class;      // class code (high byte) and subclass
+
+    // Base address registers, sized by pci_func_enable(). A 64-bit
+    // memory BAR takes two slots; its address is in the first and
+    // the second is left empty.
+    uint64 reg_base[PCI_NBARS];
+    uint64 reg_size[PCI_NBARS];
+    uchar reg_io[PCI_NBARS];  // I/O port BAR, else memory
+
+    uint irq_line;   // legacy INTx line from the BIOS
+    uint msi_cap;    // offset of the MSI capability, 0 if none
+    uint msix_cap;   // offset of the MSI-X capability, 0 if none
+    int vector;      // interrupt vector in use, set by pci_intr_enable()
+    int cpu;         // CPU the interrupt is delivered to
+
+    volatile uint32* msix_table;  // mapped MSI-X table, see pci_msix_init()
+    int msix_n;                   // entries in it
+};
+
+// Drivers that pci_init() attaches, matched by vendor and device.
+struct pci_driver {
+    uint vendor;
+    uint device;
+    int (*attach)(struct pci_func* f);
+};
+
+uint
+pci_conf_read(struct pci_func* f, uint off);
+void
+pci_conf_write(struct pci_func* f, uint off, uint val);
+void
+pci_func_enable(struct pci_func* f);
+uint
+pci_find_cap(struct pci_func* f, uint id);
+void*
+pci_map_bar(struct pci_func* f, int bar);
+int
+pci_intr_enable(struct pci_func* f, void (*handler)(void), int cpu);
+void
+pci_intr_set_cpu(struct pci_func* f, int cpu);
+int
+pci_msix_init(struct pci_func* f);
+int
+pci_msix_vector(struct pci_func* f, int entry, void (*handler)(void),
+                int cpu);
+void
+pci_msix_disable(struct pci_func* f);
+void
+pci_msix_unmask(struct pci_func* f, int entry);
+void
+pci_msix_set_cpu(struct pci_func* f, int entry, int cpu);
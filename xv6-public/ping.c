@@ -0,0 +1,99 @@
+//
+// ping: measure round trip times with ICMP echo requests.
+//
+//   ping [-c count] [-s bytes] [-i ticks] <ip>
+//
+// Sends count (10) echo requests carrying bytes (56) of data, one
+// every ticks (100) clock ticks, and prints each round trip time and
+// then the loss and the RTT percentiles, all in microseconds.
+//
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define TIMEOUT 100  // ticks to wait for each reply
+
+void
+usage(void)
+{
+  printf(2, "usage: ping [-c count] [-s bytes] [-i ticks] <ip>\n");
+  exit();
+}
+
+// Parse a dotted quad into *ip (host order); -1 if it isn't one.
+static int
+parseip(char *s, uint32 *ip)
+{
+  uint32 a = 0;
+
+  for (int i = 0; i < 4; i++) {
+    if (*s < '0' || *s > '9')
+      return -1;
+    int b = 0;
+    while (*s >= '0' && *s <= '9')
+      b = b * 10 + *s++ - '0';
+    if (b > 255 || *s != (i < 3 ? '.' : '\0'))
+      return -1;
+    s++;
+    a = (a << 8) | b;
+  }
+  *ip = a;
+  return 0;
+}
+
+// the p-th percentile of the n sorted values in v
+static int
+percentile(int *v, int n, int p)
+{
+  return v[(n - 1) * p / 100];
+}
+
+int
+main(int argc, char *argv[])
+{
+  int count = 10, size = 56, interval = 100;
+  uint32 dst;
+  int i;
+
+  for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    if (strcmp(argv[i], "-c") == 0)
+      count = atoi(argv[i+1]);
+    else if (strcmp(argv[i], "-s") == 0)
+      size = atoi(argv[i+1]);
+    else if (strcmp(argv[i], "-i") == 0)
+      interval = atoi(argv[i+1]);
+    else
+      usage();
+  }
+  if (i + 1 != argc || parseip(argv[i], &dst) < 0 || count <= 0)
+    usage();
+
+  int *rtt = malloc(count * sizeof(int));
+  int n = 0;
+  for (int seq = 0; seq < count; seq++) {
+    if (seq > 0)
+      sleep(interval);
+    int us = ping(dst, seq, size, TIMEOUT);
+    if (us < 0) {
+      printf(1, "seq %d: no reply\n", seq);
+      continue;
+    }
+    printf(1, "%d bytes from %s: seq %d time %d us\n", size, argv[i], seq, us);
+
+    // insert in order
+    int j = n++;
+    for (; j > 0 && rtt[j-1] > us; j--)
+      rtt[j] = rtt[j-1];
+    rtt[j] = us;
+  }
+
+  printf(1, "%d sent, %d received, %d%% loss\n", count, n,
+         (count - n) * 100 / count);
+  if (n > 0)
+    printf(1, "rtt us: min %d p50 %d p90 %d p99 %d max %d\n", rtt[0],
+           percentile(rtt, n, 50), percentile(rtt, n, 90),
+           percentile(rtt, n, 99), rtt[n-1]);
+  free(rtt);
+  exit();
+}
@@ -0,0 +1,181 @@
+// Fixed-size object pools for the network stack.
+//
+// Frames and packet metadata used to take a whole 4096-byte page
+// from kalloc() each. Instead, two pools carve pages into smaller
+// objects:
+//   pktbuf: PKTBUF_SIZE (2048) byte packet buffers, enough for a
+//           full Ethernet frame
+//   netobj: NETOBJ_SIZE (64) byte objects for packet and socket
+//           metadata
+// Each pool has a global free list and a small per-CPU cache, so
+// most allocations and frees touch neither the pool lock nor
+// another CPU's cache lines. Pools grow a page at a time up to a
+// limit and keep their pages; objects are not zeroed.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define POOL_CACHE 32  // objects a CPU keeps for itself
+#define POOL_BATCH 16  // objects moved to or from the free list at once
+
+struct obj {
+    struct obj* next;
+};
+
+struct pool {
+    char* name;
+    struct spinlock lock;  // protects free, nfree, pages and stats
+    int size;              // object size, divides PGSIZE
+    int maxpages;          // growth limit
+    int pages;             // pages carved up so far
+    struct obj* free;      // global free list
+    int nfree;
+    uint64 fails;          // allocations that found the pool empty
+    uint64 refills;        // batches moved to a CPU cache
+    uint64 flushes;        // batches moved back from a CPU cache
+    struct {
+        struct obj* objs[POOL_CACHE];
+        int n;
+        uint64 allocs;
+    } cpu[NCPU];
+};
+
+static struct pool pktbufs = {"pktbuf", .size = PKTBUF_SIZE,
+                              .maxpages = NPKTBUF / (PGSIZE / PKTBUF_SIZE)};
+static struct pool netobjs = {"netobj", .size = NETOBJ_SIZE,
+                              .maxpages = NNETOBJ / (PGSIZE / NETOBJ_SIZE)};
+
+// Carve one more page into objects. Caller holds p->lock.
+static int
+pool_grow(struct pool* p) {
+    if (p->pages >= p->maxpages) return -1;
+    char* pg = kalloc();
+    if (pg == 0) return -1;
+    p->pages++;
+    for (char* o = pg; o + p->size <= pg + PGSIZE; o += p->size) {
+        ((struct obj*)o)->next = p->free;
+        p->free = (struct obj*)o;
+        p->nfree++;
+    }
+    return 0;
+}
+
+static void
+pool_init(struct pool* p, int reserve) {
+    initlock(&p->lock, p->name);
+    acquire(&p->lock);
+    while (p->nfree < reserve && pool_grow(p) == 0)
+        ;
+    release(&p->lock);
+}
+
+// ------------------------------------------------------------
+// pool_alloc()
+// Take an object from this CPU's cache, refilling the cache with a
+// batch from the free list (growing the pool if need be) when it
+// is empty. Returns 0 when the pool is exhausted.
+// ------------------------------------------------------------
+static void*
+pool_alloc(struct pool* p) {
+    struct obj* o = 0;
+
+    pushcli();
+    int c = cpu - cpus;
+    if (p->cpu[c].n == 0) {
+        acquire(&p->lock);
+        while (p->cpu[c].n < POOL_BATCH) {
+            if (p->free == 0 && pool_grow(p) < 0) break;
+            p->cpu[c].objs[p->cpu[c].n++] = p->free;
+            p->free = p->free->next;
+            p->nfree--;
+        }
+        if (p->cpu[c].n == 0)
+            p->fails++;
+        else
+            p->refills++;
+        release(&p->lock);
+    }
+    if (p->cpu[c].n > 0) {
+        o = p->cpu[c].objs[--p->cpu[c].n];
+        p->cpu[c].allocs++;
+    }
+    popcli();
+    return o;
+}
+
+// Return an object to this CPU's cache, sending a batch back to the
+// free list when the cache is full.
+static void
+pool_free(struct pool* p, void* v) {
+    pushcli();
+    int c = cpu - cpus;
+    if (p->cpu[c].n == POOL_CACHE) {
+        acquire(&p->lock);
+        while (p->cpu[c].n > POOL_CACHE - POOL_BATCH) {
+            struct obj* o = p->cpu[c].objs[--p->cpu[c].n];
+            o->next = p->free;
+            p->free = o;
+            p->nfree++;
+        }
+        p->flushes++;
+        release(&p->lock);
+    }
+    p->cpu[c].objs[p->cpu[c].n++] = v;
+    popcli();
+}
+
+static void
+pool_dump(struct pool* p) {
+    uint64 allocs = 0;
+    int cached = 0;
+    for (int c = 0; c < ncpu; c++) {
+        allocs += p->cpu[c].allocs;
+        cached += p->cpu[c].n;
+    }
+    cprintf("%s: %d pages, %d free + %d cached, allocs %d fails %d "
+            "refills %d flushes %d\n",
+            p->name, p->pages, p->nfree, cached, (int)allocs, (int)p->fails,
+            (int)p->refills, (int)p->flushes);
+}
+
+// Set up both pools and carve a boot-time reserve, so that the NIC
+// rings and a normal load don't take pages later on.
+void
+pktbuf_init(void) {
+    pool_init(&pktbufs, PKTBUF_RESERVE);
+    pool_init(&netobjs, NETOBJ_RESERVE);
+}
+
+// A PKTBUF_SIZE-byte buffer for one frame, or 0.
+char*
+pktbuf_alloc(void) {
+    return pool_alloc(&pktbufs);
+}
+
+void
+pktbuf_free(char* buf) {
+    pool_free(&pktbufs, buf);
+}
+
+// A NETOBJ_SIZE-byte object for packet or socket metadata, or 0.
+void*
+netobj_alloc(void) {
+    return pool_alloc(&netobjs);
+}
+
+void
+netobj_free(void* v) {
+    pool_free(&netobjs, v);
+}
+
+// Print pool usage to the console (see net_debug()).
+void
+pktbuf_dump(void) {
+    pool_dump(&pktbufs);
+    pool_dump(&netobjs);
+}
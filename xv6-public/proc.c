@@ -17,6 +17,7 @@ static struct proc *initproc;
 int nextpid = 1;
 extern void forkret(void);
 extern void syscall_trapret(void);
+static void kthreadstart(void);
 
 static void wakeup1(void *chan);
 
@@ -114,6 +115,34 @@ userinit(void)
   p->state = RUNNABLE;
 }
 
+// Start a kernel thread that runs fn(arg) in the kernel.
+// It has no user memory and runs on a copy of the kernel page
+// table; fn must never return. Returns the pid, or -1.
+int
+kthread(char *name, void (*fn)(void*), void *arg)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  if((p->pgdir = setupkvm()) == 0){
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return -1;
+  }
+  p->sz = 0;
+  p->parent = initproc;
+  p->kfn = fn;
+  p->karg = arg;
+  p->context->rip = (addr_t)kthreadstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  __sync_synchronize();
+  p->state = RUNNABLE;
+  return p->pid;
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -372,6 +401,18 @@ forkret(void)
   // Return to "caller", actually trapret (see allocproc).
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch here. Run the thread body; it never returns.
+static void
+kthreadstart(void)
+{
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+
+  proc->kfn(proc->karg);
+  panic("kthread returned");
+}
+
 //PAGEBREAK!
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
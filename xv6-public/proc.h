@@ -7,6 +7,7 @@ struct cpu {
   int ncli;                  // Depth of pushcli nesting.
   int intena;                // Were interrupts enabled before pushcli?
   void *local;               // CPU-local storage; see seginit()
+  uint busyticks;            // timer ticks that found a process running
 };
 
 extern struct cpu cpus[NCPU];
@@ -61,6 +62,8 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void*);          // Kernel thread body (see kthread())
+  void *karg;                  // Argument passed to kfn
 };
 
 // Process memory is laid out contiguously, low addresses first:
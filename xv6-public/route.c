@@ -0,0 +1,194 @@
+//
+// route: show and change the IPv4 routing table.
+//
+//   route                          list the routes
+//   route add <net>/<len> [via <gw>] [src <ip>] [dev <n>]
+//                                  add a route, or replace the one
+//                                  for the same prefix
+//   route del <net>/<len>          delete a route
+//   route get <ip>                 show the route a send to ip takes
+//   route bench [routes] [lookups] add that many random routes (1000)
+//                                  and time that many lookups
+//                                  (1000000), then remove them again
+//
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "route.h"
+
+#define TICKS_PER_SEC 100
+
+void
+usage(void)
+{
+  printf(2, "usage: route\n");
+  printf(2, "       route add <net>/<len> [via <gw>] [src <ip>] [dev <n>]\n");
+  printf(2, "       route del <net>/<len>\n");
+  printf(2, "       route get <ip>\n");
+  printf(2, "       route bench [routes] [lookups]\n");
+  exit();
+}
+
+// Parse a dotted quad into *ip (host order); -1 if it isn't one.
+static int
+parseip(char *s, uint32 *ip)
+{
+  uint32 a = 0;
+
+  for (int i = 0; i < 4; i++) {
+    if (*s < '0' || *s > '9')
+      return -1;
+    int b = 0;
+    while (*s >= '0' && *s <= '9')
+      b = b * 10 + *s++ - '0';
+    if (b > 255 || *s != (i < 3 ? '.' : '\0'))
+      return -1;
+    s++;
+    a = (a << 8) | b;
+  }
+  *ip = a;
+  return 0;
+}
+
+// Parse <net>/<len> into rt.
+static int
+parsenet(char *s, struct rtentry *rt)
+{
+  char *slash = strchr(s, '/');
+
+  if (slash == 0)
+    return -1;
+  *slash = '\0';
+  rt->prefixlen = atoi(slash + 1);
+  if (parseip(s, &rt->dst) < 0 || rt->prefixlen < 0 || rt->prefixlen > 32)
+    return -1;
+  return 0;
+}
+
+static void
+printip(uint32 ip)
+{
+  printf(1, "%d.%d.%d.%d", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff,
+         ip & 0xff);
+}
+
+static void
+printroute(struct rtentry *rt)
+{
+  printip(rt->dst);
+  printf(1, "/%d ", rt->prefixlen);
+  if (rt->gateway) {
+    printf(1, "via ");
+    printip(rt->gateway);
+  } else {
+    printf(1, "on link");
+  }
+  printf(1, " src ");
+  printip(rt->src);
+  printf(1, " dev %d\n", rt->ifindex);
+}
+
+// lookups per second, or -1 if it ran too fast to tell
+static int
+persec(int n, int t)
+{
+  if (t <= 0)
+    return -1;
+  return (int)(((uint64)n * TICKS_PER_SEC) / t);
+}
+
+static void
+bench(int nroutes, int nlookups)
+{
+  struct rtentry rt;
+  uint32 seed = uptime();
+  uint32 *added = malloc(nroutes * 2 * sizeof(uint32));
+  int n = 0;
+
+  // random /16 to /28 routes inside 172.16.0.0/12
+  for (int i = 0; i < nroutes; i++) {
+    seed = seed * 1103515245 + 12345;
+    rt.prefixlen = 16 + (seed >> 16) % 13;
+    seed = seed * 1103515245 + 12345;
+    rt.dst = (0xac100000 | (seed & 0x000fffff)) &
+             (~0U << (32 - rt.prefixlen));
+    rt.gateway = 0x0A000202;  // 10.0.2.2
+    rt.src = 0;
+    rt.ifindex = 0;
+    if (route(RT_ADD, &rt, 0) < 0) {
+      printf(2, "route: bench: table full after %d routes\n", n);
+      break;
+    }
+    added[2*n] = rt.dst;
+    added[2*n+1] = rt.prefixlen;
+    n++;
+  }
+
+  rt.dst = 0xac100000;  // 172.16.0.0/12
+  rt.prefixlen = 12;
+  int t = route(RT_BENCH, &rt, nlookups);
+  printf(1, "%d routes, %d lookups: table %d ticks, %d lookups/s\n",
+         n, nlookups, t, persec(nlookups, t));
+
+  rt.prefixlen = 24;    // few enough addresses to stay in the cache
+  t = route(RT_BENCH_CACHED, &rt, nlookups);
+  printf(1, "%d routes, %d lookups: cache %d ticks, %d lookups/s\n",
+         n, nlookups, t, persec(nlookups, t));
+
+  for (int i = 0; i < n; i++) {
+    rt.dst = added[2*i];
+    rt.prefixlen = added[2*i+1];
+    route(RT_DEL, &rt, 0);  // fails for prefixes added twice
+  }
+  free(added);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct rtentry rt;
+
+  memset(&rt, 0, sizeof(rt));
+  if (argc == 1) {
+    for (int i = 0; route(RT_GET, &rt, i) == 0; i++)
+      printroute(&rt);
+  } else if (strcmp(argv[1], "add") == 0) {
+    if (argc < 3 || parsenet(argv[2], &rt) < 0)
+      usage();
+    for (int i = 3; i < argc; i += 2) {
+      if (i + 1 == argc)
+        usage();
+      if (strcmp(argv[i], "via") == 0) {
+        if (parseip(argv[i+1], &rt.gateway) < 0)
+          usage();
+      } else if (strcmp(argv[i], "src") == 0) {
+        if (parseip(argv[i+1], &rt.src) < 0)
+          usage();
+      } else if (strcmp(argv[i], "dev") == 0) {
+        rt.ifindex = atoi(argv[i+1]);
+      } else {
+        usage();
+      }
+    }
+    if (route(RT_ADD, &rt, 0) < 0)
+      printf(2, "route: add failed\n");
+  } else if (strcmp(argv[1], "del") == 0) {
+    if (argc != 3 || parsenet(argv[2], &rt) < 0)
+      usage();
+    if (route(RT_DEL, &rt, 0) < 0)
+      printf(2, "route: no route for %s/%d\n", argv[2], rt.prefixlen);
+  } else if (strcmp(argv[1], "get") == 0) {
+    if (argc != 3 || parseip(argv[2], &rt.dst) < 0)
+      usage();
+    if (route(RT_LOOKUP, &rt, 0) < 0)
+      printf(2, "route: no route to %s\n", argv[2]);
+    else
+      printroute(&rt);
+  } else if (strcmp(argv[1], "bench") == 0) {
+    bench(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atoi(argv[3]) : 1000000);
+  } else {
+    usage();
+  }
+  exit();
+}
@@ -0,0 +1,24 @@
+#pragma once
+// The IPv4 routing table, as seen through the route(op, rt, n)
+// system call. Shared by the kernel and user programs. Addresses
+// are in host byte order. route() returns -1 on a bad request.
+
+struct rtentry {
+    uint32 dst;       // destination network
+    int prefixlen;    // leading bits of dst that must match, 0-32
+    uint32 gateway;   // router to send through, 0 if on our link
+    uint32 src;       // source address; 0 in RT_ADD: the host's own
+    int ifindex;      // interface, in NIC registration order from 0
+};
+
+#define RT_ADD 1     // add route rt, replacing one for the same prefix
+#define RT_DEL 2     // delete the route for rt->dst/rt->prefixlen
+#define RT_GET 3     // copy the nth route into rt; -1 past the last
+#define RT_LOOKUP 4  // replace rt with the route a send to rt->dst takes
+
+// Benchmark: n longest-prefix-match lookups of addresses spread over
+// rt->dst/rt->prefixlen, straight from the table (RT_BENCH) or
+// through the send path's route cache (RT_BENCH_CACHED). Returns the
+// clock ticks taken.
+#define RT_BENCH 5
+#define RT_BENCH_CACHED 6
@@ -0,0 +1,225 @@
+// The IPv4 routing table.
+//
+// Routes live in routes[] and are found by longest-prefix match:
+// one hash table holds every route, keyed by its prefix and prefix
+// length, and a lookup probes it for each prefix length in use,
+// longest first, so it costs at most one probe per distinct length
+// however many routes there are. The table is changed and searched
+// under rtlock.
+//
+// Sends don't search the table each time. rt_lookup() first tries a
+// direct-mapped cache of recent destinations, which it reads without
+// the lock (see seq_read_begin() in spinlock.h). Any change to the
+// table bumps rt_gen, which makes every cached answer stale.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "netstat.h"
+#include "route.h"
+
+#define RT_HASH_SIZE 1024   // power of two
+#define RT_CACHE_SIZE 256   // power of two
+
+#define RT_MASK(len) ((len) ? ~0U << (32 - (len)) : 0)
+#define RT_HASH(dst, len) \
+    ((((dst) ^ ((len) << 24)) * 2654435761U) >> 22)  // top 10 bits
+
+struct route {
+    struct rtentry rt;
+    struct route* next;  // hash chain, or free list
+};
+
+static struct spinlock rtlock;
+static struct route routes[NROUTE];
+static struct route* rt_free;
+static struct route* rt_hash[RT_HASH_SIZE];
+static int rt_nlen[33];  // routes with each prefix length
+static uint rt_gen = 1;  // bumped by every change; 0 is never current
+
+static struct {
+    uint seq;            // see seq_read_begin()
+    uint gen;            // rt_gen when filled in
+    uint32 dst;          // destination looked up
+    int found;           // 0: there was no route
+    struct rtentry rt;
+} rt_cache[RT_CACHE_SIZE];
+
+static uint64 rt_cache_hits;
+static uint64 rt_cache_misses;
+static int rt_bench_found;  // keeps rt_bench()'s lookups from being elided
+
+void
+rt_init(void) {
+    initlock(&rtlock, "route");
+    for (int i = NROUTE - 1; i >= 0; i--) {
+        routes[i].next = rt_free;
+        rt_free = &routes[i];
+    }
+}
+
+// Where the route for dst/len is linked in, or would be. Caller
+// holds rtlock.
+static struct route**
+rt_find(uint32 dst, int len) {
+    struct route** rp = &rt_hash[RT_HASH(dst, len)];
+    for (; *rp; rp = &(*rp)->next)
+        if ((*rp)->rt.dst == dst && (*rp)->rt.prefixlen == len) break;
+    return rp;
+}
+
+// ------------------------------------------------------------
+// rt_match()
+// The longest-prefix match for dst, or 0. Caller holds rtlock.
+// ------------------------------------------------------------
+static struct route*
+rt_match(uint32 dst) {
+    for (int len = 32; len >= 0; len--) {
+        if (rt_nlen[len] == 0) continue;
+        struct route* r = *rt_find(dst & RT_MASK(len), len);
+        if (r) return r;
+    }
+    return 0;
+}
+
+// Add route rt, or replace the one for the same prefix. Returns -1
+// if the table is full.
+int
+rt_add(struct rtentry* rt) {
+    if (rt->prefixlen < 0 || rt->prefixlen > 32) return -1;
+    rt->dst &= RT_MASK(rt->prefixlen);
+
+    acquire(&rtlock);
+    struct route** rp = rt_find(rt->dst, rt->prefixlen);
+    struct route* r = *rp;
+    if (r == 0) {
+        if ((r = rt_free) == 0) {
+            release(&rtlock);
+            return -1;
+        }
+        rt_free = r->next;
+        r->next = 0;
+        *rp = r;
+        rt_nlen[rt->prefixlen]++;
+    }
+    r->rt = *rt;
+    rt_gen++;
+    release(&rtlock);
+    return 0;
+}
+
+// Delete the route for dst/len; -1 if there is none.
+int
+rt_del(uint32 dst, int len) {
+    if (len < 0 || len > 32) return -1;
+
+    acquire(&rtlock);
+    struct route** rp = rt_find(dst & RT_MASK(len), len);
+    struct route* r = *rp;
+    if (r == 0) {
+        release(&rtlock);
+        return -1;
+    }
+    *rp = r->next;
+    r->next = rt_free;
+    rt_free = r;
+    rt_nlen[len]--;
+    rt_gen++;
+    release(&rtlock);
+    return 0;
+}
+
+// Copy the nth route into rt; -1 if there are fewer routes.
+int
+rt_get(int n, struct rtentry* rt) {
+    acquire(&rtlock);
+    for (int b = 0; b < RT_HASH_SIZE; b++) {
+        for (struct route* r = rt_hash[b]; r; r = r->next) {
+            if (n-- == 0) {
+                *rt = r->rt;
+                release(&rtlock);
+                return 0;
+            }
+        }
+    }
+    release(&rtlock);
+    return -1;
+}
+
+// ------------------------------------------------------------
+// rt_lookup()
+// Copy the route a packet for dst takes into rt. Returns -1 if
+// there is none. Answers come from the route cache when they can;
+// a miss searches the table and fills the cache slot in.
+// ------------------------------------------------------------
+int
+rt_lookup(uint32 dst, struct rtentry* rt) {
+    int c = (dst * 2654435761U) >> 24;  // top 8 bits
+    uint gen = __atomic_load_n(&rt_gen, __ATOMIC_ACQUIRE);
+    uint seq;
+    int hit, found;
+
+    do {
+        seq = seq_read_begin(&rt_cache[c].seq);
+        hit = rt_cache[c].gen == gen && rt_cache[c].dst == dst;
+        found = rt_cache[c].found;
+        if (hit && found) *rt = rt_cache[c].rt;
+    } while (seq_read_retry(&rt_cache[c].seq, seq));
+
+    if (hit) {
+        __sync_fetch_and_add(&rt_cache_hits, 1);
+        return found ? 0 : -1;
+    }
+    __sync_fetch_and_add(&rt_cache_misses, 1);
+
+    acquire(&rtlock);
+    struct route* r = rt_match(dst);
+    if (r) *rt = r->rt;
+    seq_write_begin(&rt_cache[c].seq);
+    rt_cache[c].gen = rt_gen;
+    rt_cache[c].dst = dst;
+    rt_cache[c].found = r != 0;
+    if (r) rt_cache[c].rt = r->rt;
+    seq_write_end(&rt_cache[c].seq);
+    release(&rtlock);
+    return r ? 0 : -1;
+}
+
+// ------------------------------------------------------------
+// rt_bench()
+// Do n lookups of addresses spread over dst/len, through the route
+// cache if cached is set and straight from the table if not, and
+// return the ticks they took. The table is locked a batch of
+// lookups at a time so that clock interrupts still get in.
+// ------------------------------------------------------------
+int
+rt_bench(uint32 dst, int len, int n, int cached) {
+    if (len < 0 || len > 32 || n < 0) return -1;
+    uint32 host = ~RT_MASK(len);
+    dst &= RT_MASK(len);
+    struct rtentry rt;
+    uint t0 = ticks;
+    int found = 0;
+
+    for (int i = 0; i < n; ) {
+        int batch = n - i < 1024 ? n - i : 1024;
+        if (cached) {
+            for (int j = 0; j < batch; j++, i++)
+                found += rt_lookup(dst + ((i * 2654435761U) & host), &rt) == 0;
+        } else {
+            acquire(&rtlock);
+            for (int j = 0; j < batch; j++, i++)
+                found += rt_match(dst + ((i * 2654435761U) & host)) != 0;
+            release(&rtlock);
+        }
+    }
+    rt_bench_found = found;
+    return ticks - t0;
+}
+
+void
+rt_getstats(struct netstat* st) {
+    st->rt_cache_hits = rt_cache_hits;
+    st->rt_cache_misses = rt_cache_misses;
+}
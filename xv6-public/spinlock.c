@@ -15,6 +15,8 @@ initlock(struct spinlock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->nacquire = 0;
+  lk->ncontended = 0;
 }
 
 // Acquire the lock.
@@ -29,14 +31,19 @@ acquire(struct spinlock *lk)
     panic("acquire");
 
   // The xchg is atomic.
+  int spun = 0;
   while(xchg(&lk->locked, 1) != 0)
-    ;
+    spun = 1;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
   // references happen after the lock is acquired.
   __sync_synchronize();
 
+  lk->nacquire++;
+  if(spun)
+    lk->ncontended++;
+
   // Record info about lock acquisition for debugging.
   lk->cpu = cpu;
   getcallerpcs(&lk, lk->pcs);
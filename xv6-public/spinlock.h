@@ -7,4 +7,44 @@ struct spinlock {
   struct cpu *cpu;   // The cpu holding the lock.
   addr_t pcs[10];    // The call stack (an array of program counters)
                      // that locked the lock.
+
+  // Statistics, updated while holding the lock:
+  uint64 nacquire;   // times acquired
+  uint64 ncontended; // times it was held and acquire() had to spin
 };
+
+// Sequence counts, for small records that are read often and
+// changed rarely. Writers hold a lock and bracket each change with
+// seq_write_begin() and seq_write_end(), which leave the count odd
+// in between. Readers take no lock: they copy the record between
+// s = seq_read_begin() and seq_read_retry(s), and copy it again if
+// a writer got in the way.
+static inline void
+seq_write_begin(uint *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+seq_write_end(uint *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint
+seq_read_begin(uint *seq)
+{
+  uint s;
+
+  while((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+    ;
+  return s;
+}
+
+static inline int
+seq_read_retry(uint *seq, uint s)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+}
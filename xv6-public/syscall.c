@@ -129,6 +129,13 @@ extern uint64 sys_bind(void);
 extern uint64 sys_unbind(void);
 extern uint64 sys_send(void);
 extern uint64 sys_recv(void);
+extern uint64 sys_netctl(void);
+extern uint64 sys_join(void);
+extern uint64 sys_leave(void);
+extern uint64 sys_netstat(void);
+extern uint64 sys_connect(void);
+extern uint64 sys_route(void);
+extern uint64 sys_ping(void);
 
 
 // PAGEBREAK!
@@ -160,6 +167,13 @@ static addr_t (*syscalls[])(void) = {
 [SYS_unbind]  sys_unbind,
 [SYS_send]    sys_send,
 [SYS_recv]    sys_recv,
+[SYS_netctl]  sys_netctl,
+[SYS_join]    sys_join,
+[SYS_leave]   sys_leave,
+[SYS_netstat] sys_netstat,
+[SYS_connect] sys_connect,
+[SYS_route]   sys_route,
+[SYS_ping]    sys_ping,
 
 };
 
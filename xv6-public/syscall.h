@@ -26,4 +26,11 @@
 #define SYS_bind   22
 #define SYS_unbind 23
 #define SYS_send   24
-#define SYS_recv   25
\ No newline at end of file
+#define SYS_recv   25
+#define SYS_netctl 26
+#define SYS_join   27
+#define SYS_leave  28
+#define SYS_netstat 29
+#define SYS_connect 30
+#define SYS_route 31
+#define SYS_ping 32
@@ -14,6 +14,16 @@ extern addr_t vectors[];  // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
 
+// Device interrupt handlers by vector, for devices whose vector is
+// chosen at run time (see pci_intr_enable()). MSI vectors are handed
+// out from T_IRQ_DYN up, above the I/O APIC's T_IRQ0..T_IRQ0+23 and
+// the lapic's error and spurious vectors, and have one handler each.
+// PCI INTx lines are shared, so an INTx vector can have up to
+// IRQ_NSHARED handlers, all called on each interrupt.
+#define IRQ_NSHARED 4
+static void (*irq_handlers[256][IRQ_NSHARED])(void);
+static struct spinlock irqlock;
+
 static void
 mkgate(uint* idt, uint n, addr_t kva, uint pl) {
     uint64 addr = (uint64)kva;
@@ -37,6 +47,57 @@ tvinit(void) {
     memset(idt, 0, PGSIZE);
 
     for (n = 0; n < 256; n++) mkgate(idt, n, vectors[n], 0);
+    initlock(&irqlock, "irq");
+}
+
+// Call handler for interrupts on INTx vector, after any handlers
+// the line already has. Returns -1 for a vector outside
+// T_IRQ0..T_IRQ_DYN-1 (MSI vectors come from irq_alloc() and aren't
+// shared) or one with IRQ_NSHARED handlers already.
+int
+irq_register(int vector, void (*handler)(void)) {
+    int r = -1;
+
+    acquire(&irqlock);
+    if (vector >= T_IRQ0 && vector < T_IRQ_DYN) {
+        for (int i = 0; i < IRQ_NSHARED; i++) {
+            if (irq_handlers[vector][i] == 0) {
+                irq_handlers[vector][i] = handler;
+                r = 0;
+                break;
+            }
+        }
+    }
+    release(&irqlock);
+    return r;
+}
+
+// Allocate an unused vector for an MSI and install handler on it.
+// Returns the vector, or -1 if they are all taken.
+int
+irq_alloc(void (*handler)(void)) {
+    int vector = -1;
+
+    acquire(&irqlock);
+    for (int v = T_IRQ_DYN; v < T_IRQ_MAX; v++) {
+        if (irq_handlers[v][0] == 0) {
+            irq_handlers[v][0] = handler;
+            vector = v;
+            break;
+        }
+    }
+    release(&irqlock);
+    return vector;
+}
+
+// Give back a vector from irq_alloc(). The device must no longer
+// be able to send it.
+void
+irq_free(int vector) {
+    if (vector < T_IRQ_DYN || vector >= T_IRQ_MAX) return;
+    acquire(&irqlock);
+    irq_handlers[vector][0] = 0;
+    release(&irqlock);
 }
 
 // PAGEBREAK: 41
@@ -44,11 +105,14 @@ void
 trap(struct trapframe* tf) {
     switch (tf->trapno) {
         case T_IRQ0 + IRQ_TIMER:
+            // load sample for interrupt steering (see e1000_irq_balance())
+            if (proc) cpu->busyticks++;
             if (cpunum() == 0) {
                 acquire(&tickslock);
                 ticks++;
                 wakeup(&ticks);
                 release(&tickslock);
+                net_timer();
             }
             lapiceoi();
             break;
@@ -68,13 +132,6 @@ trap(struct trapframe* tf) {
             lapiceoi();
             break;
 
-            // *** new case for e1000 ***
-        case T_IRQ0 + IRQ_E1000:
-            e1000_intr();  // handle NIC interrupt (calls e1000_recv)
-            lapiceoi();
-            break;
-            // **************************
-
         case T_IRQ0 + 7:
         case T_IRQ0 + IRQ_SPURIOUS:
             cprintf("cpu%d: spurious interrupt at %p:%p\n", cpunum(), tf->cs,
@@ -84,6 +141,15 @@ trap(struct trapframe* tf) {
 
         // PAGEBREAK: 13
         default:
+            if (tf->trapno < 256 && irq_handlers[tf->trapno][0]) {
+                // device interrupt with registered handlers (NICs);
+                // each checks whether its device raised a shared line
+                for (int i = 0; i < IRQ_NSHARED && irq_handlers[tf->trapno][i];
+                     i++)
+                    irq_handlers[tf->trapno][i]();
+                lapiceoi();
+                break;
+            }
             if (proc == 0 || (tf->cs & 3) == 0) {
                 // In kernel, it must be our mistake.
                 cprintf("unexpected trap %d from cpu %d rip %p (cr2=0x%p)\n",
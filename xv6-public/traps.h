@@ -31,4 +31,7 @@
 #define IRQ_ERROR       19
 #define IRQ_SPURIOUS    31
 
-#define IRQ_E1000       11      // networking
+// Vectors T_IRQ_DYN..T_IRQ_MAX-1 are allocated at run time by
+// irq_alloc() for MSI-capable devices.
+#define T_IRQ_DYN       (T_IRQ0 + 32)
+#define T_IRQ_MAX       0xF0
@@ -2,6 +2,8 @@
 #include "types.h"
 struct stat;
 struct rtcdate;
+struct netstat;
+struct rtentry;
 
 // system calls
 int fork(void);
@@ -32,6 +34,13 @@ int bind(ushort);
 int unbind(ushort);
 int send(ushort, uint32, ushort, char *, uint32);
 int recv(ushort, uint32*, ushort*, char *, uint32);
+int netctl(int, int);
+int join(uint32);
+int leave(uint32);
+int netstat(struct netstat*);
+int connect(ushort, uint32, ushort);
+int route(int, struct rtentry*, int);
+int ping(uint32, int, int, int);
 
 
 // ulib.c
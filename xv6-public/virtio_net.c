@@ -0,0 +1,514 @@
+//
+// virtio-net driver, legacy PCI interface.
+// Works with QEMU's -device virtio-net-pci (vendor 0x1AF4, device
+// 0x1000, a transitional device that still has the legacy I/O
+// port registers).
+//
+// Unlike the e1000, whose every register access traps into QEMU,
+// virtio-net shares its rings with QEMU through memory: sending a
+// frame takes one I/O port write (the queue notify), and receiving
+// one none beyond reading the interrupt status.
+//
+// Each queue is a split virtqueue: a descriptor table, an "avail"
+// ring where we post descriptor chains and a "used" ring where the
+// device returns them. With VIRTIO_NET_F_MRG_RXBUF a received frame
+// may span several RX buffers; the header of the first one says
+// how many.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "x86.h"
+#include "e1000_dev.h"
+#include "virtio_net_dev.h"
+#include "mbuf.h"
+#include "net.h"
+#include "netctl.h"
+#include "netdev.h"
+#include "netstat.h"
+#include "pci.h"
+
+// Largest ring we have room for; QEMU's default is 256. The ring
+// memory for that size (descriptors and avail ring, then the used
+// ring on the next 4096-byte boundary) fits in three pages, which
+// live in the kernel image so that they are contiguous.
+#define VQ_MAX 256
+#define VQ_BYTES (3 * PGSIZE)
+static char vq_mem[2][VQ_BYTES] __attribute__((aligned(PGSIZE)));
+
+#define VNET_MAXFRAME (ETH_MTU + sizeof(struct eth))
+
+struct virtq {
+    struct spinlock lock;  // protects everything below
+    int id;                // queue number, VIRTIO_NET_RXQ or _TXQ
+    int num;               // descriptors in the ring
+    struct vring_desc* desc;
+    struct vring_avail* avail;
+    struct vring_used* used;
+    ushort last_used;      // next used ring entry to look at
+    ushort free_head;      // TX: first free descriptor
+    int nfree;             // TX: free descriptors
+    void* bufs[VQ_MAX];    // RX: pktbuf of each data descriptor,
+                           // TX: mbuf to free once sent
+};
+
+static struct virtq rxq, txq;
+static ushort iobase;      // BAR0 I/O ports
+static int hdrlen;         // bytes of virtio_net_hdr in use
+static struct pci_func* vnet_pcif;
+
+// Every RX buffer is a chain of two descriptors: the header goes
+// into a slot here, the frame into a pktbuf of its own, so frames can
+// be handed to the stack without moving them. On TX the device
+// reads one shared all-zero header (no offloads).
+static char rx_hdr[VQ_MAX][VIRTIO_NET_HDR_MRG_LEN];
+static struct virtio_net_hdr tx_hdr;
+static struct netdev virtio_net_netdev;
+
+static struct {
+    uint64 interrupts;
+    uint64 intr_cpu[NCPU];
+    uint64 rx_packets;
+    uint64 rx_bytes;
+    uint64 rx_merged;     // frames that spanned several buffers
+    uint64 rx_nomem;      // dropped: no pktbuf to replace the buffer
+    uint64 rx_too_long;   // dropped: merged frame larger than a pktbuf
+    uint64 tx_packets;
+    uint64 tx_bytes;
+    uint64 tx_ring_full;
+    uint64 tx_kicks;      // queue notify writes
+} vnet_stats;
+
+// ------------------------------------------------------------
+// vq_init()
+// Allocate queue id's rings in mem and tell the device where they
+// are. Returns -1 if the device's ring size doesn't fit.
+// ------------------------------------------------------------
+static int
+vq_init(struct virtq* q, int id, char* mem, char* name) {
+    outw(iobase + VIRTIO_PCI_QUEUE_SEL, id);
+    int num = inw(iobase + VIRTIO_PCI_QUEUE_NUM);
+    if (num == 0 || num > VQ_MAX) return -1;
+
+    initlock(&q->lock, name);
+    q->id = id;
+    q->num = num;
+    memset(mem, 0, VQ_BYTES);
+    q->desc = (struct vring_desc*)mem;
+    q->avail = (struct vring_avail*)(mem + num * sizeof(struct vring_desc));
+    q->used = (struct vring_used*)(mem +
+        PGROUNDUP(num * sizeof(struct vring_desc) + 6 + 2 * num));
+    q->last_used = 0;
+
+    for (int i = 0; i < num; i++) q->desc[i].next = i + 1;
+    q->free_head = 0;
+    q->nfree = num;
+
+    outl(iobase + VIRTIO_PCI_QUEUE_PFN, V2P(mem) >> 12);
+    return 0;
+}
+
+// Post the chain starting at descriptor head. Caller holds q->lock.
+static void
+vq_push(struct virtq* q, int head) {
+    q->avail->ring[q->avail->idx % q->num] = head;
+    __sync_synchronize();  // entry before index
+    q->avail->idx++;
+}
+
+// Tell the device about new chains, unless it asked not to be told.
+// Caller holds q->lock.
+static void
+vq_kick(struct virtq* q) {
+    __sync_synchronize();
+    if ((q->used->flags & VRING_USED_F_NO_NOTIFY) == 0) {
+        outw(iobase + VIRTIO_PCI_QUEUE_NOTIFY, q->id);
+        if (q == &txq) vnet_stats.tx_kicks++;
+    }
+}
+
+// Next used ring entry, or 0 if the device hasn't returned any.
+// Caller holds q->lock.
+static struct vring_used_elem*
+vq_used(struct virtq* q) {
+    if (q->last_used == q->used->idx) return 0;
+    __sync_synchronize();  // read the entry after its index
+    return &q->used->ring[q->last_used++ % q->num];
+}
+
+// ------------------------------------------------------------
+// rx_fill()
+// Post every RX buffer: descriptor 2b holds buffer b's header
+// slot, 2b+1 its pktbuf.
+// ------------------------------------------------------------
+static void
+rx_fill(void) {
+    for (int h = 0; h + 1 < rxq.num; h += 2) {
+        int d = h + 1;
+        char* buf = pktbuf_alloc();
+        if (buf == 0) panic("virtio_net rx pktbuf");
+        rxq.bufs[d] = buf;
+        rxq.desc[h].addr = V2P(rx_hdr[h]);
+        rxq.desc[h].len = hdrlen;
+        rxq.desc[h].flags = VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
+        rxq.desc[h].next = d;
+        rxq.desc[d].addr = V2P(buf);
+        rxq.desc[d].len = PKTBUF_SIZE;
+        rxq.desc[d].flags = VRING_DESC_F_WRITE;
+        vq_push(&rxq, h);
+    }
+}
+
+// Append n bytes from src to the merged frame out (*off bytes so
+// far); out becomes 0 if the frame outgrows the pktbuf.
+static void
+rx_append(char** out, int* off, char* src, int n) {
+    if (*out == 0 || n <= 0) return;
+    if (*off + n > PKTBUF_SIZE) {
+        pktbuf_free(*out);
+        *out = 0;
+        vnet_stats.rx_too_long++;
+        return;
+    }
+    memmove(*out + *off, src, n);
+    *off += n;
+}
+
+// ------------------------------------------------------------
+// rx_merge()
+// Copy a frame spanning nbufs buffers into one pktbuf. The first
+// buffer (head, len data bytes) has the virtio header in its slot;
+// in the others the frame starts in the header slot. All buffers
+// are posted again. Returns the pktbuf (length in *plen) or 0.
+// Caller holds rxq.lock.
+// ------------------------------------------------------------
+static char*
+rx_merge(int head, int len, int nbufs, int* plen) {
+    char* out = pktbuf_alloc();
+    int off = 0;
+
+    if (out == 0) vnet_stats.rx_nomem++;
+    rx_append(&out, &off, rxq.bufs[rxq.desc[head].next], len);
+    vq_push(&rxq, head);
+
+    for (int k = 1; k < nbufs; k++) {
+        struct vring_used_elem* e = vq_used(&rxq);
+        if (e == 0) break;  // the device publishes all of them at once
+        int h = e->id;
+        int n = e->len;
+        int inslot = n < hdrlen ? n : hdrlen;
+        rx_append(&out, &off, rx_hdr[h], inslot);
+        rx_append(&out, &off, rxq.bufs[rxq.desc[h].next], n - inslot);
+        vq_push(&rxq, h);
+    }
+
+    vnet_stats.rx_merged++;
+    *plen = off;
+    return out;
+}
+
+// ------------------------------------------------------------
+// vnet_recv()
+// Hand up to budget received frames to net_rx() (budget <= 0: all
+// of them) and return how many. A single-buffer frame goes up in
+// its own pktbuf, which is replaced by a fresh one. rxq.lock is held
+// throughout so that frames reach the stack in order; transmit
+// uses txq, so net_rx() may send.
+// ------------------------------------------------------------
+static int
+vnet_recv(int budget) {
+    struct vring_used_elem* e;
+    int done = 0;
+
+    acquire(&rxq.lock);
+    while ((budget <= 0 || done < budget) && (e = vq_used(&rxq)) != 0) {
+        int head = e->id;
+        int len = (int)e->len - hdrlen;
+        struct virtio_net_hdr* h = (struct virtio_net_hdr*)rx_hdr[head];
+        int nbufs = hdrlen == VIRTIO_NET_HDR_MRG_LEN ? h->num_buffers : 1;
+        struct mbuf* pkt = 0;
+
+        if (nbufs > 1) {
+            char* buf = rx_merge(head, len, nbufs, &len);
+            if (buf && (pkt = mbuf_wrap(buf, PKTBUF_SIZE, len)) == 0) {
+                pktbuf_free(buf);
+                vnet_stats.rx_nomem++;
+            }
+        } else {
+            int d = rxq.desc[head].next;
+            char* fresh = len > 0 ? pktbuf_alloc() : 0;
+            if (fresh &&
+                (pkt = mbuf_wrap(rxq.bufs[d], PKTBUF_SIZE, len)) != 0) {
+                rxq.bufs[d] = fresh;
+                rxq.desc[d].addr = V2P(fresh);
+            } else if (len > 0) {
+                if (fresh) pktbuf_free(fresh);
+                vnet_stats.rx_nomem++;  // drop, keep the old buffer
+            }
+            vq_push(&rxq, head);
+        }
+
+        if (pkt) {
+            pkt->dev = &virtio_net_netdev;
+            vnet_stats.rx_packets++;
+            vnet_stats.rx_bytes += len;
+            net_rx(pkt);
+        }
+        done++;
+    }
+    if (done) vq_kick(&rxq);
+    release(&rxq.lock);
+    return done;
+}
+
+// netdev rx_poll(): a receive pass outside of the interrupt path.
+static int
+virtio_net_rx_poll(int budget) {
+    return vnet_recv(budget);
+}
+
+// Reading ISR acknowledges the interrupt and lowers the line.
+static void
+virtio_net_intr(void) {
+    uchar isr = inb(iobase + VIRTIO_PCI_ISR);
+
+    vnet_stats.interrupts++;
+    vnet_stats.intr_cpu[cpu - cpus]++;
+    if (isr & VIRTIO_PCI_ISR_QUEUE) vnet_recv(0);
+}
+
+// ------------------------------------------------------------
+// tx_reclaim()
+// Take back the chains the device has sent: free their buffers and
+// put their descriptors on the free list. TX interrupts are off,
+// so this runs before each send. Caller holds txq.lock.
+// ------------------------------------------------------------
+static void
+tx_reclaim(void) {
+    struct vring_used_elem* e;
+
+    while ((e = vq_used(&txq)) != 0) {
+        int i = e->id;
+        for (;;) {
+            int flags = txq.desc[i].flags;
+            int next = txq.desc[i].next;
+            if (txq.bufs[i]) {
+                mbuf_free(txq.bufs[i]);
+                txq.bufs[i] = 0;
+            }
+            txq.desc[i].next = txq.free_head;
+            txq.free_head = i;
+            txq.nfree++;
+            if ((flags & VRING_DESC_F_NEXT) == 0) break;
+            i = next;
+        }
+    }
+}
+
+// Take a descriptor off the free list. Caller holds txq.lock.
+static int
+tx_desc_alloc(void) {
+    int i = txq.free_head;
+    txq.free_head = txq.desc[i].next;
+    txq.nfree--;
+    return i;
+}
+
+// Post one frame: the shared header, then one descriptor per mbuf.
+// Caller holds txq.lock and has checked txq.nfree.
+static void
+tx_put(struct mbuf* m) {
+    int head = tx_desc_alloc();
+    int prev = head;
+
+    txq.desc[head].addr = V2P(&tx_hdr);
+    txq.desc[head].len = hdrlen;
+    txq.desc[head].flags = VRING_DESC_F_NEXT;
+    txq.bufs[head] = 0;
+
+    while (m) {
+        struct mbuf* next = m->next;
+        int i = tx_desc_alloc();
+
+        txq.desc[prev].next = i;
+        txq.desc[i].addr = V2P(m->data);
+        txq.desc[i].len = m->len;
+        txq.desc[i].flags = next ? VRING_DESC_F_NEXT : 0;
+        txq.bufs[i] = m;
+        prev = i;
+        m = next;
+    }
+    vq_push(&txq, head);
+}
+
+// ------------------------------------------------------------
+// virtio_net_transmit_batch()
+// netdev xmit_batch(): post n frames (mbuf chains) and notify the
+// device once. No checksum offload, so m->csum is ignored. Returns
+// how many were queued; the caller still owns the rest.
+// ------------------------------------------------------------
+static int
+virtio_net_transmit_batch(struct mbuf** pkts, int n) {
+    int i;
+
+    acquire(&txq.lock);
+    tx_reclaim();
+    for (i = 0; i < n; i++) {
+        int nsegs = 0, total = 0;
+        for (struct mbuf* m = pkts[i]; m; m = m->next) {
+            nsegs++;
+            total += m->len;
+        }
+        if (nsegs == 0 || nsegs > TX_MAX_FRAGS || total > VNET_MAXFRAME)
+            break;
+        if (txq.nfree < nsegs + 1) {
+            vnet_stats.tx_ring_full++;
+            break;
+        }
+        tx_put(pkts[i]);
+        vnet_stats.tx_packets++;
+        vnet_stats.tx_bytes += total;
+    }
+    if (i > 0) vq_kick(&txq);
+    release(&txq.lock);
+    return i;
+}
+
+// netdev xmit(): send one frame; 0, or -1 if it is bad or the ring
+// is full (the caller then still owns m).
+static int
+virtio_net_transmit(struct mbuf* m) {
+    return virtio_net_transmit_batch(&m, 1) == 1 ? 0 : -1;
+}
+
+static int
+virtio_net_mtu(void) {
+    return ETH_MTU;
+}
+
+// The device is promiscuous without a control queue, so every
+// multicast frame arrives anyway and ip_rx() does the filtering.
+static int
+virtio_net_mcast(uchar* mac) {
+    return 0;
+}
+
+// NETCTL_IRQCPU with a fixed CPU moves the interrupt.
+static int
+virtio_net_ctl(int cmd, int arg) {
+    switch (cmd) {
+        case NETCTL_IRQCPU:
+            if (arg < 0 || arg >= ncpu || !cpus[arg].started) return -1;
+            pci_intr_set_cpu(vnet_pcif, arg);
+            return 0;
+    }
+    return -1;
+}
+
+static void
+virtio_net_getstats(struct netstat* st) {
+    st->interrupts = vnet_stats.interrupts;
+    for (int c = 0; c < NCPU && c < NETSTAT_NCPU; c++)
+        st->intr_cpu[c] = vnet_stats.intr_cpu[c];
+    st->irq_cpu = vnet_pcif->cpu;
+    st->rx_packets = vnet_stats.rx_packets;
+    st->rx_bytes = vnet_stats.rx_bytes;
+    st->rx_nomem = vnet_stats.rx_nomem;
+    st->tx_packets = vnet_stats.tx_packets;
+    st->tx_bytes = vnet_stats.tx_bytes;
+    st->tx_ring_full = vnet_stats.tx_ring_full;
+}
+
+// Print driver counters to the console (see net_debug()).
+static void
+virtio_net_dump(void) {
+    cprintf("virtio_net: rx ring %d tx ring %d hdr %d, interrupts %d "
+            "on cpu %d\n",
+            rxq.num, txq.num, hdrlen, (int)vnet_stats.interrupts,
+            vnet_pcif->cpu);
+    cprintf("virtio_net: rx %d pkts %d bytes, merged %d, dropped nomem %d "
+            "too long %d\n",
+            (int)vnet_stats.rx_packets, (int)vnet_stats.rx_bytes,
+            (int)vnet_stats.rx_merged, (int)vnet_stats.rx_nomem,
+            (int)vnet_stats.rx_too_long);
+    cprintf("virtio_net: tx %d pkts %d bytes, kicks %d, ring full %d\n",
+            (int)vnet_stats.tx_packets, (int)vnet_stats.tx_bytes,
+            (int)vnet_stats.tx_kicks, (int)vnet_stats.tx_ring_full);
+}
+
+// The device as the stack sees it, see netdev.h.
+static struct netdev virtio_net_netdev = {
+    "virtio-net",
+    NETDEV_F_MCAST,
+    virtio_net_transmit,
+    virtio_net_transmit_batch,
+    virtio_net_rx_poll,
+    virtio_net_mtu,
+    virtio_net_getstats,
+    virtio_net_ctl,
+    virtio_net_dump,
+    virtio_net_mcast,
+    virtio_net_mcast,
+};
+
+// ------------------------------------------------------------
+// virtio_net_attach()
+// Called by pci_init() for a virtio-net function: reset it,
+// negotiate features, set up both queues [virtio 3.1.1], post the
+// RX buffers and take the interrupt on CPU 0.
+// ------------------------------------------------------------
+int
+virtio_net_attach(struct pci_func* f) {
+    pci_func_enable(f);
+    if (!f->reg_io[0]) return -1;
+    iobase = f->reg_base[0];
+    vnet_pcif = f;
+
+    outb(iobase + VIRTIO_PCI_STATUS, 0);  // reset
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    uint features = inl(iobase + VIRTIO_PCI_HOST_FEATURES);
+    features &= VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF;
+    outl(iobase + VIRTIO_PCI_GUEST_FEATURES, features);
+    hdrlen = (features & VIRTIO_NET_F_MRG_RXBUF) ? VIRTIO_NET_HDR_MRG_LEN
+                                                 : VIRTIO_NET_HDR_LEN;
+
+    if (vq_init(&rxq, VIRTIO_NET_RXQ, vq_mem[0], "vnet.rx") < 0 ||
+        vq_init(&txq, VIRTIO_NET_TXQ, vq_mem[1], "vnet.tx") < 0) {
+        cprintf("virtio_net: bad queue size\n");
+        outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+    txq.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;  // reclaim on send
+    rx_fill();
+
+    if (features & VIRTIO_NET_F_MAC) {
+        uchar mac[ETHADDR_LEN];
+        for (int i = 0; i < ETHADDR_LEN; i++)
+            mac[i] = inb(iobase + VIRTIO_PCI_CONFIG + i);
+        cprintf("virtio_net: mac %x:%x:%x:%x:%x:%x, %s rx buffers\n",
+                mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+                hdrlen == VIRTIO_NET_HDR_MRG_LEN ? "mergeable" : "plain");
+    }
+
+    if (pci_intr_enable(f, virtio_net_intr, 0) < 0) {
+        cprintf("virtio_net: no interrupt\n");
+        outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    outb(iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK |
+         VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    acquire(&rxq.lock);
+    vq_kick(&rxq);
+    release(&rxq.lock);
+
+    netdev_register(&virtio_net_netdev);
+    return 0;
+}
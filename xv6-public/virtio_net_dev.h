@@ -0,0 +1,85 @@
+//
+// virtio-net hardware definitions: the legacy virtio PCI register
+// block, split virtqueue layout and the virtio-net packet header.
+// From the virtio 1.0 spec, sections 2.4 (virtqueues), 4.1.4.8
+// (legacy PCI interface) and 5.1 (network device). QEMU:
+// -device virtio-net-pci.
+//
+// NOTE: registers are I/O port offsets from BAR0.
+//
+#pragma once
+
+/* Legacy PCI registers, without MSI-X */
+#define VIRTIO_PCI_HOST_FEATURES 0x00  /* device features - R, 32 */
+#define VIRTIO_PCI_GUEST_FEATURES 0x04 /* driver features - RW, 32 */
+#define VIRTIO_PCI_QUEUE_PFN 0x08      /* ring address >> 12 - RW, 32 */
+#define VIRTIO_PCI_QUEUE_NUM 0x0C      /* ring size - R, 16 */
+#define VIRTIO_PCI_QUEUE_SEL 0x0E      /* queue select - RW, 16 */
+#define VIRTIO_PCI_QUEUE_NOTIFY 0x10   /* queue notify - W, 16 */
+#define VIRTIO_PCI_STATUS 0x12         /* device status - RW, 8 */
+#define VIRTIO_PCI_ISR 0x13            /* interrupt status - RC, 8 */
+#define VIRTIO_PCI_CONFIG 0x14         /* device config space */
+
+#define VIRTIO_PCI_QUEUE_ALIGN 4096 /* legacy ring alignment */
+#define VIRTIO_PCI_ISR_QUEUE 0x1    /* a used ring was updated */
+
+/* Device status */
+#define VIRTIO_STATUS_ACK 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FAILED 128
+
+/* virtio-net feature bits */
+#define VIRTIO_NET_F_MAC (1 << 5)         /* config has the MAC address */
+#define VIRTIO_NET_F_MRG_RXBUF (1 << 15)  /* frames may span RX buffers */
+
+/* virtio-net queues */
+#define VIRTIO_NET_RXQ 0
+#define VIRTIO_NET_TXQ 1
+
+/* Split virtqueue [virtio 2.4] */
+struct vring_desc {
+    uint64 addr;  /* buffer address (PHYS) */
+    uint32 len;
+    ushort flags;
+    ushort next;  /* next descriptor with VRING_DESC_F_NEXT */
+};
+
+#define VRING_DESC_F_NEXT 1  /* buffer continues in next */
+#define VRING_DESC_F_WRITE 2 /* device writes (RX), else reads */
+
+struct vring_avail {
+    ushort flags;
+    ushort idx;     /* where the driver puts the next entry */
+    ushort ring[];  /* descriptor chain heads */
+};
+
+#define VRING_AVAIL_F_NO_INTERRUPT 1 /* don't interrupt on used */
+
+struct vring_used_elem {
+    uint32 id;   /* head of the chain the device is done with */
+    uint32 len;  /* bytes written into it */
+};
+
+struct vring_used {
+    ushort flags;
+    ushort idx;  /* where the device puts the next entry */
+    struct vring_used_elem ring[];
+};
+
+#define VRING_USED_F_NO_NOTIFY 1 /* don't kick after adding buffers */
+
+/* Header in front of every frame [virtio 5.1.6]. num_buffers is
+   only there with VIRTIO_NET_F_MRG_RXBUF. */
+struct virtio_net_hdr {
+    uchar flags;
+    uchar gso_type;
+    ushort hdr_len;
+    ushort gso_size;
+    ushort csum_start;
+    ushort csum_offset;
+    ushort num_buffers;  /* RX buffers this frame spans */
+};
+
+#define VIRTIO_NET_HDR_LEN 10     /* without num_buffers */
+#define VIRTIO_NET_HDR_MRG_LEN 12 /* with num_buffers */
@@ -107,6 +107,15 @@ readeflags(void)
   return eflags;
 }
 
+// CPU timestamp counter
+static inline uint64
+rdtsc(void)
+{
+  uint lo, hi;
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64)hi << 32) | lo;
+}
+
 static inline void
 cli(void)
 {
@@ -184,6 +193,15 @@ struct trapframe {
 
 
 
+// 16-bit port input
+static inline ushort
+inw(ushort port)
+{
+  ushort data;
+  asm volatile("inw %1,%0" : "=a"(data) : "d"(port));
+  return data;
+}
+
 // 32-bit port input
 static inline uint
 inl(ushort port)